@@ -0,0 +1,422 @@
+use crate::message_stream::MessageStream;
+use crate::messages::*;
+use crate::output_pipe::{self, BufferPool, OverflowPolicy};
+use anyhow::*;
+use core::result::Result::Ok;
+use std::collections::VecDeque;
+use std::io::{Read, Write};
+use std::net::{TcpListener, TcpStream};
+use std::process::{Command, Stdio};
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+/// How long each benchmark case is run
+const BENCH_TIME: Duration = Duration::from_secs(1);
+/// Number of messages written before they are read back in the framing benchmark
+const FRAMING_BATCH: usize = 64;
+/// Total size sent in each bulk upload case
+const UPLOAD_SIZE: usize = 64 * 1024 * 1024;
+/// Amount of output written by the child in the stdout forwarding benchmark
+const STDOUT_SIZE: usize = 256 * 1024 * 1024;
+
+/// In memory stream where everything written can be read back. Reads from an empty stream
+/// would block like a non-blocking socket does.
+#[derive(Default)]
+struct MemoryStream {
+    data: VecDeque<u8>,
+}
+
+impl Read for MemoryStream {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        if self.data.is_empty() && !buf.is_empty() {
+            return Err(std::io::ErrorKind::WouldBlock.into());
+        }
+        self.data.read(buf)
+    }
+}
+
+impl Write for MemoryStream {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        self.data.extend(buf);
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+}
+
+/// Kind of data sent in the benchmarks, matters when compression is enabled
+#[derive(Clone, Copy)]
+enum Data {
+    /// Text like output that compresses well
+    Text,
+    /// Random data that doesn't compress at all
+    Random,
+}
+
+/// How messages are sent in a benchmark case
+#[derive(Clone, Copy)]
+enum Mode {
+    Plain,
+    Zstd(Data),
+    Checksum,
+}
+
+impl Mode {
+    /// Data to send, random unless it's a compression case
+    fn data(self, size: usize) -> Vec<u8> {
+        match self {
+            Mode::Zstd(kind) => make_data(kind, size),
+            _ => make_data(Data::Random, size),
+        }
+    }
+
+    fn label(self) -> &'static str {
+        match self {
+            Mode::Plain => "",
+            Mode::Zstd(Data::Text) => "zstd text",
+            Mode::Zstd(Data::Random) => "zstd random",
+            Mode::Checksum => "checksum",
+        }
+    }
+
+    fn apply(self, msg_stream: &mut MessageStream) {
+        msg_stream.set_compression(matches!(self, Mode::Zstd(_)));
+        msg_stream.set_checksum(matches!(self, Mode::Checksum));
+    }
+}
+
+fn make_data(kind: Data, size: usize) -> Vec<u8> {
+    match kind {
+        Data::Text => b"test 123: the quick brown fox jumps over the lazy dog\n"
+            .iter()
+            .cycle()
+            .take(size)
+            .copied()
+            .collect(),
+        Data::Random => {
+            // xorshift, good enough to defeat the compressor
+            let mut state = 0x2545_f491_4f6c_dd1du64;
+            (0..size)
+                .map(|_| {
+                    state ^= state << 13;
+                    state ^= state >> 7;
+                    state ^= state << 17;
+                    state as u8
+                })
+                .collect()
+        }
+    }
+}
+
+fn mb_per_sec(bytes: usize, elapsed: Duration) -> f64 {
+    bytes as f64 / (1024.0 * 1024.0) / elapsed.as_secs_f64()
+}
+
+/// Writes messages with `size` bytes of payload to a MessageStream and reads them back
+/// from another one over an in memory stream. Measures the framing (and compression or
+/// checksum) cost without any syscalls.
+fn framing(size: usize, mode: Mode) -> Result<()> {
+    let pool = Arc::new(BufferPool::default());
+    let data = mode.data(size);
+
+    let mut stream = MemoryStream::default();
+    let mut writer = MessageStream::new();
+    let mut reader = MessageStream::new();
+    writer.set_payload_pool(pool);
+    mode.apply(&mut writer);
+
+    let mut messages = 0;
+    let start = Instant::now();
+
+    while start.elapsed() < BENCH_TIME {
+        for _ in 0..FRAMING_BATCH {
+            writer.begin_write_message_with_payload(
+                &mut stream,
+                &0u32,
+                vec![data.clone()],
+                Messages::StdoutOutput,
+            )?;
+        }
+
+        for _ in 0..FRAMING_BATCH {
+            match reader.update(&mut stream)? {
+                Some(Messages::StdoutOutput) => {
+                    let msg: TextMessage = bincode::deserialize(reader.data())?;
+                    assert_eq!(msg.data.len(), size);
+                }
+                msg => bail!("Unexpected message {:?}", msg),
+            }
+        }
+
+        messages += FRAMING_BATCH;
+    }
+
+    let elapsed = start.elapsed();
+
+    println!(
+        "framing {:>8} bytes {:<12} {:>10.1} MB/s {:>10.0} msg/s",
+        size,
+        mode.label(),
+        mb_per_sec(messages * size, elapsed),
+        messages as f64 / elapsed.as_secs_f64()
+    );
+
+    Ok(())
+}
+
+/// Connected pair of TCP streams on loopback
+fn loopback() -> Result<(TcpStream, TcpStream)> {
+    let listener = TcpListener::bind("127.0.0.1:0")?;
+    let client = TcpStream::connect(listener.local_addr()?)?;
+    let (server, _) = listener.accept()?;
+    Ok((client, server))
+}
+
+/// Sends small messages over loopback TCP that are echoed back and measures the round trip
+fn round_trip(size: usize) -> Result<()> {
+    let (mut client, mut server) = loopback()?;
+
+    let echo = thread::spawn(move || -> Result<()> {
+        let mut msg_stream = MessageStream::new();
+        let mut reply = Vec::new();
+
+        loop {
+            match msg_stream.update(&mut server)? {
+                Some(Messages::StdoutOutput) => {
+                    reply.clear();
+                    reply.extend_from_slice(msg_stream.data());
+                    let msg: TextMessage = bincode::deserialize(&reply)?;
+                    msg_stream.begin_write_message(&mut server, &msg, Messages::StdoutOutput)?;
+                }
+                Some(Messages::StopExecutableRequest) => return Ok(()),
+                _ => (),
+            }
+        }
+    });
+
+    let data = make_data(Data::Text, size);
+    let mut msg_stream = MessageStream::new();
+    let mut times = Vec::new();
+    let start = Instant::now();
+
+    while start.elapsed() < BENCH_TIME {
+        let sent = Instant::now();
+        let msg = TextMessage { id: 0, data: &data };
+        msg_stream.begin_write_message(&mut client, &msg, Messages::StdoutOutput)?;
+
+        while msg_stream.update(&mut client)?.is_none() {}
+
+        times.push(sent.elapsed());
+    }
+
+    msg_stream.begin_write_message(
+        &mut client,
+        &StopExecutableRequest::default(),
+        Messages::StopExecutableRequest,
+    )?;
+    echo.join().unwrap()?;
+
+    times.sort();
+
+    let percentile = |p: usize| times[(times.len() - 1) * p / 100].as_secs_f64() * 1e6;
+
+    println!(
+        "round trip {:>5} bytes {:>10} trips p50 {:>8.1} us p99 {:>8.1} us",
+        size,
+        times.len(),
+        percentile(50),
+        percentile(99)
+    );
+
+    Ok(())
+}
+
+/// Streams `UPLOAD_SIZE` bytes in ExecutableUploadChunk messages of `chunk_size` over loopback
+/// TCP like the host does when uploading an executable
+fn upload(chunk_size: usize, mode: Mode) -> Result<()> {
+    let (mut client, mut server) = loopback()?;
+
+    let receiver = thread::spawn(move || -> Result<u64> {
+        let mut msg_stream = MessageStream::new();
+        let mut received = 0u64;
+
+        loop {
+            match msg_stream.update(&mut server)? {
+                Some(Messages::ExecutableUploadChunk) => {
+                    let msg: TextMessage = bincode::deserialize(msg_stream.data())?;
+                    received += msg.data.len() as u64;
+                }
+                Some(Messages::ExecutableUploadEnd) => {
+                    let reply = ExecutableUploadReply {
+                        id: 0,
+                        cached: false,
+                        signature: None,
+                    };
+                    msg_stream.begin_write_message(
+                        &mut server,
+                        &reply,
+                        Messages::ExecutableUploadReply,
+                    )?;
+                    return Ok(received);
+                }
+                _ => (),
+            }
+        }
+    });
+
+    let pool = Arc::new(BufferPool::default());
+    let data = mode.data(chunk_size);
+    let mut msg_stream = MessageStream::new();
+    msg_stream.set_payload_pool(pool.clone());
+    mode.apply(&mut msg_stream);
+
+    let start = Instant::now();
+    let mut sent = 0;
+
+    while sent < UPLOAD_SIZE {
+        let mut buffer = pool.get();
+        buffer.extend_from_slice(&data);
+        msg_stream.begin_write_message_with_payload(
+            &mut client,
+            &0u32,
+            vec![buffer],
+            Messages::ExecutableUploadChunk,
+        )?;
+        sent += chunk_size;
+    }
+
+    msg_stream.begin_write_message(
+        &mut client,
+        &ExecutableUploadEnd { id: 0 },
+        Messages::ExecutableUploadEnd,
+    )?;
+
+    while msg_stream.update(&mut client)? != Some(Messages::ExecutableUploadReply) {}
+
+    let elapsed = start.elapsed();
+    let received = receiver.join().unwrap()?;
+    ensure!(received as usize == sent, "Upload lost data");
+
+    println!(
+        "upload {:>8} byte chunks {:<12} {:>10.1} MB/s",
+        chunk_size,
+        mode.label(),
+        mb_per_sec(sent, elapsed)
+    );
+
+    Ok(())
+}
+
+/// Forwards the output of a child that writes as fast as it can over loopback TCP the way the
+/// runner does (pipe reader thread, coalesced chunks sent straight from the pipe buffers)
+fn stdout_forwarding(compression: bool) -> Result<()> {
+    let (mut client, mut server) = loopback()?;
+
+    let receiver = thread::spawn(move || -> Result<u64> {
+        let mut msg_stream = MessageStream::new();
+        let mut received = 0u64;
+
+        loop {
+            match msg_stream.update(&mut server)? {
+                Some(Messages::StdoutOutput) => {
+                    let msg: TextMessage = bincode::deserialize(msg_stream.data())?;
+                    received += msg.data.len() as u64;
+                }
+                Some(Messages::ExecutableExited) => return Ok(received),
+                _ => (),
+            }
+        }
+    });
+
+    let start = Instant::now();
+
+    let mut child = Command::new("sh")
+        .arg("-c")
+        .arg(format!("head -c {} /dev/zero", STDOUT_SIZE))
+        .stdout(Stdio::piped())
+        .spawn()?;
+
+    let pool = Arc::new(BufferPool::default());
+    let (tx, rx) = output_pipe::output_queue(OverflowPolicy::Block, pool.clone());
+    output_pipe::spawn_reader(
+        child.stdout.take().unwrap(),
+        pool.clone(),
+        tx,
+        None,
+        output_pipe::COALESCE_TIMEOUT,
+    );
+
+    let mut msg_stream = MessageStream::new();
+    msg_stream.set_payload_pool(pool);
+    msg_stream.set_compression(compression);
+
+    let mut sent = 0;
+
+    // Blocks for the next chunk and then batches up whatever else is available
+    while let Some(chunk) = rx.recv() {
+        let mut chunks = vec![chunk];
+        while let Ok(chunk) = rx.try_recv() {
+            chunks.push(chunk);
+        }
+        sent += chunks.iter().map(|c| c.len()).sum::<usize>();
+        msg_stream.begin_write_message_with_payload(
+            &mut client,
+            &0u32,
+            chunks,
+            Messages::StdoutOutput,
+        )?;
+    }
+
+    child.wait()?;
+
+    let exited = ExecutableExited {
+        id: 0,
+        exit_code: Some(0),
+        signal: None,
+        wall_time_us: 0,
+        usage: None,
+    };
+    msg_stream.begin_write_message(&mut client, &exited, Messages::ExecutableExited)?;
+
+    let received = receiver.join().unwrap()?;
+    let elapsed = start.elapsed();
+    ensure!(received as usize == sent, "Output lost data");
+
+    println!(
+        "stdout forwarding {:<12} {:>10.1} MB/s",
+        if compression { "zstd" } else { "" },
+        mb_per_sec(sent, elapsed)
+    );
+
+    Ok(())
+}
+
+/// Runs all of the benchmarks and prints the results. Everything runs locally so it can be run
+/// on the runner as well as the host to compare them.
+pub fn run() -> Result<()> {
+    for size in [64, 1024, 64 * 1024, 1024 * 1024] {
+        framing(size, Mode::Plain)?;
+    }
+    framing(64 * 1024, Mode::Zstd(Data::Text))?;
+    framing(64 * 1024, Mode::Zstd(Data::Random))?;
+    framing(64 * 1024, Mode::Checksum)?;
+
+    for size in [16, 1024] {
+        round_trip(size)?;
+    }
+
+    for chunk_size in [4 * 1024, 16 * 1024, CHUNK_SIZE] {
+        upload(chunk_size, Mode::Plain)?;
+    }
+    upload(CHUNK_SIZE, Mode::Zstd(Data::Text))?;
+    upload(CHUNK_SIZE, Mode::Zstd(Data::Random))?;
+    upload(CHUNK_SIZE, Mode::Checksum)?;
+
+    stdout_forwarding(false)?;
+    stdout_forwarding(true)?;
+
+    Ok(())
+}
@@ -0,0 +1,397 @@
+use crate::messages::{BlockSignature, Signature};
+use anyhow::*;
+use core::result::Result::Ok;
+use std::{collections::HashMap, io::Read};
+use xxhash_rust::xxh3::xxh3_64;
+
+/// Executables smaller than this are always uploaded in full
+pub const MIN_DELTA_SIZE: u64 = 1024 * 1024;
+
+/// Size of the quick lookup table (in bits) used to skip positions without any matching block
+const FILTER_BITS: usize = 1 << 20;
+
+/// Number of blocks read ahead of the current block when looking for matches
+const READ_AHEAD_BLOCKS: usize = 64;
+
+/// Instructions for building the new executable on the runner
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub enum DeltaOp {
+    /// Data at `offset` in the new executable that has to be sent
+    Literal { offset: u64, len: u64 },
+    /// `count` blocks starting with `block` that the runner copies from the old executable
+    Copy { block: u32, count: u32 },
+}
+
+/// Block size to use for an executable in the same way as rsync does (about the square root of
+/// the size) so the signature stays small for large executables.
+pub fn block_size_for(size: u64) -> usize {
+    ((size as f64).sqrt() as usize)
+        .next_power_of_two()
+        .clamp(2 * 1024, 64 * 1024)
+}
+
+/// Adler-32 like checksum that can be moved over the data one byte at a time
+struct RollingChecksum {
+    a: u32,
+    b: u32,
+    len: u32,
+}
+
+impl RollingChecksum {
+    fn new(block: &[u8]) -> RollingChecksum {
+        let len = block.len() as u32;
+        let mut a = 0u32;
+        let mut b = 0u32;
+
+        for (i, &x) in block.iter().enumerate() {
+            a = a.wrapping_add(x as u32);
+            b = b.wrapping_add((len - i as u32).wrapping_mul(x as u32));
+        }
+
+        RollingChecksum { a, b, len }
+    }
+
+    /// Moves the window one byte forward, `out` is leaving and `inp` entering the window
+    #[inline]
+    fn roll(&mut self, out: u8, inp: u8) {
+        self.a = self.a.wrapping_sub(out as u32).wrapping_add(inp as u32);
+        self.b = self
+            .b
+            .wrapping_sub(self.len.wrapping_mul(out as u32))
+            .wrapping_add(self.a);
+    }
+
+    #[inline]
+    fn digest(&self) -> u32 {
+        (self.a & 0xffff) | (self.b << 16)
+    }
+}
+
+#[inline]
+fn filter_index(weak: u32) -> usize {
+    (weak.wrapping_mul(0x9e37_79b1) >> 12) as usize & (FILTER_BITS - 1)
+}
+
+/// Calculates the signature of all full blocks in `reader`
+pub fn signature<R: Read>(reader: &mut R, size: u64) -> Result<Signature> {
+    let block_size = block_size_for(size);
+    let mut block = vec![0u8; block_size];
+    let mut blocks = Vec::with_capacity((size / block_size as u64) as usize);
+
+    for _ in 0..size / block_size as u64 {
+        reader.read_exact(&mut block)?;
+        blocks.push(BlockSignature {
+            weak: RollingChecksum::new(&block).digest(),
+            strong: xxh3_64(&block),
+        });
+    }
+
+    Ok(Signature {
+        block_size: block_size as u32,
+        blocks,
+    })
+}
+
+/// Part of the new executable around the position that is being matched, so it doesn't have to
+/// be read into memory all at once
+struct Window<'a, R> {
+    reader: &'a mut R,
+    buf: Vec<u8>,
+    capacity: usize,
+    /// Offset in the executable of the start of `buf`
+    start: u64,
+    /// Bytes of the executable that hasn't been read yet
+    remaining: u64,
+}
+
+impl<'a, R: Read> Window<'a, R> {
+    fn new(reader: &'a mut R, size: u64, capacity: usize) -> Window<'a, R> {
+        Window {
+            reader,
+            buf: Vec::with_capacity(capacity),
+            capacity,
+            start: 0,
+            remaining: size,
+        }
+    }
+
+    /// Makes sure that the `len` bytes at `pos` are in the window. Everything before `pos` is
+    /// dropped, so `pos` may never go backwards.
+    fn fill(&mut self, pos: u64, len: usize) -> Result<()> {
+        if pos + len as u64 <= self.start + self.buf.len() as u64 {
+            return Ok(());
+        }
+
+        self.buf.drain(..(pos - self.start) as usize);
+        self.start = pos;
+
+        let old_len = self.buf.len();
+        let size = ((self.capacity - old_len) as u64).min(self.remaining) as usize;
+        self.buf.resize(old_len + size, 0);
+        self.reader.read_exact(&mut self.buf[old_len..])?;
+        self.remaining -= size as u64;
+
+        ensure!(self.buf.len() >= len, "Executable ended early");
+        Ok(())
+    }
+
+    #[inline]
+    fn get(&self, pos: u64, len: usize) -> &[u8] {
+        let start = (pos - self.start) as usize;
+        &self.buf[start..start + len]
+    }
+
+    #[inline]
+    fn byte(&self, pos: u64) -> u8 {
+        self.buf[(pos - self.start) as usize]
+    }
+}
+
+/// Adds a copy of `block` to the ops, merging it with the previous copy if possible
+fn push_copy(ops: &mut Vec<DeltaOp>, block: u32) {
+    if let Some(DeltaOp::Copy {
+        block: start,
+        count,
+    }) = ops.last_mut()
+    {
+        if *start + *count == block {
+            *count += 1;
+            return;
+        }
+    }
+
+    ops.push(DeltaOp::Copy { block, count: 1 });
+}
+
+/// Finds the blocks of the old executable (given by `sig`) in the `size` bytes of `reader` and
+/// returns the ops needed to build the new executable on the runner. Only a window of blocks is
+/// kept in memory at a time.
+pub fn compute_delta<R: Read>(reader: &mut R, size: u64, sig: &Signature) -> Result<Vec<DeltaOp>> {
+    let block_size = sig.block_size as usize;
+    let mut ops = Vec::new();
+
+    if block_size == 0 || size < block_size as u64 || sig.blocks.is_empty() {
+        ops.push(DeltaOp::Literal {
+            offset: 0,
+            len: size,
+        });
+        return Ok(ops);
+    }
+
+    let block_len = block_size as u64;
+    let mut window = Window::new(reader, size, block_size * (READ_AHEAD_BLOCKS + 1));
+
+    let mut filter = vec![0u64; FILTER_BITS / 64];
+    let mut lookup: HashMap<u32, Vec<u32>> = HashMap::new();
+
+    for (i, block) in sig.blocks.iter().enumerate() {
+        let index = filter_index(block.weak);
+        filter[index / 64] |= 1 << (index % 64);
+        lookup.entry(block.weak).or_default().push(i as u32);
+    }
+
+    let mut literal_start = 0;
+    let mut pos = 0;
+    window.fill(pos, block_size)?;
+    let mut rolling = RollingChecksum::new(window.get(pos, block_size));
+
+    loop {
+        let weak = rolling.digest();
+        let index = filter_index(weak);
+        let mut matched = None;
+
+        if filter[index / 64] & (1 << (index % 64)) != 0 {
+            if let Some(candidates) = lookup.get(&weak) {
+                let strong = xxh3_64(window.get(pos, block_size));
+
+                // Prefer the block following the previous copy so copies can be merged
+                let next = match ops.last() {
+                    Some(DeltaOp::Copy { block, count }) if literal_start == pos => {
+                        Some(block + count)
+                    }
+                    _ => None,
+                };
+
+                matched = candidates
+                    .iter()
+                    .copied()
+                    .filter(|&i| sig.blocks[i as usize].strong == strong)
+                    .max_by_key(|&i| Some(i) == next);
+            }
+        }
+
+        if let Some(block) = matched {
+            if literal_start < pos {
+                ops.push(DeltaOp::Literal {
+                    offset: literal_start,
+                    len: pos - literal_start,
+                });
+            }
+
+            push_copy(&mut ops, block);
+
+            pos += block_len;
+            literal_start = pos;
+
+            if pos + block_len > size {
+                break;
+            }
+
+            window.fill(pos, block_size)?;
+            rolling = RollingChecksum::new(window.get(pos, block_size));
+        } else {
+            if pos + block_len >= size {
+                break;
+            }
+
+            window.fill(pos, block_size + 1)?;
+            rolling.roll(window.byte(pos), window.byte(pos + block_len));
+            pos += 1;
+        }
+    }
+
+    if literal_start < size {
+        ops.push(DeltaOp::Literal {
+            offset: literal_start,
+            len: size - literal_start,
+        });
+    }
+
+    Ok(ops)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Data without repeating blocks
+    fn random(size: usize, seed: u64) -> Vec<u8> {
+        let mut state = seed | 1;
+        (0..size)
+            .map(|_| {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                state as u8
+            })
+            .collect()
+    }
+
+    /// Builds the new executable from `old` and `ops` the way the runner does
+    fn apply(old: &[u8], new: &[u8], ops: &[DeltaOp], block_size: usize) -> Vec<u8> {
+        let mut out = Vec::new();
+
+        for op in ops {
+            match *op {
+                DeltaOp::Literal { offset, len } => {
+                    out.extend_from_slice(&new[offset as usize..(offset + len) as usize])
+                }
+                DeltaOp::Copy { block, count } => {
+                    let start = block as usize * block_size;
+                    out.extend_from_slice(&old[start..start + count as usize * block_size]);
+                }
+            }
+        }
+
+        out
+    }
+
+    /// Computes the delta from `old` to `new`, checks that it rebuilds `new` and returns the
+    /// ops and the number of literal bytes
+    fn delta(old: &[u8], new: &[u8]) -> (Vec<DeltaOp>, u64) {
+        let sig = signature(&mut &old[..], old.len() as u64).unwrap();
+        let ops = compute_delta(&mut &new[..], new.len() as u64, &sig).unwrap();
+
+        assert!(apply(old, new, &ops, sig.block_size as usize) == new);
+
+        let literal = ops
+            .iter()
+            .map(|op| match op {
+                DeltaOp::Literal { len, .. } => *len,
+                DeltaOp::Copy { .. } => 0,
+            })
+            .sum();
+
+        (ops, literal)
+    }
+
+    #[test]
+    fn identical_file_is_copied() {
+        let block_size = block_size_for(256 * 1024);
+        let old = random(256 * 1024, 1);
+
+        let (ops, literal) = delta(&old, &old);
+        let count = (old.len() / block_size) as u32;
+        assert_eq!(ops, [DeltaOp::Copy { block: 0, count }]);
+        assert_eq!(literal, 0);
+    }
+
+    #[test]
+    fn trailing_partial_block_is_sent() {
+        let block_size = block_size_for(10 * 2048 + 100);
+        assert_eq!(block_size, 2048);
+
+        let old = random(10 * block_size + 100, 2);
+        let (ops, literal) = delta(&old, &old);
+        assert_eq!(
+            ops,
+            [
+                DeltaOp::Copy {
+                    block: 0,
+                    count: 10
+                },
+                DeltaOp::Literal {
+                    offset: 10 * block_size as u64,
+                    len: 100
+                }
+            ]
+        );
+        assert_eq!(literal, 100);
+    }
+
+    #[test]
+    fn inserted_byte_costs_at_most_a_block() {
+        let old = random(256 * 1024, 3);
+        let block_size = block_size_for(old.len() as u64) as u64;
+
+        for at in [0, 100 * 1024 + 17, old.len()] {
+            let mut new = old.clone();
+            new.insert(at, 0x5a);
+
+            let (_, literal) = delta(&old, &new);
+            assert!(
+                literal >= 1 && literal <= block_size + 1,
+                "{} at {}",
+                literal,
+                at
+            );
+        }
+    }
+
+    #[test]
+    fn file_shorter_than_a_block_is_sent_in_full() {
+        let old = random(256 * 1024, 4);
+        let new = random(1000, 5);
+        let (ops, literal) = delta(&old, &new);
+        assert_eq!(ops.len(), 1);
+        assert_eq!(literal, 1000);
+
+        // An old version shorter than a block has nothing to copy from
+        let old = random(1000, 6);
+        let (ops, literal) = delta(&old, &old);
+        assert_eq!(ops.len(), 1);
+        assert_eq!(literal, 1000);
+    }
+
+    #[test]
+    fn changed_file_is_rebuilt() {
+        let old = random(300 * 1024 + 123, 7);
+        let mut new = old.clone();
+        new.drain(10_000..12_000);
+        new[150_000..151_000].copy_from_slice(&random(1000, 8));
+        new.extend_from_slice(&random(5000, 9));
+
+        let (_, literal) = delta(&old, &new);
+        assert!(literal < 20 * 1024, "{} literal bytes", literal);
+    }
+}
@@ -0,0 +1,391 @@
+use anyhow::*;
+use core::result::Result::Ok;
+use log::{error, info, trace};
+use std::{
+    collections::HashMap,
+    ffi::CString,
+    fs::File,
+    os::unix::io::{AsRawFd, FromRawFd},
+    path::{Path, PathBuf},
+    sync::atomic::{AtomicU64, Ordering},
+    sync::Arc,
+    time::SystemTime,
+};
+
+/// Content hash (SHA-256) used to identify executables
+pub type Hash = [u8; 32];
+
+/// File in the cache directory that maps host paths to the latest executable uploaded for them
+const PATHS_INDEX: &str = "paths.index";
+
+/// Used to give partial uploads unique names so concurrent uploads don't collide
+static PARTIAL_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// Directory used for the cache in memory mode when memfd isn't supported
+const TMPFS_DIR: &str = "/dev/shm/remotelink_cache";
+
+/// Where the executables in the cache are stored
+#[derive(clap::ValueEnum, Clone, Copy, Debug, PartialEq)]
+pub enum Storage {
+    /// Files in the cache directory, kept between runs
+    Disk,
+    /// Anonymous memory files (memfd), nothing is written to persistent storage. Falls back to
+    /// a tmpfs directory if memfd isn't available.
+    Memory,
+}
+
+/// Creates an anonymous memory file
+fn memfd(name: &str) -> std::io::Result<File> {
+    let name = CString::new(name).unwrap();
+    let fd = unsafe { libc::memfd_create(name.as_ptr(), libc::MFD_CLOEXEC) };
+
+    if fd < 0 {
+        return Err(std::io::Error::last_os_error());
+    }
+
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+/// Path that opens `file` from any process, used to exec a memfd. /proc/self can't be used as
+/// it would refer to the child.
+fn fd_path(file: &File) -> PathBuf {
+    PathBuf::from(format!(
+        "/proc/{}/fd/{}",
+        std::process::id(),
+        file.as_raw_fd()
+    ))
+}
+
+/// Hex representation of a hash, used as file name in the cache
+pub fn hash_to_string(hash: &Hash) -> String {
+    hash.iter().map(|b| format!("{:02x}", b)).collect()
+}
+
+fn hash_from_string(name: &str) -> Option<Hash> {
+    if name.len() != 64 {
+        return None;
+    }
+
+    let mut hash = [0u8; 32];
+    for (i, byte) in hash.iter_mut().enumerate() {
+        *byte = u8::from_str_radix(name.get(i * 2..i * 2 + 2)?, 16).ok()?;
+    }
+
+    Some(hash)
+}
+
+struct Entry {
+    size: u64,
+    last_used: SystemTime,
+    /// The executable when it's kept in memory
+    memfd: Option<Arc<File>>,
+    /// Shared with the executables handed out for the entry, it isn't evicted while any of
+    /// them are queued or running
+    users: Arc<()>,
+}
+
+/// Executable found in (or inserted into) the cache. The path of an executable kept in memory
+/// is that of the open memfd, so it holds on to the memfd to keep the path valid while it's
+/// queued and running, even if the entry is replaced meanwhile.
+pub struct CachedExecutable {
+    pub path: PathBuf,
+    _memfd: Option<Arc<File>>,
+    _user: Arc<()>,
+}
+
+/// Executables that has been uploaded to the runner, keyed by their content hash. The total
+/// size is kept below `max_size` by evicting the least recently used executables.
+pub struct ExecutableCache {
+    dir: PathBuf,
+    max_size: u64,
+    total_size: u64,
+    entries: HashMap<Hash, Entry>,
+    /// Last version of the executable uploaded for a path on the host
+    paths: HashMap<String, Hash>,
+    /// Uploads in progress by path when executables are kept in memory
+    partials: HashMap<PathBuf, File>,
+    /// Set when executables are kept in memfds rather than in `dir`
+    in_memory: bool,
+}
+
+impl ExecutableCache {
+    /// Opens the cache with the executables stored in `storage`. Memory caches start out
+    /// empty, see `open_dir` for disk caches.
+    pub fn open(storage: Storage, dir: &Path, max_size: u64) -> Result<ExecutableCache> {
+        if storage == Storage::Disk {
+            return Self::open_dir(dir, max_size);
+        }
+
+        if let Err(err) = memfd("remotelink") {
+            info!(
+                "memfd not supported ({}), using {} for the cache",
+                err, TMPFS_DIR
+            );
+            return Self::open_dir(Path::new(TMPFS_DIR), max_size);
+        }
+
+        info!("Executable cache in memory, max {} bytes", max_size);
+
+        Ok(ExecutableCache {
+            dir: PathBuf::new(),
+            max_size,
+            total_size: 0,
+            entries: HashMap::new(),
+            paths: HashMap::new(),
+            partials: HashMap::new(),
+            in_memory: true,
+        })
+    }
+
+    /// Opens (and creates if needed) the cache in `dir`. Executables from earlier runs are kept
+    /// with their modification time as last use.
+    fn open_dir(dir: &Path, max_size: u64) -> Result<ExecutableCache> {
+        std::fs::create_dir_all(dir)?;
+
+        let mut cache = ExecutableCache {
+            dir: dir.to_path_buf(),
+            max_size,
+            total_size: 0,
+            entries: HashMap::new(),
+            paths: HashMap::new(),
+            partials: HashMap::new(),
+            in_memory: false,
+        };
+
+        for entry in std::fs::read_dir(dir)? {
+            let entry = entry?;
+            let name = entry.file_name();
+            let name = name.to_string_lossy();
+
+            if let Some(hash) = hash_from_string(&name) {
+                let metadata = entry.metadata()?;
+                cache.total_size += metadata.len();
+                cache.entries.insert(
+                    hash,
+                    Entry {
+                        size: metadata.len(),
+                        last_used: metadata.modified()?,
+                        memfd: None,
+                        users: Arc::new(()),
+                    },
+                );
+            } else if name.ends_with(".partial") {
+                // Left over from an upload that never finished
+                let _ = std::fs::remove_file(entry.path());
+            }
+        }
+
+        // Which version was last used for each host path, kept so delta uploads works after
+        // a restart as well
+        if let Ok(index) = std::fs::read_to_string(dir.join(PATHS_INDEX)) {
+            for line in index.lines() {
+                if let Some((hash, path)) = line.split_once(' ') {
+                    if let Some(hash) = hash_from_string(hash) {
+                        cache.paths.insert(path.to_owned(), hash);
+                    }
+                }
+            }
+        }
+
+        info!(
+            "Executable cache {:?}: {} entries, {} bytes",
+            dir,
+            cache.entries.len(),
+            cache.total_size
+        );
+
+        cache.evict(None);
+
+        Ok(cache)
+    }
+
+    fn path(&self, hash: &Hash) -> PathBuf {
+        match self
+            .entries
+            .get(hash)
+            .and_then(|entry| entry.memfd.as_ref())
+        {
+            Some(file) => fd_path(file),
+            None => self.dir.join(hash_to_string(hash)),
+        }
+    }
+
+    /// Hands out the executable of the entry for `hash`, which has to be in the cache
+    fn executable(&self, hash: &Hash) -> CachedExecutable {
+        let entry = &self.entries[hash];
+
+        CachedExecutable {
+            path: self.path(hash),
+            _memfd: entry.memfd.clone(),
+            _user: entry.users.clone(),
+        }
+    }
+
+    /// Returns the executable if it's in the cache and marks it as used as the latest version
+    /// of `host_path`
+    pub fn lookup(&mut self, hash: &Hash, host_path: &str) -> Option<CachedExecutable> {
+        let path = self.path(hash);
+        let entry = self.entries.get_mut(hash)?;
+
+        if !path.exists() {
+            self.total_size -= entry.size;
+            self.entries.remove(hash);
+            return None;
+        }
+
+        entry.last_used = SystemTime::now();
+
+        // Update the modification time as well so the order is kept between runs. Opened read
+        // only as an executable that is open for writing can't be launched.
+        if !self.in_memory {
+            if let Ok(file) = File::open(&path) {
+                let _ = file.set_modified(entry.last_used);
+            }
+        }
+
+        trace!("Executable cache hit {}", hash_to_string(hash));
+
+        self.set_path(host_path, hash);
+
+        Some(self.executable(hash))
+    }
+
+    /// Returns the path to the latest cached version of the executable at `host_path`
+    pub fn lookup_previous(&self, host_path: &str) -> Option<PathBuf> {
+        let hash = self.paths.get(host_path)?;
+
+        if self.entries.contains_key(hash) {
+            Some(self.path(hash))
+        } else {
+            None
+        }
+    }
+
+    /// Unique path to upload a new executable to before it's inserted
+    pub fn partial_path(&mut self, hash: &Hash) -> Result<PathBuf> {
+        let counter = PARTIAL_COUNTER.fetch_add(1, Ordering::Relaxed);
+        let name = format!(
+            "{}.{}.{}.partial",
+            hash_to_string(hash),
+            std::process::id(),
+            counter
+        );
+
+        if !self.in_memory {
+            return Ok(self.dir.join(name));
+        }
+
+        let file = memfd(&hash_to_string(hash))?;
+        let path = fd_path(&file);
+        self.partials.insert(path.clone(), file);
+
+        Ok(path)
+    }
+
+    /// Throws away an upload that didn't finish
+    pub fn remove_partial(&mut self, partial: &Path) {
+        if self.partials.remove(partial).is_none() {
+            let _ = std::fs::remove_file(partial);
+        }
+    }
+
+    /// Moves a completed upload of `host_path` into the cache and returns the executable.
+    /// Least recently used executables are evicted to keep within the size limit.
+    pub fn insert(
+        &mut self,
+        hash: &Hash,
+        partial: &Path,
+        host_path: &str,
+    ) -> Result<CachedExecutable> {
+        let size = std::fs::metadata(partial)?.len();
+
+        let memfd = match self.partials.remove(partial) {
+            // Reopened read only as the memfd can't be executed while it's open for writing
+            Some(file) => {
+                let readonly = File::open(partial)?;
+                drop(file);
+                Some(Arc::new(readonly))
+            }
+            None => {
+                std::fs::rename(partial, self.dir.join(hash_to_string(hash)))?;
+                None
+            }
+        };
+
+        if let Some(old) = self.entries.insert(
+            *hash,
+            Entry {
+                size,
+                last_used: SystemTime::now(),
+                memfd,
+                users: Arc::new(()),
+            },
+        ) {
+            self.total_size -= old.size;
+        }
+
+        self.total_size += size;
+        self.evict(Some(hash));
+        self.set_path(host_path, hash);
+
+        Ok(self.executable(hash))
+    }
+
+    /// Sets `hash` as the latest version of `host_path` and updates the index on disk
+    fn set_path(&mut self, host_path: &str, hash: &Hash) {
+        if self.paths.get(host_path) == Some(hash) {
+            return;
+        }
+
+        self.paths.insert(host_path.to_owned(), *hash);
+
+        if self.in_memory {
+            return;
+        }
+
+        let index: String = self
+            .paths
+            .iter()
+            .map(|(path, hash)| format!("{} {}\n", hash_to_string(hash), path))
+            .collect();
+
+        // Written to a temporary file first so a crash never leaves a broken index behind
+        let tmp = self.dir.join(format!("{}.tmp", PATHS_INDEX));
+        if let Err(err) = std::fs::write(&tmp, index)
+            .and_then(|_| std::fs::rename(&tmp, self.dir.join(PATHS_INDEX)))
+        {
+            error!("Unable to write executable cache index: {}", err);
+        }
+    }
+
+    /// Evicts least recently used entries (except `keep`) until the cache fits in max_size.
+    /// Entries of executables that are queued or running are kept, so the cache may be larger
+    /// until they are done and the next executable is inserted.
+    fn evict(&mut self, keep: Option<&Hash>) {
+        while self.total_size > self.max_size {
+            let oldest = self
+                .entries
+                .iter()
+                .filter(|(hash, _)| Some(*hash) != keep)
+                .filter(|(_, entry)| Arc::strong_count(&entry.users) == 1)
+                .min_by_key(|(_, entry)| entry.last_used)
+                .map(|(hash, _)| *hash);
+
+            let hash = match oldest {
+                Some(hash) => hash,
+                None => break,
+            };
+
+            let path = self.path(&hash);
+            let entry = self.entries.remove(&hash).unwrap();
+            self.total_size -= entry.size;
+            self.paths.retain(|_, h| *h != hash);
+
+            // Memory files are freed when the entry is dropped
+            if entry.memfd.is_none() {
+                let _ = std::fs::remove_file(path);
+            }
+            trace!("Evicted {} from executable cache", hash_to_string(&hash));
+        }
+    }
+}
@@ -0,0 +1,609 @@
+use crate::message_stream::MessageStream;
+use crate::messages::*;
+use crate::output_pipe::{read_spare, BufferPool, CHUNK_CAPACITY};
+use anyhow::*;
+use core::result::Result::Ok;
+use log::{error, info, trace};
+use mio::{
+    net::{UnixListener, UnixStream},
+    Interest, Registry, Token,
+};
+use std::{
+    collections::{HashMap, HashSet},
+    fs::File,
+    io::{Read, Write},
+    os::unix::io::AsRawFd,
+    path::{Component, Path, PathBuf},
+    sync::atomic::{AtomicU64, Ordering},
+    sync::Arc,
+};
+
+/// Environment variable that gives the executable the path to the file server socket
+pub const FILE_SERVER_ENV: &str = "REMOTELINK_FILE_SERVER";
+
+/// Files are requested from the host and cached in blocks of this size
+const BLOCK_SIZE: u64 = CHUNK_SIZE as u64;
+/// Number of blocks after a read that are requested ahead of time
+const READ_AHEAD_BLOCKS: u64 = 16;
+/// Max size of the data in a single ReadReply to the executable
+const MAX_READ_SIZE: u64 = 1024 * 1024;
+/// Max size of the block cache on the runner
+const BLOCK_CACHE_SIZE: u64 = 256 * 1024 * 1024;
+/// Token of the file server socket, connections from the executable get the tokens after it
+const LISTENER_TOKEN: usize = 16;
+
+/// Used to give file server sockets unique names
+static SOCKET_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// Connection from the executable
+struct Client {
+    stream: UnixStream,
+    msg_stream: MessageStream,
+    token: Token,
+}
+
+/// File on the host opened by the executable
+struct OpenFile {
+    host_handle: u32,
+    size: u64,
+}
+
+struct Block {
+    data: Vec<u8>,
+    last_used: u64,
+}
+
+/// Read from the executable waiting for blocks from the host
+struct PendingRead {
+    token: Token,
+    handle: u32,
+    host_handle: u32,
+    offset: u64,
+    end: u64,
+}
+
+/// Runner side of the file server. The executable connects to a local socket and opens and
+/// reads files with the same messages as used between the host and runner. Reads are served
+/// from a block cache, missing blocks (and a number of blocks after them) are requested from
+/// the host so sequential reads mostly find their data in the cache already.
+pub struct FileServer {
+    path: PathBuf,
+    listener: UnixListener,
+    registry: Registry,
+    clients: Vec<Client>,
+    next_token: usize,
+    /// Opens sent to the host by their request id, maps to the client and its own id
+    opens: HashMap<u32, (Token, u32)>,
+    next_open_id: u32,
+    /// Handles given to the executable
+    handles: HashMap<u32, OpenFile>,
+    next_handle: u32,
+    /// Cached blocks by host handle and block index
+    blocks: HashMap<(u32, u64), Block>,
+    cache_size: u64,
+    /// Blocks that has been requested from the host but not arrived yet
+    in_flight: HashSet<(u32, u64)>,
+    pending: Vec<PendingRead>,
+    /// Used to track the last use of blocks
+    tick: u64,
+}
+
+impl FileServer {
+    /// Creates the socket the executable connects to. Connections will be registered with
+    /// `registry` so they wake up the event loop.
+    pub fn new(registry: &Registry) -> Result<FileServer> {
+        let path = std::env::temp_dir().join(format!(
+            "remotelink-{}-{}.sock",
+            std::process::id(),
+            SOCKET_COUNTER.fetch_add(1, Ordering::Relaxed)
+        ));
+
+        let _ = std::fs::remove_file(&path);
+        let mut listener = UnixListener::bind(&path)?;
+        let registry = registry.try_clone()?;
+
+        registry.register(&mut listener, Token(LISTENER_TOKEN), Interest::READABLE)?;
+
+        info!("File server listening on {:?}", path);
+
+        Ok(FileServer {
+            path,
+            listener,
+            registry,
+            clients: Vec::new(),
+            next_token: LISTENER_TOKEN + 1,
+            opens: HashMap::new(),
+            next_open_id: 0,
+            handles: HashMap::new(),
+            next_handle: 0,
+            blocks: HashMap::new(),
+            cache_size: 0,
+            in_flight: HashSet::new(),
+            pending: Vec::new(),
+            tick: 0,
+        })
+    }
+
+    /// Path of the socket that is passed to the executable
+    pub fn socket_path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Accepts new connections and handles requests from the executable. Requests that can't
+    /// be served from the cache are sent to the host over `msg_stream`. Returns true if any
+    /// progress was made.
+    pub fn update<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<bool> {
+        let mut progress = false;
+
+        loop {
+            match self.listener.accept() {
+                Ok((mut client_stream, _)) => {
+                    let token = Token(self.next_token);
+                    self.next_token += 1;
+
+                    self.registry.register(
+                        &mut client_stream,
+                        token,
+                        Interest::READABLE | Interest::WRITABLE,
+                    )?;
+
+                    trace!("File server client {:?} connected", token);
+
+                    self.clients.push(Client {
+                        stream: client_stream,
+                        msg_stream: MessageStream::new(),
+                        token,
+                    });
+
+                    progress = true;
+                }
+                Err(err) if err.kind() == std::io::ErrorKind::WouldBlock => break,
+                Err(err) => bail!(err),
+            }
+        }
+
+        let mut index = 0;
+
+        while index < self.clients.len() {
+            match self.update_client(index, msg_stream, stream) {
+                Ok(client_progress) => {
+                    progress |= client_progress;
+                    index += 1;
+                }
+                Err(err) => {
+                    // The executable closing its connection ends up here as well
+                    trace!("File server client closed: {:?}", err);
+                    let mut client = self.clients.swap_remove(index);
+                    let _ = self.registry.deregister(&mut client.stream);
+                    self.pending.retain(|read| read.token != client.token);
+                }
+            }
+        }
+
+        Ok(progress)
+    }
+
+    fn update_client<S: Write + Read>(
+        &mut self,
+        index: usize,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<bool> {
+        let mut progress = false;
+
+        loop {
+            let client = &mut self.clients[index];
+            let token = client.token;
+
+            let message = match client.msg_stream.update(&mut client.stream)? {
+                Some(message) => message,
+                None => break,
+            };
+
+            let data = client.msg_stream.data();
+
+            match message {
+                Messages::OpenHandleRequest => {
+                    let msg: OpenHandleRequest = bincode::deserialize(data)?;
+                    trace!("OpenHandleRequest {} from {:?}", msg.path, token);
+
+                    let id = self.next_open_id;
+                    self.next_open_id = self.next_open_id.wrapping_add(1);
+                    self.opens.insert(id, (token, msg.id));
+
+                    let request = OpenHandleRequest { id, path: msg.path };
+                    msg_stream.begin_write_message(
+                        stream,
+                        &request,
+                        Messages::OpenHandleRequest,
+                    )?;
+                }
+
+                Messages::ReadRequest => {
+                    let msg: ReadRequest = bincode::deserialize(data)?;
+                    self.begin_read(token, msg, msg_stream, stream)?;
+                }
+
+                Messages::CloseHandleRequest => {
+                    // Only closed locally, the host keeps the file open (and its blocks cached)
+                    // in case it's opened again
+                    let msg: CloseHandleRequest = bincode::deserialize(data)?;
+                    self.handles.remove(&msg.handle);
+                }
+
+                _ => error!("Unexpected message from file server client {:?}", message),
+            }
+
+            progress = true;
+        }
+
+        Ok(progress)
+    }
+
+    /// Replies directly if all the data is cached, otherwise it waits for the missing blocks.
+    /// Blocks following the read are requested from the host as well.
+    fn begin_read<S: Write + Read>(
+        &mut self,
+        token: Token,
+        msg: ReadRequest,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<()> {
+        let file = match self.handles.get(&msg.handle) {
+            Some(file) => file,
+            None => {
+                // Invalid handles reads as empty
+                return self.reply_read(token, msg.handle, msg.offset, &[]);
+            }
+        };
+
+        let host_handle = file.host_handle;
+        let end = (msg.offset + (msg.size as u64).min(MAX_READ_SIZE)).min(file.size);
+        let read_ahead_end = (end + READ_AHEAD_BLOCKS * BLOCK_SIZE).min(file.size);
+
+        self.pending.push(PendingRead {
+            token,
+            handle: msg.handle,
+            host_handle,
+            offset: msg.offset,
+            end,
+        });
+
+        // Requests the blocks of this read first
+        self.complete_reads(msg_stream, stream)?;
+
+        let first = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        let last = (read_ahead_end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        for block in first..last {
+            self.request_block(host_handle, block, msg_stream, stream)?;
+        }
+
+        Ok(())
+    }
+
+    /// Handles replies from the host to requests sent by the file server
+    pub fn handle_host_message<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        message: Messages,
+    ) -> Result<()> {
+        match message {
+            Messages::OpenHandleReply => {
+                let msg: OpenHandleReply = bincode::deserialize(msg_stream.data())?;
+
+                let (token, id) = match self.opens.remove(&msg.id) {
+                    Some(open) => open,
+                    None => bail!("OpenHandleReply for unknown request {}", msg.id),
+                };
+
+                let handle = msg.handle.map(|host_handle| {
+                    let handle = self.next_handle;
+                    self.next_handle = self.next_handle.wrapping_add(1);
+                    self.handles.insert(
+                        handle,
+                        OpenFile {
+                            host_handle,
+                            size: msg.size,
+                        },
+                    );
+                    handle
+                });
+
+                let reply = OpenHandleReply {
+                    id,
+                    handle,
+                    size: msg.size,
+                };
+
+                if let Some(client) = self.clients.iter_mut().find(|c| c.token == token) {
+                    client.msg_stream.begin_write_message(
+                        &mut client.stream,
+                        &reply,
+                        Messages::OpenHandleReply,
+                    )?;
+                }
+            }
+
+            Messages::ReadReply => {
+                let msg: ReadReply = bincode::deserialize(msg_stream.data())?;
+                let key = (msg.handle, msg.offset / BLOCK_SIZE);
+                let data = msg.data.to_vec();
+
+                self.in_flight.remove(&key);
+                self.insert_block(key, data);
+                self.complete_reads(msg_stream, stream)?;
+            }
+
+            _ => (),
+        }
+
+        Ok(())
+    }
+
+    /// Requests a block from the host unless it's cached or already on its way
+    fn request_block<S: Write + Read>(
+        &mut self,
+        host_handle: u32,
+        block: u64,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<()> {
+        let key = (host_handle, block);
+
+        if self.blocks.contains_key(&key) || !self.in_flight.insert(key) {
+            return Ok(());
+        }
+
+        let request = ReadRequest {
+            handle: host_handle,
+            offset: block * BLOCK_SIZE,
+            size: BLOCK_SIZE as u32,
+        };
+
+        msg_stream.begin_write_message(stream, &request, Messages::ReadRequest)?;
+
+        Ok(())
+    }
+
+    /// Replies to all pending reads that has their data in the cache and requests the missing
+    /// blocks for the rest
+    fn complete_reads<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<()> {
+        let mut index = 0;
+
+        while index < self.pending.len() {
+            let read = &self.pending[index];
+            let (host_handle, offset, end) = (read.host_handle, read.offset, read.end);
+
+            let missing: Vec<u64> = (offset / BLOCK_SIZE..(end + BLOCK_SIZE - 1) / BLOCK_SIZE)
+                .filter(|block| !self.blocks.contains_key(&(host_handle, *block)))
+                .collect();
+
+            if !missing.is_empty() {
+                for block in missing {
+                    self.request_block(host_handle, block, msg_stream, stream)?;
+                }
+
+                index += 1;
+                continue;
+            }
+
+            let read = self.pending.swap_remove(index);
+            let data = self.gather(host_handle, offset, end);
+            self.reply_read(read.token, read.handle, offset, &data)?;
+        }
+
+        Ok(())
+    }
+
+    /// Copies the data between `offset` and `end` from the cached blocks
+    fn gather(&mut self, host_handle: u32, offset: u64, end: u64) -> Vec<u8> {
+        let mut data = Vec::with_capacity(end.saturating_sub(offset) as usize);
+        let mut pos = offset;
+
+        self.tick += 1;
+
+        while pos < end {
+            let block = match self.blocks.get_mut(&(host_handle, pos / BLOCK_SIZE)) {
+                Some(block) => block,
+                None => break,
+            };
+
+            block.last_used = self.tick;
+
+            let start = (pos % BLOCK_SIZE) as usize;
+            let len = block
+                .data
+                .len()
+                .saturating_sub(start)
+                .min((end - pos) as usize);
+
+            // A short block means the file ended (or couldn't be read) on the host
+            if len == 0 {
+                break;
+            }
+
+            data.extend_from_slice(&block.data[start..start + len]);
+            pos += len as u64;
+        }
+
+        data
+    }
+
+    fn reply_read(&mut self, token: Token, handle: u32, offset: u64, data: &[u8]) -> Result<()> {
+        let client = match self.clients.iter_mut().find(|c| c.token == token) {
+            Some(client) => client,
+            None => return Ok(()),
+        };
+
+        let reply = ReadReply {
+            handle,
+            offset,
+            data,
+        };
+
+        client
+            .msg_stream
+            .begin_write_message(&mut client.stream, &reply, Messages::ReadReply)?;
+
+        Ok(())
+    }
+
+    /// Adds a block to the cache and evicts the least recently used blocks if it's full
+    fn insert_block(&mut self, key: (u32, u64), data: Vec<u8>) {
+        self.tick += 1;
+        self.cache_size += data.len() as u64;
+
+        if let Some(old) = self.blocks.insert(
+            key,
+            Block {
+                data,
+                last_used: self.tick,
+            },
+        ) {
+            self.cache_size -= old.data.len() as u64;
+        }
+
+        while self.cache_size > BLOCK_CACHE_SIZE {
+            let oldest = self
+                .blocks
+                .iter()
+                .filter(|(k, _)| **k != key)
+                .min_by_key(|(_, block)| block.last_used)
+                .map(|(k, _)| *k);
+
+            match oldest.and_then(|k| self.blocks.remove(&k)) {
+                Some(block) => self.cache_size -= block.data.len() as u64,
+                None => break,
+            }
+        }
+    }
+}
+
+impl Drop for FileServer {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.path);
+    }
+}
+
+/// Host side of the file server, serves files from `root` to the runner
+pub struct FileHost {
+    root: PathBuf,
+    files: Vec<File>,
+    /// Files are only opened once so the runner can keep using its cached blocks
+    paths: HashMap<String, u32>,
+    pool: Arc<BufferPool>,
+}
+
+impl FileHost {
+    pub fn new(root: &Path, pool: Arc<BufferPool>) -> FileHost {
+        FileHost {
+            root: root.to_path_buf(),
+            files: Vec::new(),
+            paths: HashMap::new(),
+            pool,
+        }
+    }
+
+    /// Paths are relative to the root and may not point outside of it
+    fn resolve(&self, path: &str) -> Option<PathBuf> {
+        let path = Path::new(path);
+
+        if path
+            .components()
+            .any(|c| !matches!(c, Component::Normal(_) | Component::CurDir))
+        {
+            return None;
+        }
+
+        Some(self.root.join(path))
+    }
+
+    fn open(&mut self, path: &str) -> Option<(u32, u64)> {
+        if let Some(&handle) = self.paths.get(path) {
+            let size = self.files[handle as usize].metadata().ok()?.len();
+            return Some((handle, size));
+        }
+
+        let file = match self.resolve(path).map(File::open) {
+            Some(Ok(file)) => file,
+            _ => return None,
+        };
+
+        let size = file.metadata().ok()?.len();
+        let handle = self.files.len() as u32;
+
+        self.files.push(file);
+        self.paths.insert(path.to_owned(), handle);
+
+        Some((handle, size))
+    }
+
+    /// Handles file server requests from the runner
+    pub fn handle_message<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        message: Messages,
+    ) -> Result<()> {
+        match message {
+            Messages::OpenHandleRequest => {
+                let msg: OpenHandleRequest = bincode::deserialize(msg_stream.data())?;
+                let id = msg.id;
+                let opened = self.open(msg.path);
+
+                trace!("OpenHandleRequest {} -> {:?}", msg.path, opened);
+
+                let reply = OpenHandleReply {
+                    id,
+                    handle: opened.map(|(handle, _)| handle),
+                    size: opened.map_or(0, |(_, size)| size),
+                };
+
+                msg_stream.begin_write_message(stream, &reply, Messages::OpenHandleReply)?;
+            }
+
+            Messages::ReadRequest => {
+                let msg: ReadRequest = bincode::deserialize(msg_stream.data())?;
+                let mut buffer = self.pool.get();
+                let size = (msg.size as usize).min(CHUNK_CAPACITY);
+
+                // Errors are sent as a short read, which the runner treats as the end of file
+                if let Some(file) = self.files.get(msg.handle as usize) {
+                    while buffer.len() < size {
+                        let offset = msg.offset + buffer.len() as u64;
+                        let len = size - buffer.len();
+
+                        match read_spare(file.as_raw_fd(), &mut buffer, len, Some(offset)) {
+                            Ok(0) => break,
+                            Ok(_) => (),
+                            Err(err) if err.kind() == std::io::ErrorKind::Interrupted => (),
+                            Err(_) => break,
+                        }
+                    }
+                }
+
+                // Sent as the data of a ReadReply straight from the buffer
+                msg_stream.begin_write_message_with_payload(
+                    stream,
+                    &(msg.handle, msg.offset),
+                    vec![buffer],
+                    Messages::ReadReply,
+                )?;
+            }
+
+            _ => (),
+        }
+
+        Ok(())
+    }
+}
@@ -1,39 +1,90 @@
 use anyhow::*;
-use log::trace;
+use log::{error, info, trace};
+use mio::{net::TcpStream, Events, Interest, Poll, Token, Waker};
+use sha2::{Digest, Sha256};
+use std::collections::{BTreeMap, HashMap, VecDeque};
 use std::fs::File;
-use std::io::{Read, Write};
-use std::net::TcpStream;
-use std::sync::mpsc::channel;
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::net::{SocketAddr, ToSocketAddrs};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{channel, Receiver};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
 
-use crate::message_stream::{MessageStream, TransitionToRead};
+use notify_debouncer_mini::notify::{RecursiveMode, Watcher};
+use notify_debouncer_mini::{new_debouncer, DebounceEventResult, Debouncer};
+
+use crate::delta::{self, DeltaOp};
+use crate::file_server::FileHost;
+use crate::message_stream::{
+    is_disconnect, set_buffer_sizes, set_keepalive, wait_for_events, MessageStream,
+};
 use crate::messages::*;
 use crate::options::Opt;
+use crate::output_pipe::BufferPool;
+
+const SOCKET: Token = Token(0);
+/// Woken up by Ctrl-C and by changes to watched executables
+const WAKER: Token = Token(1);
+
+/// Time to wait for more changes before relaunching, a build usually writes the executable in
+/// several steps
+const WATCH_DEBOUNCE: Duration = Duration::from_millis(100);
 
-fn handshake<T: Write + Read>(stream: &mut T) -> Result<()> {
+/// How long to wait for the runner to accept a connection and reply when reattaching
+const REATTACH_CONNECT_TIMEOUT: Duration = Duration::from_secs(2);
+/// Time between attempts to reattach
+const REATTACH_INTERVAL: Duration = Duration::from_secs(1);
+
+/// How long to wait for the StopExecutableReply on top of the grace period, the wait is
+/// extended as long as messages (such as the last output of the executables) keep coming
+const STOP_REPLY_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Returns the compression methods and features that were agreed on, and the id of the session
+/// on the runner
+fn handshake<T: Write + Read>(
+    stream: &mut T,
+    compression: u8,
+    features: u8,
+) -> Result<(u8, u8, u64)> {
     let handshake_request = HandshakeRequest {
         version_major: REMOTELINK_MAJOR_VERSION,
         version_minor: REMOTELINK_MINOR_VERSION,
+        compression,
+        features,
     };
 
     let mut msg_stream = MessageStream::new();
 
     // as socket is in blocking mode at this point we expect this to return with the correct data directly
-    if !msg_stream.begin_write_message(
-        stream,
-        &handshake_request,
-        Messages::HandshakeRequest,
-        TransitionToRead::No,
-    )? {
+    if !msg_stream.begin_write_message(stream, &handshake_request, Messages::HandshakeRequest)? {
         return Err(anyhow!(
             "Message write wasn't finished, should have completed directly"
         ));
     }
 
-    match msg_stream.begin_read(stream, true)? {
+    match msg_stream.update(stream)? {
         Some(msg) => {
             if msg == Messages::HandshakeReply {
-                let _message: HandshakeReply = bincode::deserialize(&msg_stream.data)?;
-            // TODO: validate that versions match
+                // Check the version first as the rest of reply may differ between versions
+                let (version_major, _): (u8, u8) = bincode::deserialize(msg_stream.data())?;
+
+                if version_major != REMOTELINK_MAJOR_VERSION {
+                    return Err(anyhow!(
+                        "Major version miss-match (host {} target {})",
+                        REMOTELINK_MAJOR_VERSION,
+                        version_major
+                    ));
+                }
+
+                let reply: HandshakeReply = bincode::deserialize(msg_stream.data())?;
+
+                return Ok((
+                    reply.compression & compression,
+                    reply.features & features,
+                    reply.session,
+                ));
             } else {
                 return Err(anyhow!(
                     "Incorrect message returned for HandshakeRequest {:?}",
@@ -48,89 +99,670 @@ fn handshake<T: Write + Read>(stream: &mut T) -> Result<()> {
             ))
         }
     }
-
-    Ok(())
 }
 
 /// Handles incoming messages and sends back reply (if needed)
 fn handle_incoming_msg<S: Write + Read>(
     msg_stream: &mut MessageStream,
     stream: &mut S,
+    launches: &mut Launches,
+    files: &mut Option<FileHost>,
+    output: &mut Output,
     message: Messages,
 ) -> Result<()> {
     trace!("Message received: {:?}", message);
 
+    if message.is_spooled() {
+        launches.received += msg_stream.data().len() as u64;
+    }
+
     match message {
+        // Output is written as is, it may not be valid UTF-8 if a character is split between
+        // two messages
         Messages::StdoutOutput => {
-            let msg: TextMessage = bincode::deserialize(&msg_stream.data)?;
-            let text = std::str::from_utf8(msg.data)?;
-            print!("{}", text);
+            let msg: TextMessage = bincode::deserialize(msg_stream.data())?;
+            output.stdout(msg.data)?;
+        }
+
+        Messages::StderrOutput => {
+            let msg: TextMessage = bincode::deserialize(msg_stream.data())?;
+            output.stderr(msg.data)?;
+        }
+
+        Messages::ExecutableUploadReply => {
+            let msg: ExecutableUploadReply = bincode::deserialize(msg_stream.data())?;
 
-            // make sure stream starts reading again
-            //msg_stream.begin_read(stream, true)?;
+            if let Some(launch) = launches.active.get_mut(&msg.id) {
+                if msg.cached {
+                    trace!("{} found in remote cache, skipping upload", launch.path);
+                    launch.upload = None;
+                } else if let Some(upload) = launch.upload.as_mut() {
+                    upload.start(msg.signature.as_ref())?;
+                }
+            }
         }
 
         Messages::LaunchExecutableReply => {
-            // TODO: Verify that the executable launched correct
-            // make sure stream starts reading again
-            //msg_stream.begin_read(stream, true)?;
+            let msg: LaunchExecutableReply = bincode::deserialize(msg_stream.data())?;
+
+            if msg.launch_status != 0 {
+                if let Some(launch) = launches.active.remove(&msg.id) {
+                    error!(
+                        "Unable to launch {}: {}",
+                        launch.path,
+                        msg.error_info.unwrap_or("unknown error")
+                    );
+                    launches.finished.push(Finished {
+                        path: launch.path,
+                        exit_code: LAUNCH_FAILED,
+                        wall_time: None,
+                    });
+                }
+            } else if let Some(launch) = launches.active.get_mut(&msg.id) {
+                launch.started = true;
+            }
+        }
+
+        Messages::ProfileData => {
+            let msg: TextMessage = bincode::deserialize(msg_stream.data())?;
+
+            if let Some(launch) = launches.active.get_mut(&msg.id) {
+                let file = match launch.profile.as_mut() {
+                    Some((_, file)) => file,
+                    None => {
+                        let path = format!("{}{}", launch.path, launches.profile_suffix);
+                        let file = File::create(&path)
+                            .map_err(|err| anyhow!("Unable to create {}: {}", path, err))?;
+                        &mut launch.profile.insert((path, file)).1
+                    }
+                };
+
+                file.write_all(msg.data)?;
+            }
+        }
+
+        Messages::ExecutableExited => {
+            let msg: ExecutableExited = bincode::deserialize(msg_stream.data())?;
+
+            if let Some(launch) = launches.active.remove(&msg.id) {
+                output.stderr(exit_message(&launch.path, &msg).as_bytes())?;
+
+                if let Some((path, _)) = launch.profile {
+                    output.stderr(format!("Profile written to {}\n", path).as_bytes())?;
+                }
+
+                launches.finished.push(Finished {
+                    wall_time: msg.usage.map(|_| Duration::from_micros(msg.wall_time_us)),
+                    exit_code: exit_code(&msg),
+                    path: launch.path,
+                });
+            }
+        }
+
+        Messages::OpenHandleRequest | Messages::ReadRequest => {
+            if let Some(files) = files.as_mut() {
+                files.handle_message(msg_stream, stream, message)?;
+            }
         }
 
         _ => (),
     }
 
-    trace!("Message handled, begin read again");
-    msg_stream.begin_read(stream, false)?;
-
     Ok(())
 }
 
-fn send_file<S: Write + Read>(
-    msg_stream: &mut MessageStream,
-    stream: &mut S,
-    filename: &str,
-) -> Result<()> {
-    let mut buffer = Vec::new();
-    let mut f = File::open(filename)?;
-    f.read_to_end(&mut buffer)?;
-
-    let file_request = LaunchExecutableRequest {
-        // TODO: Implement file serving
-        file_server: false,
-        path: filename,
-        data: &buffer,
+/// Executable that has been run (or failed to launch)
+struct Finished {
+    path: String,
+    exit_code: i32,
+    /// None if it never ran
+    wall_time: Option<Duration>,
+}
+
+/// Outcome of running the executables on one target
+#[derive(Default)]
+struct RunResult {
+    /// See `Launches::exit_code`
+    exit_code: i32,
+    finished: Vec<Finished>,
+}
+
+/// Set by Ctrl-C, wakes up the event loops of all the targets. The handler can only be set
+/// once so it's shared between them.
+struct Interrupt {
+    set: AtomicBool,
+    wakers: Mutex<Vec<Arc<Waker>>>,
+}
+
+impl Interrupt {
+    fn install() -> Arc<Interrupt> {
+        let interrupt = Arc::new(Interrupt {
+            set: AtomicBool::new(false),
+            wakers: Mutex::new(Vec::new()),
+        });
+
+        let handler = interrupt.clone();
+
+        ctrlc::set_handler(move || {
+            handler.set.store(true, Ordering::Relaxed);
+            for waker in handler.wakers.lock().unwrap().iter() {
+                waker.wake().expect("Could not wake up event loop.");
+            }
+        })
+        .expect("Error setting Ctrl-C handler");
+
+        interrupt
+    }
+
+    /// `waker` is woken up on Ctrl-C
+    fn register(&self, waker: Arc<Waker>) {
+        self.wakers.lock().unwrap().push(waker);
+    }
+
+    fn is_set(&self) -> bool {
+        self.set.load(Ordering::Relaxed)
+    }
+}
+
+/// Writes the output of the executables to stdout and stderr. When running on several targets
+/// every line is prefixed with the target and only complete lines are written, so the output
+/// of different targets doesn't mix within a line. Lines longer than `CHUNK_SIZE` are broken
+/// up so output without newlines isn't held back (or kept in memory) until the end.
+struct Output {
+    prefix: Option<String>,
+    /// Incomplete last line of stdout and stderr when prefixed, less than `CHUNK_SIZE` bytes
+    partial: [Vec<u8>; 2],
+}
+
+impl Output {
+    fn new(prefix: Option<String>) -> Output {
+        Output {
+            prefix,
+            partial: [Vec::new(), Vec::new()],
+        }
+    }
+
+    fn stdout(&mut self, data: &[u8]) -> Result<()> {
+        self.write(0, data)
+    }
+
+    fn stderr(&mut self, data: &[u8]) -> Result<()> {
+        self.write(1, data)
+    }
+
+    fn write(&mut self, stream: usize, data: &[u8]) -> Result<()> {
+        let prefix = match self.prefix.as_ref() {
+            Some(prefix) => prefix,
+            None => return Self::write_to(stream, data),
+        };
+
+        let partial = &mut self.partial[stream];
+        partial.extend_from_slice(data);
+
+        let mut end = partial
+            .iter()
+            .rposition(|b| *b == b'\n')
+            .map_or(0, |pos| pos + 1);
+        if partial.len() - end >= CHUNK_SIZE {
+            end = partial.len();
+        }
+
+        if end == 0 {
+            return Ok(());
+        }
+
+        let mut lines = Vec::with_capacity(end + 16 * prefix.len());
+        for line in partial[..end].split_inclusive(|b| *b == b'\n') {
+            let text = line.strip_suffix(b"\n").unwrap_or(line);
+            let mut start = 0;
+
+            loop {
+                let piece = &text[start..text.len().min(start + CHUNK_SIZE)];
+                lines.extend_from_slice(prefix.as_bytes());
+                lines.extend_from_slice(piece);
+                lines.push(b'\n');
+
+                start += CHUNK_SIZE;
+                if start >= text.len() {
+                    break;
+                }
+            }
+        }
+
+        partial.drain(..end);
+
+        Self::write_to(stream, &lines)
+    }
+
+    fn write_to(stream: usize, data: &[u8]) -> Result<()> {
+        if stream == 0 {
+            let mut stdout = std::io::stdout().lock();
+            stdout.write_all(data)?;
+            stdout.flush()?;
+        } else {
+            std::io::stderr().lock().write_all(data)?;
+        }
+
+        Ok(())
+    }
+
+    /// Writes what is left of incomplete lines
+    fn finish(&mut self) -> Result<()> {
+        for stream in 0..2 {
+            if !self.partial[stream].is_empty() {
+                self.write(stream, b"\n")?;
+            }
+        }
+
+        Ok(())
+    }
+}
+
+/// Exit code used for executables that couldn't be launched
+const LAUNCH_FAILED: i32 = 1;
+/// Exit code used when the host is stopped with Ctrl-C (like a shell does)
+const INTERRUPTED: i32 = 130;
+
+/// Exit code to return for an executable, signals are reported as 128 + signal like a shell
+/// does
+fn exit_code(msg: &ExecutableExited) -> i32 {
+    match (msg.exit_code, msg.signal) {
+        (Some(code), _) => code,
+        (None, Some(signal)) => 128 + signal,
+        (None, None) => LAUNCH_FAILED,
+    }
+}
+
+/// Line telling how the executable exited and what it used of the runner. Written to stderr so
+/// it doesn't mix with the output of the executable.
+fn exit_message(path: &str, msg: &ExecutableExited) -> String {
+    let status = match (msg.exit_code, msg.signal) {
+        (Some(code), _) => format!("exited with code {}", code),
+        (None, Some(signal)) => format!("killed by signal {}", signal),
+        (None, None) => "stopped before it was started".to_owned(),
     };
 
-    msg_stream.begin_write_message(
-        stream,
-        &file_request,
-        Messages::LaunchExecutableRequest,
-        TransitionToRead::Yes,
-    )?;
+    let usage = match msg.usage.as_ref() {
+        Some(usage) => usage,
+        None => return format!("{} {}\n", path, status),
+    };
 
-    Ok(())
+    let seconds = |us: u64| us as f64 / 1_000_000.0;
+
+    format!(
+        "{} {} (wall {:.3}s, user {:.3}s, sys {:.3}s, max rss {} KiB, {} major faults)\n",
+        path,
+        status,
+        seconds(msg.wall_time_us),
+        seconds(usage.user_time_us),
+        seconds(usage.system_time_us),
+        usage.max_rss_kb,
+        usage.major_faults
+    )
 }
 
-fn close_down_exe<S: Write + Read>(msg_stream: &mut MessageStream, stream: &mut S) -> Result<()> {
-    let stop_request = StopExecutableRequest::default();
-    msg_stream.begin_write_message(
-        stream,
-        &stop_request,
-        Messages::StopExecutableRequest,
-        TransitionToRead::Yes,
-    )?;
+/// Max amount of upload data that is queued on the message stream at once. This keeps memory
+/// bounded to a few chunks no matter the size of the executable.
+const MAX_QUEUED_UPLOAD: usize = 4 * CHUNK_SIZE;
+
+/// Executable launched on the runner
+struct Launch {
+    path: String,
+    /// Set while the executable is being uploaded
+    upload: Option<Upload>,
+    /// Set when the launch has been asked to stop so a new version can be run
+    stopping: bool,
+    /// Set once the runner has started the executable
+    started: bool,
+    /// Where the profile is written, created when the first of it arrives
+    profile: Option<(String, File)>,
+}
+
+/// How executables are started on the runner, sent in the LaunchExecutableRequest
+#[derive(Clone, Default)]
+struct LaunchOptions {
+    file_server: bool,
+    interactive: bool,
+    pty: bool,
+    profile: bool,
+    process: ProcessSettings,
+}
+
+/// Executables to run on the runner. They are launched in order over the same connection with
+/// up to `jobs` of them running at the same time.
+struct Launches {
+    pending: VecDeque<String>,
+    /// Launched executables by id that hasn't exited yet
+    active: BTreeMap<u32, Launch>,
+    next_id: u32,
+    jobs: usize,
+    options: LaunchOptions,
+    /// Time (in ms) executables get to exit after SIGTERM when they are stopped
+    grace_period_ms: u32,
+    /// Added to the path of the executable to get the path of its profile
+    profile_suffix: String,
+    /// Executables that has exited or couldn't be launched
+    finished: Vec<Finished>,
+    /// Size of the messages received that the runner keeps in its spool, where the runner
+    /// starts sending them again when reattaching
+    received: u64,
+}
+
+impl Launches {
+    fn new(
+        executables: Vec<String>,
+        jobs: usize,
+        options: LaunchOptions,
+        grace_period_ms: u32,
+        profile_suffix: String,
+    ) -> Launches {
+        Launches {
+            pending: executables.into(),
+            active: BTreeMap::new(),
+            next_id: 0,
+            jobs: jobs.max(1),
+            options,
+            grace_period_ms,
+            profile_suffix,
+            finished: Vec::new(),
+            received: 0,
+        }
+    }
+
+    /// Launches executables until `jobs` are active and streams the uploads in progress
+    fn update<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<()> {
+        // Launches that are being stopped doesn't count as they are about to be replaced
+        while self
+            .active
+            .values()
+            .filter(|launch| !launch.stopping)
+            .count()
+            < self.jobs
+        {
+            let path = match self.pending.pop_front() {
+                Some(path) => path,
+                None => break,
+            };
+
+            let id = self.next_id;
+            self.next_id += 1;
+
+            // Treated like a failed launch so the other executables still runs (the file may
+            // also be in the middle of being rebuilt when watching)
+            let upload = match Upload::begin(msg_stream, stream, id, &path, &self.options) {
+                Ok(upload) => upload,
+                Err(err) => {
+                    error!("Unable to launch {}: {}", path, err);
+                    self.finished.push(Finished {
+                        path,
+                        exit_code: LAUNCH_FAILED,
+                        wall_time: None,
+                    });
+                    continue;
+                }
+            };
 
-    // wait 30 ms for the reply, then just the client
+            self.active.insert(
+                id,
+                Launch {
+                    path,
+                    upload: Some(upload),
+                    stopping: false,
+                    started: false,
+                    profile: None,
+                },
+            );
+        }
+
+        for launch in self.active.values_mut() {
+            if let Some(upload) = launch.upload.as_mut() {
+                if upload.update(msg_stream, stream)? {
+                    launch.upload = None;
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Stops the running versions of `path` and launches it again. The runner still has the
+    /// old version cached so only the changes are uploaded.
+    fn restart<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        path: &str,
+    ) -> Result<()> {
+        for (id, launch) in self.active.iter_mut() {
+            if launch.path == path && !launch.stopping {
+                let request = StopLaunchRequest {
+                    id: *id,
+                    grace_period_ms: self.grace_period_ms,
+                };
+
+                msg_stream.begin_write_message(stream, &request, Messages::StopLaunchRequest)?;
+
+                // The runner drops a stopped upload, so the rest of it is never sent
+                launch.upload = None;
+                launch.stopping = true;
+            }
+        }
+
+        if !self.pending.iter().any(|pending| pending == path) {
+            self.pending.push_front(path.to_owned());
+        }
+
+        Ok(())
+    }
+
+    /// True when all executables has been run
+    fn is_done(&self) -> bool {
+        self.pending.is_empty() && self.active.is_empty()
+    }
+
+    /// Exit code of the first executable that failed, 0 if all of them succeeded
+    fn exit_code(&self) -> i32 {
+        self.finished
+            .iter()
+            .map(|finished| finished.exit_code)
+            .find(|code| *code != 0)
+            .unwrap_or(0)
+    }
+}
+
+/// Executable that is streamed to the remote runner in `CHUNK_SIZE` pieces
+struct Upload {
+    id: u32,
+    /// Shared with the message stream while chunks sent with sendfile are queued
+    file: Arc<File>,
+    size: u64,
+    /// What is left to send, the full file unless the runner has an older version of it
+    ops: VecDeque<DeltaOp>,
+    /// Set when the runner has replied that it doesn't have the executable cached
+    streaming: bool,
+}
 
-    for _ in 0..30 {
-        if let Some(msg) = msg_stream.update(stream)? {
+impl Upload {
+    /// Sends the LaunchExecutableRequest that starts the upload of `filename`
+    fn begin<S: Write + Read>(
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        id: u32,
+        filename: &str,
+        options: &LaunchOptions,
+    ) -> Result<Upload> {
+        let mut file = File::open(filename)?;
+        let size = file.metadata()?.len();
+
+        // The runner uses the hash to look the executable up in its cache
+        let mut hasher = Sha256::new();
+        std::io::copy(&mut file, &mut hasher)?;
+
+        let file_request = LaunchExecutableRequest {
+            id,
+            file_server: options.file_server,
+            interactive: options.interactive || options.pty,
+            pty: options.pty,
+            profile: options.profile,
+            process: options.process.clone(),
+            path: filename,
+            size,
+            hash: hasher.finalize().into(),
+        };
+
+        msg_stream.begin_write_message(stream, &file_request, Messages::LaunchExecutableRequest)?;
+
+        Ok(Upload {
+            id,
+            file: Arc::new(file),
+            size,
+            ops: VecDeque::from([DeltaOp::Literal {
+                offset: 0,
+                len: size,
+            }]),
+            streaming: false,
+        })
+    }
+
+    /// Called when the runner has asked for the executable. If it has an older version of it
+    /// (given by `signature`) only the changed parts are sent.
+    fn start(&mut self, signature: Option<&Signature>) -> Result<()> {
+        if let Some(signature) = signature {
+            // Read through once more, the chunks are sent with their offsets later
+            let mut file = &*self.file;
+            file.seek(SeekFrom::Start(0))?;
+
+            let ops = delta::compute_delta(&mut file, self.size, signature)?;
+
+            let literal: u64 = ops
+                .iter()
+                .map(|op| match op {
+                    DeltaOp::Literal { len, .. } => *len,
+                    DeltaOp::Copy { .. } => 0,
+                })
+                .sum();
+
+            info!(
+                "Delta upload: sending {} of {} bytes ({} ops)",
+                literal,
+                self.size,
+                ops.len()
+            );
+
+            self.ops = ops.into();
+        }
+
+        self.streaming = true;
+
+        Ok(())
+    }
+
+    /// Queues chunks of the file while there is room on the message stream.
+    /// Returns true when all of the file (and the end marker) has been queued
+    fn update<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<bool> {
+        if !self.streaming {
+            return Ok(false);
+        }
+
+        while msg_stream.queued_bytes() < MAX_QUEUED_UPLOAD {
+            match self.ops.front_mut() {
+                None => {
+                    trace!("Upload done");
+                    msg_stream.begin_write_message(
+                        stream,
+                        &ExecutableUploadEnd { id: self.id },
+                        Messages::ExecutableUploadEnd,
+                    )?;
+                    return Ok(true);
+                }
+
+                Some(DeltaOp::Copy { block, count }) => {
+                    let copy = ExecutableUploadCopy {
+                        id: self.id,
+                        block: *block,
+                        count: *count,
+                    };
+
+                    self.ops.pop_front();
+                    msg_stream.begin_write_message(
+                        stream,
+                        &copy,
+                        Messages::ExecutableUploadCopy,
+                    )?;
+                }
+
+                Some(DeltaOp::Literal { offset, len }) => {
+                    let (start, size) = (*offset, (*len as usize).min(CHUNK_SIZE));
+
+                    *offset += size as u64;
+                    *len -= size as u64;
+
+                    if *len == 0 {
+                        self.ops.pop_front();
+                    }
+
+                    // Sent as the data of a TextMessage, straight from the page cache only with
+                    // --no-compression (and no checksums) as compressing needs it in memory
+                    msg_stream.begin_write_file_message(
+                        stream,
+                        self.id,
+                        &self.id,
+                        &self.file,
+                        start,
+                        size,
+                        Messages::ExecutableUploadChunk,
+                    )?;
+                }
+            }
+        }
+
+        Ok(false)
+    }
+}
+
+/// Stops the executables on the runner. They get the grace period to exit after SIGTERM and
+/// their remaining output is written before the runner replies.
+fn close_down_exe<S: Write + Read>(
+    poll: &mut Poll,
+    events: &mut Events,
+    msg_stream: &mut MessageStream,
+    stream: &mut S,
+    launches: &mut Launches,
+    output: &mut Output,
+) -> Result<()> {
+    let stop_request = StopExecutableRequest {
+        grace_period_ms: launches.grace_period_ms,
+    };
+    msg_stream.begin_write_message(stream, &stop_request, Messages::StopExecutableRequest)?;
+
+    let grace = Duration::from_millis(launches.grace_period_ms as u64);
+    let mut deadline = Instant::now() + grace + STOP_REPLY_TIMEOUT;
+
+    loop {
+        while let Some(msg) = msg_stream.update(stream)? {
             if msg == Messages::StopExecutableReply {
                 trace!("StopExecutableReply received, closing down");
                 return Ok(());
             }
+
+            handle_incoming_msg(msg_stream, stream, launches, &mut None, output, msg)?;
+            deadline = deadline.max(Instant::now() + STOP_REPLY_TIMEOUT);
+        }
+
+        let now = Instant::now();
+        if now >= deadline {
+            break;
         }
 
-        std::thread::sleep(std::time::Duration::from_millis(1));
+        wait_for_events(poll, events, Some(deadline - now))?;
     }
 
     trace!("No reply from client, closing down anyway");
@@ -138,43 +770,727 @@ fn close_down_exe<S: Write + Read>(msg_stream: &mut MessageStream, stream: &mut
     Ok(())
 }
 
-pub fn host_loop(opts: &Opt, ip_address: &str) -> Result<()> {
-    let ip_adress: std::net::IpAddr = ip_address.parse()?;
-    let address = std::net::SocketAddr::new(ip_adress, opts.port);
+/// Watches the executables and reports the ones that has changed
+struct ExecutableWatcher {
+    _debouncer: Debouncer<notify_debouncer_mini::notify::RecommendedWatcher>,
+    changes: Receiver<PathBuf>,
+    /// Maps the canonical path of the watched files to the path they were given as
+    paths: HashMap<PathBuf, String>,
+}
 
-    let mut stream = TcpStream::connect(address)?;
+impl ExecutableWatcher {
+    /// The directories of the executables are watched rather than the files themselves so
+    /// builds that replace the file (by renaming a new one over it) are picked up as well
+    fn new(executables: &[String], waker: Arc<Waker>) -> Result<ExecutableWatcher> {
+        let (tx, rx) = channel();
 
-    handshake(&mut stream)?;
+        let mut debouncer = new_debouncer(
+            WATCH_DEBOUNCE,
+            None,
+            move |res: DebounceEventResult| match res {
+                Ok(events) => {
+                    for event in events {
+                        let _ = tx.send(event.path);
+                    }
+                    let _ = waker.wake();
+                }
+                Err(errors) => errors
+                    .iter()
+                    .for_each(|err| error!("Watch error: {:?}", err)),
+            },
+        )?;
 
-    // set non-blocking mode after handshake
-    stream.set_nonblocking(true)?;
+        let mut paths = HashMap::new();
+
+        for executable in executables {
+            let path = Path::new(executable);
+            let file_name = path
+                .file_name()
+                .ok_or_else(|| anyhow!("Unable to watch {}", executable))?;
+
+            let dir = match path.parent() {
+                Some(dir) if !dir.as_os_str().is_empty() => dir.canonicalize()?,
+                _ => std::env::current_dir()?,
+            };
+
+            if !paths
+                .keys()
+                .any(|p: &PathBuf| p.parent() == Some(dir.as_path()))
+            {
+                debouncer
+                    .watcher()
+                    .watch(&dir, RecursiveMode::NonRecursive)?;
+            }
+
+            paths.insert(dir.join(file_name), executable.clone());
+        }
+
+        Ok(ExecutableWatcher {
+            _debouncer: debouncer,
+            changes: rx,
+            paths,
+        })
+    }
+
+    /// Returns the executables that has changed since the last call
+    fn changed(&self) -> Vec<String> {
+        let mut changed = Vec::new();
+
+        for path in self.changes.try_iter() {
+            if let Some(executable) = self.paths.get(&path) {
+                if !changed.contains(executable) {
+                    changed.push(executable.clone());
+                }
+            }
+        }
+
+        changed
+    }
+}
+
+/// Forwards stdin of the host to the executable in interactive mode. Stdin is read on a
+/// thread of its own that wakes up the event loop when there is input.
+struct StdinForwarder {
+    input: Receiver<Vec<u8>>,
+    /// Input read before there is an executable running to send it to
+    pending: VecDeque<Vec<u8>>,
+}
+
+impl StdinForwarder {
+    fn new(waker: Arc<Waker>) -> StdinForwarder {
+        let (tx, rx) = channel();
+
+        std::thread::Builder::new()
+            .name("stdin".into())
+            .spawn(move || {
+                let mut stdin = std::io::stdin().lock();
+
+                loop {
+                    let mut buffer = vec![0; 4096];
+
+                    // The end of stdin is sent as empty input
+                    let size = match stdin.read(&mut buffer) {
+                        Ok(size) => size,
+                        Err(err) if err.kind() == std::io::ErrorKind::Interrupted => continue,
+                        Err(_) => 0,
+                    };
+
+                    buffer.truncate(size);
+
+                    if tx.send(buffer).is_err() {
+                        break;
+                    }
+
+                    let _ = waker.wake();
+
+                    if size == 0 {
+                        break;
+                    }
+                }
+            })
+            .expect("!thread");
+
+        StdinForwarder {
+            input: rx,
+            pending: VecDeque::new(),
+        }
+    }
+
+    /// Sends the input read so far to the first running executable
+    fn update<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        launches: &Launches,
+    ) -> Result<()> {
+        self.pending.extend(self.input.try_iter());
+
+        let id = match launches
+            .active
+            .iter()
+            .find(|(_, launch)| launch.started && !launch.stopping)
+        {
+            Some((id, _)) => *id,
+            None => return Ok(()),
+        };
+
+        for data in self.pending.drain(..) {
+            let msg = TextMessage { id, data: &data };
+            msg_stream.begin_write_message(stream, &msg, Messages::StdinInput)?;
+        }
+
+        Ok(())
+    }
+}
+
+/// Switches the terminal on stdin to raw mode so every keystroke is sent as is, restores it
+/// when dropped. Output processing is kept so our own messages still end up on a line each.
+struct RawTerminal {
+    saved: libc::termios,
+}
+
+impl RawTerminal {
+    /// Returns None if stdin isn't a terminal
+    fn new() -> Result<Option<RawTerminal>> {
+        unsafe {
+            if libc::isatty(libc::STDIN_FILENO) == 0 {
+                return Ok(None);
+            }
+
+            let mut saved: libc::termios = std::mem::zeroed();
+            if libc::tcgetattr(libc::STDIN_FILENO, &mut saved) < 0 {
+                return Err(std::io::Error::last_os_error().into());
+            }
+
+            let mut raw = saved;
+            libc::cfmakeraw(&mut raw);
+            raw.c_oflag |= libc::OPOST;
+
+            if libc::tcsetattr(libc::STDIN_FILENO, libc::TCSANOW, &raw) < 0 {
+                return Err(std::io::Error::last_os_error().into());
+            }
+
+            Ok(Some(RawTerminal { saved }))
+        }
+    }
+}
+
+impl Drop for RawTerminal {
+    fn drop(&mut self) {
+        unsafe { libc::tcsetattr(libc::STDIN_FILENO, libc::TCSANOW, &self.saved) };
+    }
+}
+
+/// Asks the runner for its metrics and prints them
+fn print_stats<S: Write + Read>(
+    poll: &mut Poll,
+    events: &mut Events,
+    msg_stream: &mut MessageStream,
+    stream: &mut S,
+    output: &mut Output,
+) -> Result<()> {
+    msg_stream.begin_write_message(stream, &StatsRequest::default(), Messages::StatsRequest)?;
+
+    loop {
+        while let Some(msg) = msg_stream.update(stream)? {
+            if msg == Messages::StatsReply {
+                let reply: StatsReply = bincode::deserialize(msg_stream.data())?;
+                return output.stdout(reply.text.as_bytes());
+            }
+        }
+
+        wait_for_events(poll, events, None)?;
+    }
+}
+
+/// Executables given on the command line, - reads a list of executables from stdin
+fn executables(filenames: &[String]) -> Result<Vec<String>> {
+    let mut executables = Vec::new();
+
+    for filename in filenames {
+        if filename == "-" {
+            for line in std::io::stdin().lines() {
+                let line = line?;
+                let line = line.trim();
+
+                if !line.is_empty() {
+                    executables.push(line.to_owned());
+                }
+            }
+        } else {
+            executables.push(filename.clone());
+        }
+    }
+
+    Ok(executables)
+}
+
+/// Address of a target given as an address or host name, with or without a port
+fn target_address(target: &str, port: u16) -> Result<SocketAddr> {
+    let mut addresses = match target.to_socket_addrs() {
+        Ok(addresses) => addresses,
+        Err(_) => (target, port).to_socket_addrs()?,
+    };
+
+    addresses
+        .next()
+        .ok_or_else(|| anyhow!("Unable to resolve {}", target))
+}
+
+/// Runs the executables on all the targets and returns the exit code for the host process: the
+/// first one that isn't 0 in the order the targets were given. Each target is run on a thread
+/// and connection of its own so a slow runner doesn't hold back the others.
+pub fn run(opts: &Opt) -> Result<i32> {
+    // Runners given more than once are only used once, so executables are uploaded once to each
+    let mut targets: Vec<&str> = Vec::new();
+    for target in &opts.target {
+        if !targets.contains(&target.as_str()) {
+            targets.push(target);
+        }
+    }
+
+    ensure!(!targets.is_empty(), "No target given (use --target)");
+
+    let executables = executables(&opts.filename)?;
+    let process = process_settings(opts)?;
+    let interrupt = Interrupt::install();
+
+    if let [target] = targets[..] {
+        let output = Output::new(None);
+        let result = host_loop(opts, target, executables, &process, output, &interrupt)?;
+        return Ok(result.exit_code);
+    }
+
+    ensure!(
+        !opts.interactive && !opts.pty,
+        "--interactive and --pty can only be used with a single target"
+    );
+
+    let results: Vec<(&str, Result<RunResult>, Duration)> = std::thread::scope(|scope| {
+        let threads: Vec<_> = targets
+            .iter()
+            .map(|target| {
+                let (executables, process, interrupt) = (executables.clone(), &process, &interrupt);
+                let output = Output::new(Some(format!("[{}] ", target)));
+
+                scope.spawn(move || {
+                    let started = Instant::now();
+                    let result = host_loop(opts, target, executables, process, output, interrupt);
+                    (*target, result, started.elapsed())
+                })
+            })
+            .collect();
+
+        threads
+            .into_iter()
+            .map(|thread| thread.join().expect("!thread"))
+            .collect()
+    });
+
+    print_summary(&results);
+
+    Ok(results
+        .iter()
+        .map(|(_, result, _)| match result {
+            Ok(result) => result.exit_code,
+            Err(_) => LAUNCH_FAILED,
+        })
+        .find(|code| *code != 0)
+        .unwrap_or(0))
+}
+
+/// Arguments, environment, working directory and scheduling of the executables from the
+/// command line
+fn process_settings(opts: &Opt) -> Result<ProcessSettings> {
+    let env = opts
+        .env
+        .iter()
+        .map(|var| match var.split_once('=') {
+            Some((name, value)) if !name.is_empty() => Ok((name.to_owned(), value.to_owned())),
+            _ => Err(anyhow!("Invalid --env {}, should be NAME=VALUE", var)),
+        })
+        .collect::<Result<Vec<_>>>()?;
+
+    let affinity = match opts.affinity.as_ref() {
+        Some(cpus) => parse_cpu_list(cpus)?,
+        None => Vec::new(),
+    };
+
+    Ok(ProcessSettings {
+        args: opts.args.clone(),
+        env,
+        cwd: opts.cwd.clone(),
+        affinity,
+        nice: opts.nice,
+    })
+}
+
+/// Parses a list of CPUs such as 0,2-3 (the format of taskset -c)
+fn parse_cpu_list(list: &str) -> Result<Vec<u32>> {
+    let mut cpus = Vec::new();
+
+    for part in list.split(',') {
+        let invalid = || anyhow!("Invalid CPU list {}, should be like 0,2-3", list);
+
+        let (first, last) = match part.split_once('-') {
+            Some((first, last)) => (first, last),
+            None => (part, part),
+        };
+
+        let first: u32 = first.trim().parse().map_err(|_| invalid())?;
+        let last: u32 = last.trim().parse().map_err(|_| invalid())?;
+        if first > last {
+            return Err(invalid());
+        }
+
+        cpus.extend(first..=last);
+    }
+
+    Ok(cpus)
+}
+
+/// Prints how every executable did on every target
+fn print_summary(results: &[(&str, Result<RunResult>, Duration)]) {
+    eprintln!("Summary:");
+
+    for (target, result, elapsed) in results {
+        let result = match result {
+            Ok(result) => result,
+            Err(err) => {
+                eprintln!("  {}: error: {}", target, err);
+                continue;
+            }
+        };
+
+        let failed = result.finished.iter().filter(|f| f.exit_code != 0).count();
+        let interrupted = match result.exit_code {
+            INTERRUPTED => ", interrupted",
+            _ => "",
+        };
+
+        eprintln!(
+            "  {}: {} executables, {} failed ({:.3}s{})",
+            target,
+            result.finished.len(),
+            failed,
+            elapsed.as_secs_f64(),
+            interrupted
+        );
+
+        for finished in &result.finished {
+            match finished.wall_time {
+                Some(wall_time) => eprintln!(
+                    "    {} exit code {} (wall {:.3}s)",
+                    finished.path,
+                    finished.exit_code,
+                    wall_time.as_secs_f64()
+                ),
+                None => eprintln!("    {} not run", finished.path),
+            }
+        }
+    }
+}
+
+/// Connects to the runner at `address` and does the handshake. Returns the (still blocking)
+/// stream, a message stream set up as agreed on in the handshake and the id of the session.
+fn connect(
+    opts: &Opt,
+    address: SocketAddr,
+    timeout: Option<Duration>,
+) -> Result<(std::net::TcpStream, MessageStream, u64)> {
+    let mut stream = match timeout {
+        Some(timeout) => std::net::TcpStream::connect_timeout(&address, timeout)?,
+        None => std::net::TcpStream::connect(address)?,
+    };
+
+    set_keepalive(&stream)?;
+    set_buffer_sizes(
+        &stream,
+        opts.send_buffer.map(|kb| kb * 1024),
+        opts.receive_buffer.map(|kb| kb * 1024),
+    )?;
+
+    // Messages are written a whole frame at a time (and output is coalesced on the runner) so
+    // Nagle's algorithm would only hold back the small ones, such as the handshake, replies and
+    // keystrokes, waiting for an ack
+    stream.set_nodelay(true)?;
+
+    let compression = match opts.no_compression {
+        true => 0,
+        false => COMPRESSION_ZSTD,
+    };
+
+    let features = match opts.checksum {
+        true => FEATURE_CHECKSUM,
+        false => 0,
+    };
+
+    let (compression, features, session) = handshake(&mut stream, compression, features)?;
 
     let mut msg_stream = MessageStream::new();
+    msg_stream.set_compression(compression & COMPRESSION_ZSTD != 0);
+    msg_stream.set_checksum(features & FEATURE_CHECKSUM != 0);
+    msg_stream.set_sendfile(&stream);
+
+    Ok((stream, msg_stream, session))
+}
+
+/// Connects to the runner again and reattaches to `session`, which the runner keeps around for
+/// a while after the connection was lost. Retries until the reattach timeout has passed.
+/// Returns the new connection, on which the runner sends the launch replies, output and exits
+/// from `offset` on, or None if interrupted by Ctrl-C.
+fn reattach(
+    opts: &Opt,
+    address: SocketAddr,
+    session: u64,
+    offset: u64,
+    interrupt: &Interrupt,
+) -> Result<Option<(std::net::TcpStream, MessageStream)>> {
+    let timeout = Duration::from_secs(opts.reattach_timeout);
+    let deadline = Instant::now() + timeout;
 
-    // read file to be sent
+    loop {
+        match try_reattach(opts, address, session, offset) {
+            Ok(Some((stream, msg_stream, lost))) => {
+                if lost > 0 {
+                    error!(
+                        "{} bytes of output from {} were lost while reattaching",
+                        lost, address
+                    );
+                }
+                return Ok(Some((stream, msg_stream)));
+            }
+            Ok(None) => bail!(
+                "Session {} on {} is gone, unable to reattach",
+                session,
+                address
+            ),
+            Err(err) => info!("Unable to reattach to {}: {}", address, err),
+        }
 
-    if let Some(target) = opts.filename.as_ref() {
-        send_file(&mut msg_stream, &mut stream, target)?;
+        let retry = Instant::now() + REATTACH_INTERVAL;
+        ensure!(
+            retry < deadline,
+            "Unable to reattach to {} within {:?}",
+            address,
+            timeout
+        );
+
+        while Instant::now() < retry {
+            if interrupt.is_set() {
+                return Ok(None);
+            }
+            std::thread::sleep(Duration::from_millis(100));
+        }
     }
+}
 
-    // setup ctrl-c handler
-    let (tx, rx) = channel();
+/// Returns the new connection and the number of bytes from `offset` that the runner no longer
+/// has, or None if the session is gone
+fn try_reattach(
+    opts: &Opt,
+    address: SocketAddr,
+    session: u64,
+    offset: u64,
+) -> Result<Option<(std::net::TcpStream, MessageStream, u64)>> {
+    let (mut stream, mut msg_stream, _) = connect(opts, address, Some(REATTACH_CONNECT_TIMEOUT))?;
 
-    ctrlc::set_handler(move || tx.send(()).expect("Could not send signal on channel."))
-        .expect("Error setting Ctrl-C handler");
+    // Still blocking, but a network that is down shouldn't hang it
+    stream.set_read_timeout(Some(REATTACH_CONNECT_TIMEOUT))?;
+    let deadline = Instant::now() + REATTACH_CONNECT_TIMEOUT;
+
+    msg_stream.begin_write_message(
+        &mut stream,
+        &ReattachRequest { session, offset },
+        Messages::ReattachRequest,
+    )?;
 
-    //
     loop {
-        if let Some(msg) = msg_stream.update(&mut stream).unwrap() {
-            handle_incoming_msg(&mut msg_stream, &mut stream, msg).unwrap();
+        match msg_stream.update(&mut stream)? {
+            Some(Messages::ReattachReply) => break,
+            Some(msg) => bail!("Incorrect message returned for ReattachRequest {:?}", msg),
+            None => ensure!(Instant::now() < deadline, "No reply to ReattachRequest"),
         }
+    }
+
+    let reply: ReattachReply = bincode::deserialize(msg_stream.data())?;
+    if !reply.attached {
+        return Ok(None);
+    }
+
+    stream.set_read_timeout(None)?;
+
+    Ok(Some((stream, msg_stream, reply.lost)))
+}
+
+/// Runs `executables` on `target`
+fn host_loop(
+    opts: &Opt,
+    target: &str,
+    executables: Vec<String>,
+    process: &ProcessSettings,
+    mut output: Output,
+    interrupt: &Interrupt,
+) -> Result<RunResult> {
+    let address = target_address(target, opts.port)?;
+    let (stream, mut msg_stream, session) = connect(opts, address, None)?;
+
+    // set non-blocking mode after handshake
+    stream.set_nonblocking(true)?;
+
+    let mut stream = TcpStream::from_std(stream);
+    let mut poll = Poll::new()?;
+    let mut events = Events::with_capacity(16);
+
+    poll.registry()
+        .register(&mut stream, SOCKET, Interest::READABLE | Interest::WRITABLE)?;
+
+    let pool = Arc::new(BufferPool::default());
+    msg_stream.set_payload_pool(pool.clone());
+
+    if opts.stats {
+        print_stats(
+            &mut poll,
+            &mut events,
+            &mut msg_stream,
+            &mut stream,
+            &mut output,
+        )?;
+        output.finish()?;
+        return Ok(RunResult::default());
+    }
+
+    let mut files = opts
+        .file_root
+        .as_ref()
+        .map(|root| FileHost::new(Path::new(root), pool.clone()));
+
+    // Only one waker can be registered so it's shared between ctrl-c and the watcher
+    let waker = Arc::new(Waker::new(poll.registry(), WAKER)?);
+    interrupt.register(waker.clone());
+
+    let watcher = match opts.watch {
+        true => Some(ExecutableWatcher::new(&executables, waker.clone())?),
+        false => None,
+    };
+
+    let interactive = opts.interactive || opts.pty;
+
+    let options = LaunchOptions {
+        file_server: files.is_some(),
+        interactive,
+        pty: opts.pty,
+        profile: opts.profile,
+        process: process.clone(),
+    };
 
-        if rx.try_recv().is_ok() {
-            trace!("Ctrl-C received, closing down");
-            return close_down_exe(&mut msg_stream, &mut stream);
+    // The profiles are written next to the executables so perf finds the symbols, with the
+    // target in the name when there are several
+    let profile_suffix = match output.prefix.is_some() {
+        true => format!(".{}.perf.data", target),
+        false => ".perf.data".to_owned(),
+    };
+
+    let mut launches = Launches::new(
+        executables,
+        opts.jobs,
+        options,
+        opts.grace_period,
+        profile_suffix,
+    );
+
+    let mut stdin = match interactive {
+        true => Some(StdinForwarder::new(waker.clone())),
+        false => None,
+    };
+
+    // Restored when the host exits
+    let _raw_terminal = match opts.pty {
+        true => RawTerminal::new()?,
+        false => None,
+    };
+
+    loop {
+        let result = (|| -> Result<RunResult> {
+            loop {
+                // Handle everything that is ready before waiting for new events
+                while let Some(msg) = msg_stream.update(&mut stream)? {
+                    handle_incoming_msg(
+                        &mut msg_stream,
+                        &mut stream,
+                        &mut launches,
+                        &mut files,
+                        &mut output,
+                        msg,
+                    )?;
+                }
+
+                if let Some(watcher) = watcher.as_ref() {
+                    for path in watcher.changed() {
+                        info!("{} changed, relaunching", path);
+                        launches.restart(&mut msg_stream, &mut stream, &path)?;
+                    }
+                }
+
+                // Launches the next executables and sends the uploads in progress
+                launches.update(&mut msg_stream, &mut stream)?;
+
+                if let Some(stdin) = stdin.as_mut() {
+                    stdin.update(&mut msg_stream, &mut stream, &launches)?;
+                }
+
+                // Keeps running until Ctrl-C when watching
+                if watcher.is_none() && launches.is_done() {
+                    trace!("All executables has exited, closing down");
+                    while !msg_stream.flush(&mut stream)? {
+                        wait_for_events(&mut poll, &mut events, None)?;
+                    }
+                    output.finish()?;
+                    return Ok(RunResult {
+                        exit_code: launches.exit_code(),
+                        finished: std::mem::take(&mut launches.finished),
+                    });
+                }
+
+                if interrupt.is_set() {
+                    trace!("Ctrl-C received, closing down");
+                    close_down_exe(
+                        &mut poll,
+                        &mut events,
+                        &mut msg_stream,
+                        &mut stream,
+                        &mut launches,
+                        &mut output,
+                    )?;
+                    output.finish()?;
+                    return Ok(RunResult {
+                        exit_code: INTERRUPTED,
+                        finished: std::mem::take(&mut launches.finished),
+                    });
+                }
+
+                wait_for_events(&mut poll, &mut events, None)?;
+            }
+        })();
+
+        let error = match result {
+            Ok(result) => return Ok(result),
+            Err(error) => error,
+        };
+
+        // The runner keeps the executables running for a while if the connection is lost, so
+        // they are reattached to instead of failing
+        if !is_disconnect(&error) || opts.reattach_timeout == 0 || launches.is_done() {
+            return Err(error);
         }
 
-        // don't hammer the CPU
-        std::thread::sleep(std::time::Duration::from_millis(1));
+        error!(
+            "Connection to {} lost ({}), reattaching to session {}",
+            target, error, session
+        );
+
+        poll.registry().deregister(&mut stream)?;
+
+        let (new_stream, new_msg_stream) =
+            match reattach(opts, address, session, launches.received, interrupt)? {
+                Some(connection) => connection,
+                None => {
+                    output.finish()?;
+                    return Ok(RunResult {
+                        exit_code: INTERRUPTED,
+                        finished: launches.finished,
+                    });
+                }
+            };
+
+        info!("Reattached to session {} on {}", session, target);
+
+        new_stream.set_nonblocking(true)?;
+        stream = TcpStream::from_std(new_stream);
+        poll.registry()
+            .register(&mut stream, SOCKET, Interest::READABLE | Interest::WRITABLE)?;
+
+        msg_stream = new_msg_stream;
+        msg_stream.set_payload_pool(pool.clone());
     }
 }
@@ -0,0 +1,99 @@
+use mio::Waker;
+use std::{
+    collections::VecDeque,
+    sync::{Arc, Mutex},
+};
+
+struct State {
+    running: usize,
+    /// Sessions waiting for a slot in the order they asked for one
+    waiting: VecDeque<(u64, Arc<Waker>)>,
+}
+
+/// Limits the number of executables running at the same time on the runner. Sessions that want
+/// to launch when all slots are taken are queued and woken up in order as slots are released.
+pub struct LaunchQueue {
+    max_running: usize,
+    state: Mutex<State>,
+}
+
+/// A slot for a running executable, released when dropped
+pub struct LaunchSlot {
+    queue: Arc<LaunchQueue>,
+}
+
+impl LaunchQueue {
+    pub fn new(max_running: usize) -> LaunchQueue {
+        LaunchQueue {
+            max_running: max_running.max(1),
+            state: Mutex::new(State {
+                running: 0,
+                waiting: VecDeque::new(),
+            }),
+        }
+    }
+
+    /// Takes a slot for `session` if one is free and no session queued before it is waiting.
+    /// Otherwise the session is queued and `waker` is woken up when it's its turn.
+    pub fn try_acquire(
+        queue: &Arc<LaunchQueue>,
+        session: u64,
+        waker: &Arc<Waker>,
+    ) -> Option<LaunchSlot> {
+        let mut state = queue.state.lock().unwrap();
+
+        let first = match state.waiting.front() {
+            Some((id, _)) => *id == session,
+            None => true,
+        };
+
+        if first && state.running < queue.max_running {
+            if !state.waiting.is_empty() {
+                state.waiting.pop_front();
+            }
+
+            state.running += 1;
+            queue.wake_next(&state);
+
+            return Some(LaunchSlot {
+                queue: queue.clone(),
+            });
+        }
+
+        if !state.waiting.iter().any(|(id, _)| *id == session) {
+            state.waiting.push_back((session, waker.clone()));
+        }
+
+        None
+    }
+
+    /// Removes a session that no longer wants to launch from the queue
+    pub fn cancel(&self, session: u64) {
+        let mut state = self.state.lock().unwrap();
+        state.waiting.retain(|(id, _)| *id != session);
+        self.wake_next(&state);
+    }
+
+    /// Number of running executables and sessions waiting to launch one
+    pub fn status(&self) -> (usize, usize) {
+        let state = self.state.lock().unwrap();
+        (state.running, state.waiting.len())
+    }
+
+    /// Wakes up the first waiting session if there is a free slot for it
+    fn wake_next(&self, state: &State) {
+        if state.running < self.max_running {
+            if let Some((_, waker)) = state.waiting.front() {
+                let _ = waker.wake();
+            }
+        }
+    }
+}
+
+impl Drop for LaunchSlot {
+    fn drop(&mut self) {
+        let mut state = self.queue.state.lock().unwrap();
+        state.running -= 1;
+        self.queue.wake_next(&state);
+    }
+}
@@ -0,0 +1,565 @@
+use crate::messages::ResourceUsage;
+use anyhow::*;
+use core::result::Result::Ok;
+use log::{error, info, trace};
+use mio::Waker;
+use serde::{Deserialize, Serialize};
+use std::{
+    collections::HashMap,
+    ffi::CString,
+    fs::File,
+    os::unix::ffi::OsStrExt,
+    os::unix::io::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+    os::unix::process::ExitStatusExt,
+    path::Path,
+    process::ExitStatus,
+    sync::atomic::{AtomicU64, Ordering},
+    sync::mpsc::{channel, Sender},
+    sync::{Arc, Mutex},
+    thread,
+};
+
+/// Max size of a request or event sent between the runner and the launcher
+const MAX_PACKET_SIZE: usize = 64 * 1024;
+/// Number of file descriptors sent with a spawn request (stdout and stderr)
+const SPAWN_FDS: usize = 2;
+
+#[derive(Serialize, Deserialize, Debug)]
+enum Request {
+    /// Starts `path` with `args` and `env` added to the environment. The write ends of the
+    /// stdout and stderr pipes are sent with the request.
+    Spawn {
+        id: u64,
+        path: Vec<u8>,
+        args: Vec<String>,
+        env: Vec<(String, String)>,
+    },
+}
+
+#[derive(Serialize, Deserialize, Debug)]
+enum Event {
+    Spawned {
+        id: u64,
+        pid: i32,
+    },
+    SpawnFailed {
+        id: u64,
+        errno: i32,
+    },
+    Exited {
+        pid: i32,
+        status: i32,
+        usage: ResourceUsage,
+    },
+}
+
+/// Resource usage as reported by wait4
+pub fn resource_usage(usage: &libc::rusage) -> ResourceUsage {
+    let time_us = |tv: libc::timeval| tv.tv_sec as u64 * 1_000_000 + tv.tv_usec as u64;
+
+    ResourceUsage {
+        user_time_us: time_us(usage.ru_utime),
+        system_time_us: time_us(usage.ru_stime),
+        // Given in kilobytes on Linux
+        max_rss_kb: usage.ru_maxrss as u64,
+        major_faults: usage.ru_majflt as u64,
+    }
+}
+
+/// Sends `data` as a single packet with `fds` attached
+fn send_packet(socket: RawFd, data: &[u8], fds: &[RawFd]) -> std::io::Result<()> {
+    let mut iov = libc::iovec {
+        iov_base: data.as_ptr() as *mut libc::c_void,
+        iov_len: data.len(),
+    };
+
+    let fds_size = std::mem::size_of_val(fds) as u32;
+    let mut control = vec![0u8; unsafe { libc::CMSG_SPACE(fds_size) } as usize];
+
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+
+    if !fds.is_empty() {
+        msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+        msg.msg_controllen = control.len() as _;
+
+        unsafe {
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN(fds_size) as _;
+            std::ptr::copy_nonoverlapping(
+                fds.as_ptr() as *const u8,
+                libc::CMSG_DATA(cmsg),
+                fds_size as usize,
+            );
+        }
+    }
+
+    loop {
+        if unsafe { libc::sendmsg(socket, &msg, libc::MSG_NOSIGNAL) } >= 0 {
+            return Ok(());
+        }
+
+        let err = std::io::Error::last_os_error();
+        if err.kind() != std::io::ErrorKind::Interrupted {
+            return Err(err);
+        }
+    }
+}
+
+/// Receives a packet to `buffer` and the file descriptors attached to it. Returns the size of
+/// the packet, 0 when the other end has closed the socket.
+fn recv_packet(socket: RawFd, buffer: &mut [u8], fds: &mut Vec<OwnedFd>) -> std::io::Result<usize> {
+    let mut iov = libc::iovec {
+        iov_base: buffer.as_mut_ptr() as *mut libc::c_void,
+        iov_len: buffer.len(),
+    };
+
+    let fds_size = (SPAWN_FDS * std::mem::size_of::<RawFd>()) as u32;
+    let mut control = vec![0u8; unsafe { libc::CMSG_SPACE(fds_size) } as usize];
+
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = control.len() as _;
+
+    let size = loop {
+        let size = unsafe { libc::recvmsg(socket, &mut msg, libc::MSG_CMSG_CLOEXEC) };
+        if size >= 0 {
+            break size as usize;
+        }
+
+        let err = std::io::Error::last_os_error();
+        if err.kind() != std::io::ErrorKind::Interrupted {
+            return Err(err);
+        }
+    };
+
+    unsafe {
+        let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                let data = libc::CMSG_DATA(cmsg) as *const RawFd;
+                let count = ((*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize)
+                    / std::mem::size_of::<RawFd>();
+
+                for i in 0..count {
+                    fds.push(OwnedFd::from_raw_fd(std::ptr::read_unaligned(data.add(i))));
+                }
+            }
+            cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+    }
+
+    Ok(size)
+}
+
+/// Exit of a child started by the launcher, set by the event reader
+struct ExitSlot {
+    exit: Mutex<Option<(ExitStatus, ResourceUsage)>>,
+    waker: Arc<Waker>,
+}
+
+/// Child process started by the launcher. It's a child of the launcher so it's reaped there
+/// and the exit is reported back to the runner.
+pub struct LaunchedChild {
+    pid: u32,
+    slot: Arc<ExitSlot>,
+}
+
+impl LaunchedChild {
+    pub fn id(&self) -> u32 {
+        self.pid
+    }
+
+    pub fn kill(&self) -> std::io::Result<()> {
+        self.signal(libc::SIGKILL)
+    }
+
+    /// Sends `signal` to the child unless it has exited
+    pub fn signal(&self, signal: libc::c_int) -> std::io::Result<()> {
+        // Once the exit is known the pid may have been reused
+        if self.slot.exit.lock().unwrap().is_some() {
+            return Ok(());
+        }
+
+        if unsafe { libc::kill(self.pid as libc::pid_t, signal) } < 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+
+        Ok(())
+    }
+
+    /// Exit status and resource usage if it has exited
+    pub fn try_wait(&self) -> Option<(ExitStatus, ResourceUsage)> {
+        *self.slot.exit.lock().unwrap()
+    }
+}
+
+#[derive(Default)]
+struct LauncherState {
+    /// Spawn requests waiting for a reply, with the waker for the session that sent them
+    pending: HashMap<u64, (Sender<Result<LaunchedChild>>, Arc<Waker>)>,
+    /// Running children by pid
+    running: HashMap<i32, Arc<ExitSlot>>,
+    /// Cleared if the launcher process has gone away
+    alive: bool,
+}
+
+/// Small helper process that starts executables for the runner. It's forked when the runner
+/// starts so it stays small and single threaded no matter how large the runner grows, which
+/// keeps the cost of starting a process low and flat.
+pub struct Launcher {
+    socket: OwnedFd,
+    state: Arc<Mutex<LauncherState>>,
+    next_id: AtomicU64,
+}
+
+impl Launcher {
+    /// Forks the launcher process. Has to be called before any other threads are started.
+    pub fn start() -> Result<Launcher> {
+        let mut fds = [0; 2];
+        let res = unsafe {
+            libc::socketpair(
+                libc::AF_UNIX,
+                libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC,
+                0,
+                fds.as_mut_ptr(),
+            )
+        };
+
+        if res < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        let (runner_end, launcher_end) =
+            unsafe { (OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])) };
+
+        match unsafe { libc::fork() } {
+            -1 => return Err(std::io::Error::last_os_error().into()),
+            0 => {
+                drop(runner_end);
+                run_launcher(launcher_end);
+            }
+            pid => info!("Started launcher process {}", pid),
+        }
+
+        drop(launcher_end);
+
+        let state = Arc::new(Mutex::new(LauncherState {
+            alive: true,
+            ..Default::default()
+        }));
+
+        let socket = runner_end.as_raw_fd();
+        let reader_state = state.clone();
+
+        thread::Builder::new()
+            .name("launcher_events".into())
+            .spawn(move || read_events(socket, &reader_state))
+            .expect("!thread");
+
+        Ok(Launcher {
+            socket: runner_end,
+            state,
+            next_id: AtomicU64::new(0),
+        })
+    }
+
+    /// Starts `path` with `args` and stdout and stderr going to the given pipes. `waker` is
+    /// woken up when it has exited.
+    pub fn spawn(
+        &self,
+        path: &Path,
+        args: Vec<String>,
+        env: Vec<(String, String)>,
+        stdout: &File,
+        stderr: &File,
+        waker: Arc<Waker>,
+    ) -> Result<LaunchedChild> {
+        let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+        let (tx, rx) = channel();
+
+        {
+            let mut state = self.state.lock().unwrap();
+            ensure!(state.alive, "Launcher process has exited");
+            state.pending.insert(id, (tx, waker));
+        }
+
+        let request = bincode::serialize(&Request::Spawn {
+            id,
+            path: path.as_os_str().as_bytes().to_vec(),
+            args,
+            env,
+        })?;
+
+        if let Err(err) = send_packet(
+            self.socket.as_raw_fd(),
+            &request,
+            &[stdout.as_raw_fd(), stderr.as_raw_fd()],
+        ) {
+            self.state.lock().unwrap().pending.remove(&id);
+            return Err(err.into());
+        }
+
+        rx.recv()
+            .map_err(|_| anyhow!("Launcher process has exited"))?
+    }
+}
+
+/// Dispatches the events from the launcher process to the sessions
+fn read_events(socket: RawFd, state: &Mutex<LauncherState>) {
+    let mut buffer = vec![0u8; MAX_PACKET_SIZE];
+    let mut fds = Vec::new();
+
+    loop {
+        let size = match recv_packet(socket, &mut buffer, &mut fds) {
+            Ok(0) => break,
+            Ok(size) => size,
+            Err(err) => {
+                error!("Unable to read from launcher: {}", err);
+                break;
+            }
+        };
+
+        let event: Event = match bincode::deserialize(&buffer[..size]) {
+            Ok(event) => event,
+            Err(err) => {
+                error!("Invalid event from launcher: {}", err);
+                continue;
+            }
+        };
+
+        trace!("Launcher event {:?}", event);
+
+        let mut state = state.lock().unwrap();
+
+        match event {
+            Event::Spawned { id, pid } => {
+                if let Some((tx, waker)) = state.pending.remove(&id) {
+                    let slot = Arc::new(ExitSlot {
+                        exit: Mutex::new(None),
+                        waker,
+                    });
+                    state.running.insert(pid, slot.clone());
+                    let _ = tx.send(Ok(LaunchedChild {
+                        pid: pid as u32,
+                        slot,
+                    }));
+                }
+            }
+
+            Event::SpawnFailed { id, errno } => {
+                if let Some((tx, _)) = state.pending.remove(&id) {
+                    let err = std::io::Error::from_raw_os_error(errno);
+                    let _ = tx.send(Err(err.into()));
+                }
+            }
+
+            Event::Exited { pid, status, usage } => {
+                if let Some(slot) = state.running.remove(&pid) {
+                    *slot.exit.lock().unwrap() = Some((ExitStatus::from_raw(status), usage));
+                    let _ = slot.waker.wake();
+                }
+            }
+        }
+    }
+
+    error!("Launcher process has exited");
+
+    // The exit of the children can't be known any more so they are killed and reported as such
+    let mut state = state.lock().unwrap();
+    state.alive = false;
+    state.pending.clear();
+
+    for (pid, slot) in state.running.drain() {
+        unsafe { libc::kill(pid, libc::SIGKILL) };
+        *slot.exit.lock().unwrap() = Some((
+            ExitStatus::from_raw(libc::SIGKILL),
+            ResourceUsage::default(),
+        ));
+        let _ = slot.waker.wake();
+    }
+}
+
+/// Environment for a child, the environment of the launcher with `env` added
+fn child_env(env: &[(String, String)]) -> Vec<CString> {
+    let mut vars: Vec<CString> = std::env::vars_os()
+        .filter(|(name, _)| !env.iter().any(|(n, _)| n.as_bytes() == name.as_bytes()))
+        .filter_map(|(name, value)| {
+            let mut var = name.as_bytes().to_vec();
+            var.push(b'=');
+            var.extend_from_slice(value.as_bytes());
+            CString::new(var).ok()
+        })
+        .collect();
+
+    vars.extend(
+        env.iter()
+            .filter_map(|(name, value)| CString::new(format!("{}={}", name, value)).ok()),
+    );
+
+    vars
+}
+
+/// Starts `path` with stdout and stderr redirected to `fds`. Returns the pid or errno.
+fn spawn(
+    path: &[u8],
+    args: &[String],
+    env: &[(String, String)],
+    fds: &[OwnedFd],
+) -> Result<i32, i32> {
+    let path = CString::new(path).map_err(|_| libc::EINVAL)?;
+    let args = args
+        .iter()
+        .map(|arg| CString::new(arg.as_str()))
+        .collect::<Result<Vec<_>, _>>()
+        .map_err(|_| libc::EINVAL)?;
+    let mut argv: Vec<*const libc::c_char> = std::iter::once(path.as_ptr())
+        .chain(args.iter().map(|arg| arg.as_ptr()))
+        .collect();
+    argv.push(std::ptr::null());
+    let env = child_env(env);
+    let mut envp: Vec<*const libc::c_char> = env.iter().map(|v| v.as_ptr()).collect();
+    envp.push(std::ptr::null());
+
+    unsafe {
+        let mut actions: libc::posix_spawn_file_actions_t = std::mem::zeroed();
+        let mut attr: libc::posix_spawnattr_t = std::mem::zeroed();
+        libc::posix_spawn_file_actions_init(&mut actions);
+        libc::posix_spawnattr_init(&mut attr);
+
+        libc::posix_spawn_file_actions_adddup2(&mut actions, fds[0].as_raw_fd(), 1);
+        libc::posix_spawn_file_actions_adddup2(&mut actions, fds[1].as_raw_fd(), 2);
+
+        // SIGCHLD is blocked in the launcher, the child should start out with nothing blocked
+        let mut mask: libc::sigset_t = std::mem::zeroed();
+        libc::sigemptyset(&mut mask);
+        libc::posix_spawnattr_setsigmask(&mut attr, &mask);
+        libc::posix_spawnattr_setflags(&mut attr, libc::POSIX_SPAWN_SETSIGMASK as _);
+
+        let mut pid = 0;
+        let res = libc::posix_spawn(
+            &mut pid,
+            path.as_ptr(),
+            &actions,
+            &attr,
+            argv.as_ptr() as *const *mut libc::c_char,
+            envp.as_ptr() as *const *mut libc::c_char,
+        );
+
+        libc::posix_spawn_file_actions_destroy(&mut actions);
+        libc::posix_spawnattr_destroy(&mut attr);
+
+        match res {
+            0 => Ok(pid),
+            errno => Err(errno),
+        }
+    }
+}
+
+/// Main loop of the launcher process. Starts executables on request and reports back when
+/// they have exited, until the runner closes the socket.
+fn run_launcher(socket: OwnedFd) -> ! {
+    let socket = socket.as_raw_fd();
+
+    // Exits are picked up through a signalfd so everything can be handled in one poll loop
+    let signal_fd = unsafe {
+        let mut mask: libc::sigset_t = std::mem::zeroed();
+        libc::sigemptyset(&mut mask);
+        libc::sigaddset(&mut mask, libc::SIGCHLD);
+        libc::sigprocmask(libc::SIG_BLOCK, &mask, std::ptr::null_mut());
+        libc::signalfd(-1, &mask, libc::SFD_CLOEXEC)
+    };
+
+    let mut buffer = vec![0u8; MAX_PACKET_SIZE];
+    let mut fds = Vec::new();
+
+    loop {
+        let mut pfds = [
+            libc::pollfd {
+                fd: socket,
+                events: libc::POLLIN,
+                revents: 0,
+            },
+            libc::pollfd {
+                fd: signal_fd,
+                events: libc::POLLIN,
+                revents: 0,
+            },
+        ];
+
+        if unsafe { libc::poll(pfds.as_mut_ptr(), 2, -1) } < 0 {
+            continue;
+        }
+
+        if pfds[0].revents != 0 {
+            fds.clear();
+            let size = match recv_packet(socket, &mut buffer, &mut fds) {
+                Ok(0) | Err(_) => unsafe { libc::_exit(0) },
+                Ok(size) => size,
+            };
+
+            if let Ok(Request::Spawn {
+                id,
+                path,
+                args,
+                env,
+            }) = bincode::deserialize(&buffer[..size])
+            {
+                let event = match fds.len() {
+                    SPAWN_FDS => match spawn(&path, &args, &env, &fds) {
+                        Ok(pid) => Event::Spawned { id, pid },
+                        Err(errno) => Event::SpawnFailed { id, errno },
+                    },
+                    _ => Event::SpawnFailed {
+                        id,
+                        errno: libc::EBADF,
+                    },
+                };
+
+                // The pipes are only needed by the child
+                fds.clear();
+
+                if let Ok(data) = bincode::serialize(&event) {
+                    let _ = send_packet(socket, &data, &[]);
+                }
+            }
+        }
+
+        if pfds[1].revents != 0 {
+            let mut info: libc::signalfd_siginfo = unsafe { std::mem::zeroed() };
+            unsafe {
+                libc::read(
+                    signal_fd,
+                    &mut info as *mut _ as *mut libc::c_void,
+                    std::mem::size_of_val(&info),
+                )
+            };
+
+            // Signals are merged so all children that has exited are reaped
+            loop {
+                let mut status = 0;
+                let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+                let pid = unsafe { libc::wait4(-1, &mut status, libc::WNOHANG, &mut usage) };
+
+                if pid <= 0 {
+                    break;
+                }
+
+                let event = Event::Exited {
+                    pid,
+                    status,
+                    usage: resource_usage(&usage),
+                };
+
+                if let Ok(data) = bincode::serialize(&event) {
+                    let _ = send_packet(socket, &data, &[]);
+                }
+            }
+        }
+    }
+}
@@ -1,8 +1,17 @@
+mod bench;
+mod delta;
+mod exe_cache;
+mod file_server;
 mod host;
+mod launch_queue;
+mod launcher;
 mod message_stream;
 mod messages;
+mod metrics;
 mod options;
+mod output_pipe;
 mod remote_runner;
+mod spool;
 mod tests;
 use clap::Parser;
 
@@ -28,12 +37,15 @@ fn main() -> Result<()> {
         .with_colors(true)
         .init()?;
 
-    if opt.remote_runner {
+    if opt.bench {
+        bench::run()?;
+    } else if opt.remote_runner {
         println!("Starting remote-runner");
         remote_runner::update(&opt);
     } else {
         println!("Starting host");
-        host::host_loop(&opt, opt.target.as_ref().unwrap())?;
+        let exit_code = host::run(&opt)?;
+        std::process::exit(exit_code);
     }
 
     Ok(())
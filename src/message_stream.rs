@@ -1,180 +1,923 @@
 use crate::messages::Messages;
+use crate::metrics::METRICS;
+use crate::output_pipe::{self, BufferPool};
 use anyhow::*;
 use core::result::Result::Ok;
 use log::trace;
+use mio::{Events, Poll};
 use serde::ser::Serialize;
-use std::collections::hash_map::DefaultHasher;
-use std::hash::Hasher;
-use std::io::{Read, Write};
+use std::collections::VecDeque;
+use std::fs::File;
+use std::io::{IoSlice, Read, Write};
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::Duration;
+use xxhash_rust::xxh3::{xxh3_64, Xxh3};
+use zstd::zstd_safe::{
+    self, zstd_sys::ZSTD_EndDirective, CCtx, CParameter, DCtx, InBuffer, OutBuffer,
+};
 
-/// These are all the states that is needed to write to the output
-/// This supports writing it non-blocking fashion and can pickup where it left of.
+/// Size of the fixed header used for the handshake: type, flags and a 48 bit big endian size
+const LEGACY_HEADER_SIZE: usize = 8;
+/// Size of the checksum that ends the header when `FLAG_CHECKSUM` is set
+const CHECKSUM_SIZE: usize = 8;
+/// Max size of a LEB128 encoded u64
+const MAX_VARINT_SIZE: usize = 10;
+/// Max size of the header in front of every message: type, flags, size, stream id and checksum.
+/// This much space is reserved in front of the message data and the header is written right
+/// before the data once the size is known.
+const MAX_HEADER_SIZE: usize = 2 + 2 * MAX_VARINT_SIZE + CHECKSUM_SIZE;
+/// Size limit of a message (both as sent and decompressed). The size in a header comes from
+/// the remote end, so larger messages are refused before anything is allocated for them. The
+/// largest messages sent are batches of output and the signatures of large executables, well
+/// below this.
+const MAX_MESSAGE_SIZE: u64 = 64 * 1024 * 1024;
+/// Incoming data is read ahead in blocks of this size so several small messages can be read
+/// with a single read. Larger messages are read directly to their buffer.
+const READ_AHEAD_SIZE: usize = 4 * 1024;
+/// Number of data buffers from written messages that are kept around for reuse
+const MAX_SPARE_BUFFERS: usize = 8;
+/// Max number of buffers handed to a single vectored write
+const MAX_IO_SLICES: usize = 64;
+/// Set in the flags byte of the header when the message data is zstd compressed
+const FLAG_COMPRESSED: u8 = 1;
+/// Set in the flags byte of the header when it's followed by an xxh3 checksum of the data (as
+/// sent, after compression)
+const FLAG_CHECKSUM: u8 = 2;
+/// Set when the size is followed by the id of the stream (such as the launch) the message
+/// belongs to
+const FLAG_STREAM: u8 = 4;
+/// Set when the header uses the compact layout with varint sizes. Only the handshake is sent
+/// with the legacy layout (so any version can read it and detect the version miss-match).
+const FLAG_COMPACT: u8 = 8;
+const KNOWN_FLAGS: u8 = FLAG_COMPRESSED | FLAG_CHECKSUM | FLAG_STREAM | FLAG_COMPACT;
+/// Smallest receive buffer, all messages up to this size share the same class
+const MIN_RECEIVE_CLASS: usize = 4 * 1024;
+/// Messages larger than this get a buffer of their own that is dropped once it has been used
+const MAX_RECEIVE_CLASS: usize = 16 * 1024 * 1024;
+/// Number of buffers kept for each class, one for the compressed and one for the plain data
+const BUFFERS_PER_CLASS: usize = 2;
+/// Messages smaller than this are never compressed so small messages don't get extra latency
+const COMPRESSION_THRESHOLD: usize = 1024;
+/// Output is latency sensitive so it uses one of the fast (negative) zstd levels
+const OUTPUT_COMPRESSION_LEVEL: i32 = -1;
+/// Executables and profiles are compressed harder as they usually compress well and are sent once
+const UPLOAD_COMPRESSION_LEVEL: i32 = 3;
+
+/// zstd level to use for a message type, None for messages that aren't worth compressing
+fn compression_level(msg_type: Messages) -> Option<i32> {
+    match msg_type {
+        Messages::StdoutOutput | Messages::StderrOutput | Messages::ReadReply => {
+            Some(OUTPUT_COMPRESSION_LEVEL)
+        }
+        Messages::ExecutableUploadChunk | Messages::ProfileData => Some(UPLOAD_COMPRESSION_LEVEL),
+        _ => None,
+    }
+}
+
+fn zstd_error(code: zstd_safe::ErrorCode) -> Error {
+    anyhow!("zstd: {}", zstd_safe::get_error_name(code))
+}
+
+/// Writes `value` LEB128 encoded to `out`, returns the number of bytes written
+fn write_varint(out: &mut [u8], mut value: u64) -> usize {
+    let mut size = 0;
+
+    loop {
+        let byte = (value & 0x7f) as u8;
+        value >>= 7;
+
+        if value == 0 {
+            out[size] = byte;
+            return size + 1;
+        }
+
+        out[size] = byte | 0x80;
+        size += 1;
+    }
+}
+
+/// Reads a LEB128 encoded value from the start of `data`. Returns the value and its size, or
+/// None if `data` ends before the value does.
+fn read_varint(data: &[u8]) -> Result<Option<(u64, usize)>> {
+    let mut value = 0u64;
+
+    for (i, byte) in data.iter().take(MAX_VARINT_SIZE).enumerate() {
+        value |= ((byte & 0x7f) as u64) << (7 * i);
+
+        if byte & 0x80 == 0 {
+            return Ok(Some((value, i + 1)));
+        }
+    }
+
+    ensure!(
+        data.len() < MAX_VARINT_SIZE,
+        "Invalid varint in message header"
+    );
+    Ok(None)
+}
+
+/// Decoded message header
+struct FrameHeader {
+    message: Messages,
+    flags: u8,
+    /// Size of the message data as sent
+    size: usize,
+    stream_id: Option<u32>,
+    checksum: Option<u64>,
+    /// Size of the header itself
+    header_size: usize,
+}
+
+impl FrameHeader {
+    /// Decodes the header at the start of `data`, returns None if `data` doesn't hold all of it
+    fn parse(data: &[u8]) -> Result<Option<FrameHeader>> {
+        if data.len() < 2 {
+            return Ok(None);
+        }
+
+        let message = Messages::from_u8(data[0])
+            .ok_or_else(|| anyhow!("Invalid message type {}", data[0]))?;
+        let flags = data[1];
+
+        ensure!(
+            flags & !KNOWN_FLAGS == 0,
+            "Unknown flags {:#x} in {:?} message",
+            flags,
+            message
+        );
+
+        let mut offset = 2;
+        let mut stream_id = None;
+
+        let size = if flags & FLAG_COMPACT != 0 {
+            let (size, len) = match read_varint(&data[offset..])? {
+                Some(v) => v,
+                None => return Ok(None),
+            };
+            offset += len;
+
+            if flags & FLAG_STREAM != 0 {
+                let (id, len) = match read_varint(&data[offset..])? {
+                    Some(v) => v,
+                    None => return Ok(None),
+                };
+                ensure!(id <= u32::MAX as u64, "Invalid stream id {}", id);
+                stream_id = Some(id as u32);
+                offset += len;
+            }
+
+            size
+        } else {
+            if data.len() < LEGACY_HEADER_SIZE {
+                return Ok(None);
+            }
+
+            let size = data[2..LEGACY_HEADER_SIZE]
+                .iter()
+                .fold(0u64, |size, b| (size << 8) | *b as u64);
+            offset = LEGACY_HEADER_SIZE;
+            size
+        };
+
+        ensure!(
+            size <= MAX_MESSAGE_SIZE,
+            "{:?} message too large ({} bytes)",
+            message,
+            size
+        );
+
+        let checksum = if flags & FLAG_CHECKSUM != 0 {
+            if data.len() < offset + CHECKSUM_SIZE {
+                return Ok(None);
+            }
+
+            let mut checksum = [0u8; CHECKSUM_SIZE];
+            checksum.copy_from_slice(&data[offset..offset + CHECKSUM_SIZE]);
+            offset += CHECKSUM_SIZE;
+            Some(u64::from_be_bytes(checksum))
+        } else {
+            None
+        };
+
+        Ok(Some(FrameHeader {
+            message,
+            flags,
+            size: size as usize,
+            stream_id,
+            checksum,
+            header_size: offset,
+        }))
+    }
+}
+
+/// Buffers that incoming messages are read to, in power of two size classes. The buffers are
+/// zero initialized once when they are allocated and then reused as is, so reading a message
+/// neither allocates nor fills the buffer once the classes in use have been allocated.
+struct ReceiveBuffers {
+    classes: Vec<Vec<Vec<u8>>>,
+}
+
+impl ReceiveBuffers {
+    fn new() -> ReceiveBuffers {
+        let count = (MAX_RECEIVE_CLASS / MIN_RECEIVE_CLASS).trailing_zeros() as usize + 1;
+        ReceiveBuffers {
+            classes: (0..count).map(|_| Vec::new()).collect(),
+        }
+    }
+
+    fn class_size(size: usize) -> usize {
+        size.max(MIN_RECEIVE_CLASS).next_power_of_two()
+    }
+
+    fn class_index(class_size: usize) -> usize {
+        (class_size / MIN_RECEIVE_CLASS).trailing_zeros() as usize
+    }
+
+    /// Returns a buffer of at least `size` bytes
+    fn take(&mut self, size: usize) -> Vec<u8> {
+        if size > MAX_RECEIVE_CLASS {
+            return vec![0; size];
+        }
+
+        let class_size = Self::class_size(size);
+        self.classes[Self::class_index(class_size)]
+            .pop()
+            .unwrap_or_else(|| vec![0; class_size])
+    }
+
+    /// Gives back a buffer from `take`
+    fn put(&mut self, buffer: Vec<u8>) {
+        let size = buffer.len();
+
+        if size > MAX_RECEIVE_CLASS || size != Self::class_size(size) {
+            return;
+        }
+
+        let class = &mut self.classes[Self::class_index(size)];
+        if class.len() < BUFFERS_PER_CLASS {
+            class.push(buffer);
+        }
+    }
+}
+
+/// Returned when the remote end has closed the connection
+#[derive(Debug)]
+pub struct ConnectionClosed;
+
+impl std::fmt::Display for ConnectionClosed {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "Connection closed by remote")
+    }
+}
+
+impl std::error::Error for ConnectionClosed {}
+
+/// These are all the states that is needed to read from the input
+/// This supports reading in non-blocking fashion and can pickup where it left of.
 #[derive(Clone, Copy, PartialEq, Debug)]
-enum State {
-    ReadHeader,
-    ReadData,
-    WriteHeader,
-    WriteData,
-    /// Read or write has completed
+enum ReadState {
+    Header,
+    Data,
+    /// A message has been read and is available in `data` until the next update
     Complete,
 }
 
-/// This makes it possible to auto trasition the state matchine to read after
-/// a write has been completed.
-#[derive(Clone, Copy, PartialEq, Debug)]
-pub enum TransitionToRead {
-    Yes,
-    No,
+/// Part of a file that is written after the payload of a frame
+struct FileSlice {
+    file: Arc<File>,
+    offset: u64,
+    len: usize,
 }
 
+/// A message waiting in the write queue
+struct Frame {
+    /// Header followed by the serialized message, starting at `start`
+    head: Vec<u8>,
+    start: usize,
+    /// Trailing payload that is written straight from the buffers it was given in
+    payload: Vec<Vec<u8>>,
+    /// Trailing file data, written with sendfile when possible
+    file: Option<FileSlice>,
+}
+
+impl Frame {
+    /// Size of the parts of the frame that are in memory
+    fn memory_size(&self) -> usize {
+        self.head.len() - self.start + self.payload.iter().map(|p| p.len()).sum::<usize>()
+    }
+
+    fn size(&self) -> usize {
+        self.memory_size() + self.file.as_ref().map_or(0, |f| f.len)
+    }
+}
+
+/// Reads and writes messages over a (non-blocking) stream. Reading and writing have separate
+/// state so an outgoing message can be in progress while incoming messages are read, and
+/// outgoing messages are queued so a new write never clobbers one in flight.
 pub struct MessageStream {
-    /// Set to Yes if transition to read after a write has been completed
-    transition_to_read: TransitionToRead,
-    /// Current state of the state machine
-    state: State,
-    /// header read or write offset (number of bytes read or written)
+    /// Current state of the read state machine
+    read_state: ReadState,
+    /// Type of the message being read
     message: Messages,
-    /// header read or write offset (number of bytes read or written)
-    header_offset: usize,
+    /// Size of the header of the message being read
+    header_size: usize,
+    /// Stream the message being read belongs to
+    stream_id: Option<u32>,
+    /// Checksum the data of the message being read should have
+    expected_checksum: Option<u64>,
     /// how much data that has been read to the data buffer
     data_offset: usize,
-    /// header to read/write from
-    header: [u8; 8],
-    /// Data to read/write from
-    pub data: Vec<u8>,
+    /// Size of the message data being read (compressed size if it's compressed)
+    read_size: usize,
+    /// Data read from the stream that hasn't been used yet is at `read_pos..read_end`
+    read_ahead: Vec<u8>,
+    read_pos: usize,
+    read_end: usize,
+    /// Data of the last read message, only the first `data_size` bytes are part of it
+    data: Vec<u8>,
+    data_size: usize,
+    /// Set if the message being read is compressed and read to `compressed_data`
+    compressed_read: bool,
+    /// Compressed data of the message being read
+    compressed_data: Vec<u8>,
+    receive_buffers: ReceiveBuffers,
+    /// If messages we write may be compressed (as negotiated in the handshake)
+    compression: bool,
+    /// If messages we write carry a checksum (as negotiated in the handshake)
+    checksum: bool,
+    compressor: Option<CCtx<'static>>,
+    decompressor: Option<DCtx<'static>>,
+    /// Messages waiting to be written, the front one may be partially written
+    write_queue: VecDeque<Frame>,
+    /// Number of bytes of the front frame (header included) that has been written
+    write_offset: usize,
+    /// Number of bytes in the write queue that hasn't been written yet
+    queued_bytes: usize,
+    /// Data buffers of written messages that can be reused
+    spare_buffers: Vec<Vec<u8>>,
+    /// Payload buffers are given back here once written (if set)
+    payload_pool: Option<Arc<BufferPool>>,
+    /// Socket that the stream writes to, file data is sent to it with sendfile (if set)
+    sendfile: Option<RawFd>,
 }
 
 impl MessageStream {
     pub fn new() -> MessageStream {
         MessageStream {
-            transition_to_read: TransitionToRead::No,
-            state: State::Complete,
+            read_state: ReadState::Header,
             message: Messages::NoMessage,
-            header_offset: 0,
+            header_size: 0,
+            stream_id: None,
+            expected_checksum: None,
             data_offset: 0,
-            header: [0; 8],
+            read_size: 0,
+            read_ahead: vec![0; READ_AHEAD_SIZE],
+            read_pos: 0,
+            read_end: 0,
             data: Vec::new(),
+            data_size: 0,
+            compressed_read: false,
+            compressed_data: Vec::new(),
+            receive_buffers: ReceiveBuffers::new(),
+            compression: false,
+            checksum: false,
+            compressor: None,
+            decompressor: None,
+            write_queue: VecDeque::new(),
+            write_offset: 0,
+            queued_bytes: 0,
+            spare_buffers: Vec::new(),
+            payload_pool: None,
+            sendfile: None,
         }
     }
 
-    /// Update the state machine. Will return a Some(Message) when a read request has finished.
-    /// For writes no state will be given back
-    pub fn update<S: Write + Read>(&mut self, stream: &mut S) -> Result<Option<Messages>> {
-        match self.state {
-            State::WriteHeader => {
-                self.write_header(stream)?;
-                // We have switched state to write data, we try to write it here as well
-                // to finish it as early as possible
-                if self.state == State::WriteData {
-                    self.write_data(stream)?;
-                }
+    /// Payload buffers will be given back to `pool` after they have been written
+    pub fn set_payload_pool(&mut self, pool: Arc<BufferPool>) {
+        self.payload_pool = Some(pool);
+    }
 
-                Ok(None)
-            }
+    /// Allow compression of large messages that are written. Compressed messages are flagged
+    /// in the header so this only needs to be enabled when the remote end supports it, reading
+    /// compressed messages is always supported.
+    pub fn set_compression(&mut self, enabled: bool) {
+        self.compression = enabled;
+    }
 
-            State::WriteData => {
-                self.write_data(stream)?;
-                Ok(None)
-            }
+    /// Send a checksum with every message that is written. Like compression it's flagged in the
+    /// header and incoming checksums are always verified.
+    pub fn set_checksum(&mut self, enabled: bool) {
+        self.checksum = enabled;
+    }
 
-            State::ReadHeader => {
-                self.read_header(stream)?;
-                // Read data directly here if we are finished with the header
-                if self.state == State::ReadData {
-                    self.data_offset = 0;
-                    self.read_data(stream)
-                } else {
-                    Ok(None)
-                }
-            }
+    /// Data of the last message returned by `update`
+    pub fn data(&self) -> &[u8] {
+        &self.data[..self.data_size]
+    }
 
-            State::ReadData => {
-                self.read_data(stream)
-            }
+    /// Stream id of the last message returned by `update`, if it was sent with one
+    pub fn stream_id(&self) -> Option<u32> {
+        self.stream_id
+    }
+
+    /// Update the state machine. Writes as much of the queued messages as possible and will
+    /// return a Some(Message) when a message has been read. The data of the message is valid
+    /// until the next call to update. Reads and writes are driven until they either complete or
+    /// the stream would block so this is safe to use with edge triggered events.
+    pub fn update<S: Write + Read>(&mut self, stream: &mut S) -> Result<Option<Messages>> {
+        self.flush(stream)?;
 
-            State::Complete => Ok(None),
+        if self.read_state == ReadState::Complete {
+            // Previous message has been handled so start on the next one
+            let data = std::mem::take(&mut self.data);
+            let compressed_data = std::mem::take(&mut self.compressed_data);
+            self.receive_buffers.put(data);
+            self.receive_buffers.put(compressed_data);
+            self.data_size = 0;
+            self.data_offset = 0;
+            self.read_state = ReadState::Header;
         }
-    }
 
-    /// Will return false if read can't be started (write/read in progress)
-    pub fn begin_read<S: Write + Read>(
-        &mut self,
-        stream: &mut S,
-        do_update: bool,
-    ) -> Result<Option<Messages>> {
-        if self.state != State::Complete && self.state != State::ReadHeader {
-            trace!("begin_read: Not started, not correct state");
-            Ok(None)
+        if self.read_state == ReadState::Header {
+            self.read_header(stream)?;
+        }
+
+        // Read data directly here if we are finished with the header
+        if self.read_state == ReadState::Data {
+            self.read_data(stream)
         } else {
-            trace!("begin_read: Start reading header");
-            self.header_offset = 0;
-            self.data_offset = 0;
-            self.state = State::ReadHeader;
-            if do_update {
-                self.update(stream)
-            } else {
-                Ok(None)
-            }
+            Ok(None)
         }
     }
 
-    /// Begins writing message to the stream, returns false if it can't, true if finished
+    /// Lets file data (see `begin_write_file_message`) be sent with sendfile, straight from the
+    /// page cache to `socket`. It has to be the socket that is given as stream when writing,
+    /// and stay open for as long as this is used.
+    pub fn set_sendfile<T: AsRawFd>(&mut self, socket: &T) {
+        self.sendfile = Some(socket.as_raw_fd());
+    }
+
+    /// Number of queued bytes that hasn't been written to the stream yet
+    pub fn queued_bytes(&self) -> usize {
+        self.queued_bytes
+    }
+
+    /// Queues a message to be written and starts writing it.
+    /// Returns true if all queued messages (including this one) has been written
     pub fn begin_write_message<T: Serialize, S: Write + Read>(
         &mut self,
         stream: &mut S,
         data: &T,
         msg_type: Messages,
-        trans_to_read: TransitionToRead,
     ) -> Result<bool> {
-        // Make sure we can make progress
-        //if self.state != State::Complete {
-        //    return Ok(false);
-        //}
-
-        self.data.clear();
-
-        bincode::serialize_into(&mut self.data, data)?;
-
-        let len = self.data.len() as u64;
-        // reserve upper space for type
-        assert!(len < 0xffff_ffff_ffff);
-        // store type in top byte
-        self.header[0] = msg_type as u8;
-        self.header[1] = ((len >> 48) & 0xff) as u8;
-        self.header[2] = ((len >> 40) & 0xff) as u8;
-        self.header[3] = ((len >> 32) & 0xff) as u8;
-        self.header[4] = ((len >> 24) & 0xff) as u8;
-        self.header[5] = ((len >> 16) & 0xff) as u8;
-        self.header[6] = ((len >> 8) & 0xff) as u8;
-        self.header[7] = (len & 0xff) as u8;
-
-        self.transition_to_read = trans_to_read;
-        self.state = State::WriteHeader;
-        self.header_offset = 0;
+        self.begin_write_message_with_payload(stream, data, Vec::new(), msg_type)
+    }
+
+    /// Queues a message where `payload` follows `head` as a trailing byte slice and starts
+    /// writing it. The payload is encoded the way bincode encodes a `&[u8]` field so the
+    /// receiver deserializes the full message (such as `TextMessage`) as usual, but it's written
+    /// straight from the given buffers instead of being copied into the message.
+    /// Returns true if all queued messages (including this one) has been written
+    pub fn begin_write_message_with_payload<T: Serialize, S: Write + Read>(
+        &mut self,
+        stream: &mut S,
+        head: &T,
+        payload: Vec<Vec<u8>>,
+        msg_type: Messages,
+    ) -> Result<bool> {
+        self.queue_message(stream, None, head, payload, msg_type)
+    }
+
+    /// Same as `begin_write_message_with_payload` but tags the message with the stream (such as
+    /// the launch) it belongs to, so the receiver can tell messages of different streams apart
+    /// from the header alone.
+    pub fn begin_write_stream_message<T: Serialize, S: Write + Read>(
+        &mut self,
+        stream: &mut S,
+        stream_id: u32,
+        head: &T,
+        payload: Vec<Vec<u8>>,
+        msg_type: Messages,
+    ) -> Result<bool> {
+        self.queue_message(stream, Some(stream_id), head, payload, msg_type)
+    }
+
+    /// Same as `begin_write_stream_message` with `len` bytes of `file` from `offset` as the
+    /// payload. The data is sent with sendfile when it's enabled (see `set_sendfile`) and the
+    /// message is neither compressed nor checksummed, otherwise it's read to a buffer first.
+    /// Compression needs the data in memory, so with compression enabled (as it is by default)
+    /// message types that may be compressed never use sendfile.
+    #[allow(clippy::too_many_arguments)]
+    pub fn begin_write_file_message<T: Serialize, S: Write + Read>(
+        &mut self,
+        stream: &mut S,
+        stream_id: u32,
+        head: &T,
+        file: &Arc<File>,
+        offset: u64,
+        len: usize,
+        msg_type: Messages,
+    ) -> Result<bool> {
+        let compressed = self.compression && compression_level(msg_type).is_some();
+
+        if self.sendfile.is_none() || compressed || self.checksum {
+            let mut buffer = match self.payload_pool.as_ref() {
+                Some(pool) => pool.get(),
+                None => Vec::new(),
+            };
+
+            output_pipe::read_exact_spare(file, &mut buffer, len, offset)?;
+
+            return self.queue_message(stream, Some(stream_id), head, vec![buffer], msg_type);
+        }
+
+        let mut buffer = self.spare_buffers.pop().unwrap_or_default();
+        buffer.clear();
+        buffer.extend_from_slice(&[0u8; MAX_HEADER_SIZE]);
+
+        // Same layout as `serialize_head` with a payload
+        bincode::serialize_into(&mut buffer, head)?;
+        bincode::serialize_into(&mut buffer, &(len as u64))?;
+
+        let file = FileSlice {
+            file: file.clone(),
+            offset,
+            len,
+        };
+
+        self.queue_frame(
+            stream,
+            Some(stream_id),
+            buffer,
+            Vec::new(),
+            Some(file),
+            msg_type,
+        )
+    }
+
+    fn queue_message<T: Serialize, S: Write + Read>(
+        &mut self,
+        stream: &mut S,
+        stream_id: Option<u32>,
+        head: &T,
+        payload: Vec<Vec<u8>>,
+        msg_type: Messages,
+    ) -> Result<bool> {
+        let mut buffer = self.spare_buffers.pop().unwrap_or_default();
+        buffer.clear();
+        buffer.extend_from_slice(&[0u8; MAX_HEADER_SIZE]);
+
+        serialize_head(&mut buffer, head, &payload)?;
+        self.queue_frame(stream, stream_id, buffer, payload, None, msg_type)
+    }
+
+    /// Queues a message with data that has already been serialized (such as by
+    /// `serialize_head` followed by the payload) and starts writing it.
+    /// Returns true if all queued messages (including this one) has been written
+    pub fn begin_write_raw_message<S: Write + Read>(
+        &mut self,
+        stream: &mut S,
+        stream_id: Option<u32>,
+        data: &[u8],
+        msg_type: Messages,
+    ) -> Result<bool> {
+        let mut buffer = self.spare_buffers.pop().unwrap_or_default();
+        buffer.clear();
+        buffer.reserve(MAX_HEADER_SIZE + data.len());
+        buffer.extend_from_slice(&[0u8; MAX_HEADER_SIZE]);
+        buffer.extend_from_slice(data);
+
+        self.queue_frame(stream, stream_id, buffer, Vec::new(), None, msg_type)
+    }
+
+    /// Queues a message serialized to `buffer` after `MAX_HEADER_SIZE` bytes of space for the
+    /// header, followed by `payload` and `file`. Messages with a file are never compressed or
+    /// checksummed.
+    fn queue_frame<S: Write + Read>(
+        &mut self,
+        stream: &mut S,
+        stream_id: Option<u32>,
+        mut buffer: Vec<u8>,
+        mut payload: Vec<Vec<u8>>,
+        file: Option<FileSlice>,
+        msg_type: Messages,
+    ) -> Result<bool> {
+        let mut payload_len: usize = payload.iter().map(|p| p.len()).sum();
+        payload_len += file.as_ref().map_or(0, |f| f.len);
+        let mut flags = 0;
+
+        if let Some(level) = compression_level(msg_type) {
+            if self.compression
+                && file.is_none()
+                && buffer.len() - MAX_HEADER_SIZE + payload_len >= COMPRESSION_THRESHOLD
+            {
+                if let Some(compressed) = self.compress(&buffer, &payload, level)? {
+                    let old = std::mem::replace(&mut buffer, compressed);
+                    if self.spare_buffers.len() < MAX_SPARE_BUFFERS {
+                        self.spare_buffers.push(old);
+                    }
+
+                    // The payload is part of the compressed data so the buffers can be reused
+                    for p in payload.drain(..) {
+                        if let Some(pool) = self.payload_pool.as_ref() {
+                            pool.put(p);
+                        }
+                    }
+
+                    payload_len = 0;
+                    flags |= FLAG_COMPRESSED;
+                }
+            }
+        }
+
+        let len = (buffer.len() - MAX_HEADER_SIZE + payload_len) as u64;
+        ensure!(len <= MAX_MESSAGE_SIZE, "Message too large ({} bytes)", len);
+
+        let mut header = [0u8; MAX_HEADER_SIZE];
+        header[0] = msg_type as u8;
+        let mut header_size = 2;
+
+        match msg_type {
+            Messages::HandshakeRequest | Messages::HandshakeReply => {
+                for (i, b) in header[2..LEGACY_HEADER_SIZE].iter_mut().enumerate() {
+                    *b = (len >> (8 * (LEGACY_HEADER_SIZE - 3 - i))) as u8;
+                }
+                header_size = LEGACY_HEADER_SIZE;
+            }
+            _ => {
+                flags |= FLAG_COMPACT;
+                header_size += write_varint(&mut header[header_size..], len);
+
+                if let Some(id) = stream_id {
+                    flags |= FLAG_STREAM;
+                    header_size += write_varint(&mut header[header_size..], id as u64);
+                }
+            }
+        }
+
+        if self.checksum && file.is_none() {
+            let mut hasher = Xxh3::new();
+            hasher.update(&buffer[MAX_HEADER_SIZE..]);
+            for p in &payload {
+                hasher.update(p);
+            }
+
+            flags |= FLAG_CHECKSUM;
+            header[header_size..header_size + CHECKSUM_SIZE]
+                .copy_from_slice(&hasher.digest().to_be_bytes());
+            header_size += CHECKSUM_SIZE;
+        }
+
+        header[1] = flags;
+
+        // The header goes right in front of the data
+        let start = MAX_HEADER_SIZE - header_size;
+        buffer[start..MAX_HEADER_SIZE].copy_from_slice(&header[..header_size]);
 
         trace!(
-            "begin_write_message: {:?} len {}",
+            "begin_write_message: {:?} len {} (queued {})",
             msg_type,
-            self.data.len()
+            len,
+            self.write_queue.len()
         );
 
-        // Do a update directly here to reduce latency as short messages will likely finish directly
-        self.update(stream)?;
+        let frame_size = buffer.len() - start + payload_len;
+        METRICS.sent.add(msg_type as u8, frame_size);
+        METRICS
+            .write_queue_bytes
+            .fetch_add(frame_size as u64, Ordering::Relaxed);
 
-        // check if we have finished already
-        if self.state == State::Complete || self.state == State::ReadHeader {
-            Ok(true)
-        } else {
-            Ok(false)
+        self.queued_bytes += frame_size;
+        self.write_queue.push_back(Frame {
+            head: buffer,
+            start,
+            payload,
+            file,
+        });
+
+        // Do a write directly here to reduce latency as short messages will likely finish directly.
+        // Reading is left to `update` so we don't drop a message that arrives meanwhile.
+        self.flush(stream)
+    }
+
+    /// Compresses the message in `buffer` (after the header) followed by `payload` into a new
+    /// buffer that starts with space for the header. Returns None if it didn't get any smaller.
+    fn compress(
+        &mut self,
+        buffer: &[u8],
+        payload: &[Vec<u8>],
+        level: i32,
+    ) -> Result<Option<Vec<u8>>> {
+        let parts =
+            std::iter::once(&buffer[MAX_HEADER_SIZE..]).chain(payload.iter().map(|p| &p[..]));
+        let size: usize = parts.clone().map(|p| p.len()).sum();
+
+        let cctx = self.compressor.get_or_insert_with(CCtx::create);
+        cctx.reset(zstd_safe::ResetDirective::SessionOnly)
+            .map_err(zstd_error)?;
+        cctx.set_parameter(CParameter::CompressionLevel(level))
+            .map_err(zstd_error)?;
+        // Makes the size end up in the frame header so the receiver knows how much it will get
+        cctx.set_pledged_src_size(Some(size as u64))
+            .map_err(zstd_error)?;
+
+        let mut output = self.spare_buffers.pop().unwrap_or_default();
+        output.clear();
+        output.reserve(MAX_HEADER_SIZE + zstd_safe::compress_bound(size));
+        output.extend_from_slice(&[0u8; MAX_HEADER_SIZE]);
+
+        for part in parts {
+            let mut input = InBuffer::around(part);
+            while input.pos() < part.len() {
+                let pos = output.len();
+                let mut out = OutBuffer::around_pos(&mut output, pos);
+                cctx.compress_stream2(&mut out, &mut input, ZSTD_EndDirective::ZSTD_e_continue)
+                    .map_err(zstd_error)?;
+            }
+        }
+
+        loop {
+            let pos = output.len();
+            let mut out = OutBuffer::around_pos(&mut output, pos);
+            let mut input = InBuffer::around(&[]);
+            let left = cctx
+                .compress_stream2(&mut out, &mut input, ZSTD_EndDirective::ZSTD_e_end)
+                .map_err(zstd_error)?;
+            if left == 0 {
+                break;
+            }
         }
+
+        trace!(
+            "compress: {} -> {} bytes",
+            size,
+            output.len() - MAX_HEADER_SIZE
+        );
+
+        if output.len() - MAX_HEADER_SIZE >= size {
+            if self.spare_buffers.len() < MAX_SPARE_BUFFERS {
+                self.spare_buffers.push(output);
+            }
+            return Ok(None);
+        }
+
+        Ok(Some(output))
     }
 
-    /// handle writing to a socket that is non-blocking
-    fn write<S: Write + Read>(stream: &mut S, data: &[u8]) -> Result<usize> {
-        match stream.write(data) {
-            Ok(n) => Ok(n),
+    /// Decompresses the message in `compressed_data` to `data`
+    fn decompress(&mut self) -> Result<()> {
+        let compressed = &self.compressed_data[..self.read_size];
+
+        let size = match zstd_safe::get_frame_content_size(compressed) {
+            Ok(Some(size)) if size <= MAX_MESSAGE_SIZE => size as usize,
+            _ => bail!("Compressed message without a valid size"),
+        };
+
+        let dctx = self.decompressor.get_or_insert_with(DCtx::create);
+
+        self.data = self.receive_buffers.take(size);
+        let written = dctx
+            .decompress(&mut self.data[..size], compressed)
+            .map_err(zstd_error)?;
+
+        ensure!(written == size, "Compressed message has the wrong size");
+        self.data_size = size;
+
+        Ok(())
+    }
+
+    /// Writes as much of the queued messages as the stream accepts.
+    /// Returns true if the write queue is empty
+    pub fn flush<S: Write + Read>(&mut self, stream: &mut S) -> Result<bool> {
+        while let Some(frame) = self.write_queue.front() {
+            let total = frame.size();
+
+            while self.write_offset < total {
+                let written = match frame.memory_size() <= self.write_offset {
+                    true => Self::write_file(frame, self.write_offset, self.sendfile)?,
+                    false => Self::write_frame(stream, frame, self.write_offset, self.sendfile)?,
+                };
+
+                if written == 0 {
+                    trace!("flush: {} of {} bytes written", self.write_offset, total);
+                    return Ok(false);
+                }
+
+                self.write_offset += written;
+                self.queued_bytes -= written;
+                METRICS
+                    .write_queue_bytes
+                    .fetch_sub(written as u64, Ordering::Relaxed);
+            }
+
+            trace!("flush: message of {} bytes written", total);
+
+            // Keep the buffers around so we don't need to allocate for the next message
+            let frame = self.write_queue.pop_front().unwrap();
+            self.write_offset = 0;
+
+            if self.spare_buffers.len() < MAX_SPARE_BUFFERS {
+                self.spare_buffers.push(frame.head);
+            }
+
+            if let Some(pool) = self.payload_pool.as_ref() {
+                frame.payload.into_iter().for_each(|p| pool.put(p));
+            }
+        }
+
+        Ok(true)
+    }
+
+    /// Writes what is left of the parts of `frame` that are in memory after `offset` using a
+    /// single vectored write. Returns the number of bytes written (0 if the stream would block)
+    fn write_frame<S: Write + Read>(
+        stream: &mut S,
+        frame: &Frame,
+        offset: usize,
+        sendfile: Option<RawFd>,
+    ) -> Result<usize> {
+        let mut slices = [IoSlice::new(&[]); MAX_IO_SLICES];
+        let mut count = 0;
+        let mut skip = offset;
+
+        let head = &frame.head[frame.start..];
+
+        for part in std::iter::once(head).chain(frame.payload.iter().map(|p| &p[..])) {
+            if count == MAX_IO_SLICES {
+                break;
+            }
+
+            if skip >= part.len() {
+                skip -= part.len();
+                continue;
+            }
+
+            slices[count] = IoSlice::new(&part[skip..]);
+            skip = 0;
+            count += 1;
+        }
+
+        let size = slices[..count].iter().map(|s| s.len()).sum();
+
+        // The header of a message with file data is sent along with the start of the data
+        // instead of in a small segment of its own
+        let result = match (frame.file.as_ref(), sendfile) {
+            (Some(_), Some(fd)) if count == 1 => {
+                let res = unsafe {
+                    libc::send(
+                        fd,
+                        slices[0].as_ptr() as *const libc::c_void,
+                        slices[0].len(),
+                        libc::MSG_MORE | libc::MSG_NOSIGNAL,
+                    )
+                };
+
+                match res {
+                    -1 => Err(std::io::Error::last_os_error()),
+                    n => Ok(n as usize),
+                }
+            }
+            _ => stream.write_vectored(&slices[..count]),
+        };
+
+        Self::written(result, size)
+    }
+
+    /// Writes what is left of the file data of `frame` after `offset` with sendfile (frames
+    /// only have file data when it's enabled). Returns the number of bytes written (0 if the
+    /// stream would block)
+    fn write_file(frame: &Frame, offset: usize, sendfile: Option<RawFd>) -> Result<usize> {
+        let fd = sendfile.expect("!sendfile");
+        let file = frame.file.as_ref().expect("!file");
+        let done = offset - frame.memory_size();
+        let left = file.len - done;
+
+        let mut file_offset = (file.offset + done as u64) as libc::off_t;
+        let res = unsafe { libc::sendfile(fd, file.file.as_raw_fd(), &mut file_offset, left) };
+
+        let result = match res {
+            -1 => Err(std::io::Error::last_os_error()),
+            0 => bail!("File shrunk while it was being sent"),
+            n => Ok(n as usize),
+        };
+
+        Self::written(result, left)
+    }
+
+    /// Result of writing `size` bytes to the stream, 0 if it would block
+    fn written(result: std::io::Result<usize>, size: usize) -> Result<usize> {
+        match result {
+            Ok(n) => {
+                if n < size {
+                    METRICS.partial_writes.fetch_add(1, Ordering::Relaxed);
+                }
+                Ok(n)
+            }
             Err(err) => {
                 if err.kind() == std::io::ErrorKind::WouldBlock {
+                    METRICS.would_block.fetch_add(1, Ordering::Relaxed);
                     Ok(0)
                 } else {
                     bail!(err);
@@ -186,6 +929,7 @@ impl MessageStream {
     /// handle read to a socket that is non-blocking
     fn read<S: Write + Read>(data: &mut [u8], stream: &mut S) -> Result<usize> {
         match stream.read(data) {
+            Ok(0) if !data.is_empty() => Err(ConnectionClosed.into()),
             Ok(n) => Ok(n),
             Err(err) => {
                 if err.kind() == std::io::ErrorKind::WouldBlock {
@@ -197,92 +941,479 @@ impl MessageStream {
         }
     }
 
-    /// Write header to the stream and return the total amount of data that has been written
-    fn write_header<S: Write + Read>(&mut self, stream: &mut S) -> Result<usize> {
-        self.header_offset += Self::write(stream, &self.header[self.header_offset..])?;
-        trace!(
-            "write_header: written total of {} bytes",
-            self.header_offset
-        );
+    /// Reads the header of the next message, from what has been read ahead and then from the
+    /// stream until the whole header is there or the stream would block
+    fn read_header<S: Write + Read>(&mut self, stream: &mut S) -> Result<()> {
+        loop {
+            if let Some(header) =
+                FrameHeader::parse(&self.read_ahead[self.read_pos..self.read_end])?
+            {
+                self.read_pos += header.header_size;
+                self.begin_data(header);
+                return Ok(());
+            }
 
-        if self.header_offset == 8 {
-            let mut hasher = DefaultHasher::new();
-            hasher.write(&self.data);
-            trace!(
-                "write_data hash {:x} len {}",
-                hasher.finish(),
-                self.data.len()
-            );
+            // Move the start of the header to the front so there is room for the rest of it
+            self.read_ahead.copy_within(self.read_pos..self.read_end, 0);
+            self.read_end -= self.read_pos;
+            self.read_pos = 0;
 
-            self.data_offset = 0;
-            self.state = State::WriteData;
+            let read = Self::read(&mut self.read_ahead[self.read_end..], stream)?;
+            if read == 0 {
+                return Ok(());
+            }
+            self.read_end += read;
         }
+    }
 
-        Ok(self.header_offset)
+    /// Sets up reading the data of the message with `header`
+    fn begin_data(&mut self, header: FrameHeader) {
+        self.message = header.message;
+        self.header_size = header.header_size;
+        self.stream_id = header.stream_id;
+        self.expected_checksum = header.checksum;
+        self.compressed_read = header.flags & FLAG_COMPRESSED != 0;
+        self.read_size = header.size;
+
+        // Buffers are reused as they are, only the part that is read to is used
+        let buffer = self.receive_buffers.take(self.read_size);
+        if self.compressed_read {
+            self.compressed_data = buffer;
+        } else {
+            self.data = buffer;
+        }
+
+        self.data_offset = 0;
+        self.read_state = ReadState::Data;
     }
 
-    /// Write data to the stream and return the total amount of data that has been written
-    fn write_data<S: Write + Read>(&mut self, stream: &mut S) -> Result<usize> {
-        self.data_offset += Self::write(stream, &self.data[self.data_offset..])?;
-        trace!("write_data total bytes {} written", self.data_offset);
+    fn read_data<S: Write + Read>(&mut self, stream: &mut S) -> Result<Option<Messages>> {
+        let data = if self.compressed_read {
+            &mut self.compressed_data
+        } else {
+            &mut self.data
+        };
+
+        while self.data_offset < self.read_size {
+            let left = self.read_size - self.data_offset;
+
+            if self.read_pos == self.read_end {
+                if left >= READ_AHEAD_SIZE {
+                    // Large messages skip the read ahead buffer
+                    let read = Self::read(&mut data[self.data_offset..self.read_size], stream)?;
+                    if read == 0 {
+                        break;
+                    }
+                    self.data_offset += read;
+                    continue;
+                }
+
+                // Read ahead so the following messages may come along with the rest of this one
+                self.read_pos = 0;
+                self.read_end = Self::read(&mut self.read_ahead, stream)?;
+                if self.read_end == 0 {
+                    break;
+                }
+            }
+
+            let size = left.min(self.read_end - self.read_pos);
+            data[self.data_offset..self.data_offset + size]
+                .copy_from_slice(&self.read_ahead[self.read_pos..self.read_pos + size]);
+            self.read_pos += size;
+            self.data_offset += size;
+        }
+
+        trace!("read_data total bytes {} read", self.data_offset);
 
-        // When we have finished writing all data we switch over to look for incoming messages
-        if self.data_offset == self.data.len() {
-            self.header_offset = 0;
+        if self.data_offset == self.read_size {
+            if let Some(expected) = self.expected_checksum {
+                if xxh3_64(&data[..self.read_size]) != expected {
+                    bail!("Checksum miss-match for {:?} message", self.message);
+                }
+            }
 
-            if self.transition_to_read == TransitionToRead::Yes {
-                trace!("write_data done, tranistion to State::ReadHeader");
-                self.state = State::ReadHeader;
+            if self.compressed_read {
+                self.decompress()?;
             } else {
-                trace!("write_data done, tranistion to State::Complete");
-                self.state = State::Complete;
+                self.data_size = self.read_size;
             }
+
+            METRICS
+                .received
+                .add(self.message as u8, self.header_size + self.read_size);
+
+            self.read_state = ReadState::Complete;
+            Ok(Some(self.message))
+        } else {
+            Ok(None)
         }
+    }
+}
+
+impl Drop for MessageStream {
+    fn drop(&mut self) {
+        // Whatever is left in the queue will never be written
+        METRICS
+            .write_queue_bytes
+            .fetch_sub(self.queued_bytes as u64, Ordering::Relaxed);
+    }
+}
+
+/// Serializes `head` to `out` followed by the length of the trailing `payload` (if any), which
+/// is how messages written with `begin_write_message_with_payload` start
+pub fn serialize_head<T: Serialize>(
+    out: &mut Vec<u8>,
+    head: &T,
+    payload: &[Vec<u8>],
+) -> Result<()> {
+    bincode::serialize_into(&mut *out, head)?;
+
+    if !payload.is_empty() {
+        let payload_len: usize = payload.iter().map(|p| p.len()).sum();
+        bincode::serialize_into(&mut *out, &(payload_len as u64))?;
+    }
+
+    Ok(())
+}
 
-        Ok(self.data_offset)
+/// Enables TCP keepalive on `stream` with short intervals, so a connection that silently went
+/// away (such as when the network drops without either end closing it) fails within about 20
+/// seconds instead of hanging until the kernel default of hours.
+pub fn set_keepalive<T: AsRawFd>(stream: &T) -> Result<()> {
+    let options = [
+        (libc::SOL_SOCKET, libc::SO_KEEPALIVE, 1),
+        (libc::IPPROTO_TCP, libc::TCP_KEEPIDLE, 10),
+        (libc::IPPROTO_TCP, libc::TCP_KEEPINTVL, 3),
+        (libc::IPPROTO_TCP, libc::TCP_KEEPCNT, 3),
+    ];
+
+    for (level, name, value) in options {
+        set_socket_option(stream.as_raw_fd(), level, name, value)?;
     }
 
-    /// Reads header data to self, returns number of bytes read
-    fn read_header<S: Write + Read>(&mut self, stream: &mut S) -> Result<usize> {
-        self.header_offset += Self::read(&mut self.header[self.header_offset..], stream)?;
-        //trace!("read_header total bytes {} read", self.header_offset);
+    Ok(())
+}
 
-        if self.header_offset == 8 {
-            let msg_type = self.header[0];
-            let size = ((self.header[1] as u64) << 48)
-                | ((self.header[2] as u64) << 40)
-                | ((self.header[3] as u64) << 32)
-                | ((self.header[4] as u64) << 24)
-                | ((self.header[5] as u64) << 16)
-                | ((self.header[6] as u64) << 8)
-                | (self.header[7] as u64);
+/// Sets the size (in bytes) of the send and receive buffers of `socket`, the kernel tunes the
+/// ones that aren't given. Larger buffers lets bulk transfers keep more data in flight on links
+/// with high latency. Set on a listening socket so accepted connections (and the window they
+/// announce) get them from the start.
+pub fn set_buffer_sizes<T: AsRawFd>(
+    socket: &T,
+    send: Option<usize>,
+    receive: Option<usize>,
+) -> Result<()> {
+    let sizes = [(libc::SO_SNDBUF, send), (libc::SO_RCVBUF, receive)];
 
-            assert!(size < 0xffff_ffff_ffff);
-            // TODO: Optimize
-            self.data.resize(size as _, 0xff);
-            self.message = unsafe { std::mem::transmute(msg_type) };
-            self.state = State::ReadData;
+    for (name, size) in sizes {
+        if let Some(size) = size {
+            let size = size.min(libc::c_int::MAX as usize) as libc::c_int;
+            set_socket_option(socket.as_raw_fd(), libc::SOL_SOCKET, name, size)?;
         }
+    }
 
-        Ok(self.header_offset)
+    Ok(())
+}
+
+fn set_socket_option(
+    fd: RawFd,
+    level: libc::c_int,
+    name: libc::c_int,
+    value: libc::c_int,
+) -> Result<()> {
+    let res = unsafe {
+        libc::setsockopt(
+            fd,
+            level,
+            name,
+            &value as *const libc::c_int as *const libc::c_void,
+            std::mem::size_of::<libc::c_int>() as libc::socklen_t,
+        )
+    };
+
+    if res != 0 {
+        return Err(std::io::Error::last_os_error().into());
     }
 
-    fn read_data<S: Write + Read>(&mut self, stream: &mut S) -> Result<Option<Messages>> {
-        self.data_offset += Self::read(&mut self.data[self.data_offset..], stream)?;
-        trace!("read_data total bytes {} read", self.data_offset);
+    Ok(())
+}
 
-        if self.data_offset == self.data.len() {
-            let mut hasher = DefaultHasher::new();
-            hasher.write(&self.data);
-            trace!(
-                "read_data hash {:x} len {}",
-                hasher.finish(),
-                self.data.len()
-            );
-            self.state = State::Complete;
-            Ok(Some(self.message))
-        } else {
-            Ok(None)
+/// Returns true if `err` means that the connection to the remote end was lost (rather than the
+/// remote end sending something invalid)
+pub fn is_disconnect(err: &Error) -> bool {
+    if err.downcast_ref::<ConnectionClosed>().is_some() {
+        return true;
+    }
+
+    match err.downcast_ref::<std::io::Error>() {
+        Some(err) => matches!(
+            err.kind(),
+            std::io::ErrorKind::ConnectionReset
+                | std::io::ErrorKind::ConnectionAborted
+                | std::io::ErrorKind::BrokenPipe
+                | std::io::ErrorKind::TimedOut
+                | std::io::ErrorKind::NotConnected
+                | std::io::ErrorKind::UnexpectedEof
+        ),
+        None => false,
+    }
+}
+
+/// Blocks until any of the sources registered with `poll` are ready or the timeout has passed.
+pub fn wait_for_events(
+    poll: &mut Poll,
+    events: &mut Events,
+    timeout: Option<Duration>,
+) -> Result<()> {
+    match poll.poll(events, timeout) {
+        Ok(()) => Ok(()),
+        // Signals (such as Ctrl-C) may interrupt the wait, the caller will check for them
+        Err(err) if err.kind() == std::io::ErrorKind::Interrupted => Ok(()),
+        Err(err) => bail!(err),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::messages::TextMessage;
+
+    /// In-memory connection. Reads return at most `read_size` bytes and would block once
+    /// everything that has been written is read.
+    struct Pipe {
+        data: Vec<u8>,
+        pos: usize,
+        read_size: usize,
+    }
+
+    impl Pipe {
+        fn new(data: Vec<u8>, read_size: usize) -> Pipe {
+            Pipe {
+                data,
+                pos: 0,
+                read_size,
+            }
+        }
+    }
+
+    impl Read for Pipe {
+        fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+            let size = buf
+                .len()
+                .min(self.read_size)
+                .min(self.data.len() - self.pos);
+            if size == 0 && !buf.is_empty() {
+                return Err(std::io::ErrorKind::WouldBlock.into());
+            }
+
+            buf[..size].copy_from_slice(&self.data[self.pos..self.pos + size]);
+            self.pos += size;
+            Ok(size)
+        }
+    }
+
+    impl Write for Pipe {
+        fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+            self.data.extend_from_slice(buf);
+            Ok(buf.len())
+        }
+
+        fn flush(&mut self) -> std::io::Result<()> {
+            Ok(())
+        }
+    }
+
+    /// Writes a `TextMessage` with `data` and returns the frame as sent
+    fn send(compression: bool, checksum: bool, stream_id: Option<u32>, data: &[u8]) -> Vec<u8> {
+        let mut msg_stream = MessageStream::new();
+        msg_stream.set_compression(compression);
+        msg_stream.set_checksum(checksum);
+
+        let mut pipe = Pipe::new(Vec::new(), usize::MAX);
+        let msg = TextMessage { id: 1, data };
+        let written = match stream_id {
+            Some(id) => msg_stream.begin_write_stream_message(
+                &mut pipe,
+                id,
+                &msg,
+                Vec::new(),
+                Messages::StdoutOutput,
+            ),
+            None => msg_stream.begin_write_message(&mut pipe, &msg, Messages::StdoutOutput),
+        };
+
+        assert!(written.unwrap());
+        pipe.data
+    }
+
+    /// Reads all messages in `frames`, `read_size` bytes at a time
+    fn receive(frames: Vec<u8>, read_size: usize) -> Result<Vec<(Messages, Option<u32>, Vec<u8>)>> {
+        let mut msg_stream = MessageStream::new();
+        let mut pipe = Pipe::new(frames, read_size);
+        let mut messages = Vec::new();
+
+        while pipe.pos < pipe.data.len() || msg_stream.read_pos < msg_stream.read_end {
+            if let Some(msg) = msg_stream.update(&mut pipe)? {
+                messages.push((msg, msg_stream.stream_id(), msg_stream.data().to_vec()));
+            }
         }
+
+        Ok(messages)
+    }
+
+    fn output(size: usize) -> Vec<u8> {
+        (0..)
+            .flat_map(|i| format!("line {}\n", i).into_bytes())
+            .take(size)
+            .collect()
+    }
+
+    #[test]
+    fn varint_boundaries() {
+        let values = [
+            (0, 1),
+            (127, 1),
+            (128, 2),
+            ((1 << 21) - 1, 3),
+            (1 << 21, 4),
+            (u32::MAX as u64, 5),
+            (u64::MAX, MAX_VARINT_SIZE),
+        ];
+
+        for (value, size) in values {
+            let mut buf = [0u8; MAX_VARINT_SIZE];
+            assert_eq!(write_varint(&mut buf, value), size, "{}", value);
+            assert_eq!(read_varint(&buf[..size]).unwrap(), Some((value, size)));
+
+            for len in 0..size {
+                assert_eq!(
+                    read_varint(&buf[..len]).unwrap(),
+                    None,
+                    "{} of {}",
+                    len,
+                    size
+                );
+            }
+        }
+
+        // Nothing valid is longer than a u64
+        assert!(read_varint(&[0x80; MAX_VARINT_SIZE]).is_err());
+    }
+
+    #[test]
+    fn truncated_headers_need_more_data() {
+        let mut handshake = Pipe::new(Vec::new(), usize::MAX);
+        MessageStream::new()
+            .begin_write_message(&mut handshake, &(6u8, 0u8), Messages::HandshakeRequest)
+            .unwrap();
+
+        let frames = [
+            (handshake.data, LEGACY_HEADER_SIZE),
+            (send(false, false, None, b"hi"), 3),
+            (send(false, true, Some(300), b"hi"), 3 + 2 + CHECKSUM_SIZE),
+        ];
+
+        for (frame, header_size) in frames {
+            for len in 0..header_size {
+                assert!(FrameHeader::parse(&frame[..len]).unwrap().is_none());
+            }
+
+            let header = FrameHeader::parse(&frame).unwrap().unwrap();
+            assert_eq!(header.header_size, header_size);
+            assert_eq!(header.size, frame.len() - header_size);
+        }
+    }
+
+    #[test]
+    fn oversized_messages_are_rejected() {
+        let header = |size: u64| {
+            let mut frame = vec![Messages::StdoutOutput as u8, FLAG_COMPACT];
+            let mut buf = [0u8; MAX_VARINT_SIZE];
+            let len = write_varint(&mut buf, size);
+            frame.extend_from_slice(&buf[..len]);
+            frame
+        };
+
+        let limit = FrameHeader::parse(&header(MAX_MESSAGE_SIZE))
+            .unwrap()
+            .unwrap();
+        assert_eq!(limit.size as u64, MAX_MESSAGE_SIZE);
+        assert!(FrameHeader::parse(&header(MAX_MESSAGE_SIZE + 1)).is_err());
+        assert!(FrameHeader::parse(&header(u64::MAX)).is_err());
+
+        // Refused as soon as the header is read, before a buffer is taken for the data
+        assert!(receive(header(u32::MAX as u64), usize::MAX).is_err());
+
+        let legacy = [
+            Messages::HandshakeRequest as u8,
+            0,
+            0xff,
+            0xff,
+            0xff,
+            0xff,
+            0xff,
+            0xff,
+        ];
+        assert!(FrameHeader::parse(&legacy).is_err());
+    }
+
+    #[test]
+    fn flag_combinations_round_trip() {
+        for compression in [false, true] {
+            for checksum in [false, true] {
+                for stream_id in [None, Some(0), Some(u32::MAX)] {
+                    for size in [10, 64 * 1024] {
+                        let data = output(size);
+                        let frame = send(compression, checksum, stream_id, &data);
+
+                        let flags = FrameHeader::parse(&frame).unwrap().unwrap().flags;
+                        let compressed = compression && size >= COMPRESSION_THRESHOLD;
+                        assert_eq!(flags & FLAG_COMPACT, FLAG_COMPACT);
+                        assert_eq!(flags & FLAG_COMPRESSED != 0, compressed);
+                        assert_eq!(flags & FLAG_CHECKSUM != 0, checksum);
+                        assert_eq!(flags & FLAG_STREAM != 0, stream_id.is_some());
+
+                        for read_size in [1, usize::MAX] {
+                            let messages = receive(frame.clone(), read_size).unwrap();
+                            assert_eq!(messages.len(), 1);
+
+                            let (msg_type, id, received) = &messages[0];
+                            let msg: TextMessage = bincode::deserialize(received).unwrap();
+                            assert_eq!(*msg_type, Messages::StdoutOutput);
+                            assert_eq!(*id, stream_id);
+                            assert_eq!((msg.id, msg.data), (1, &data[..]));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn messages_read_back_to_back() {
+        let sizes = [0, 1, 100, 5000, 200 * 1024];
+        let frames: Vec<u8> = sizes
+            .iter()
+            .enumerate()
+            .flat_map(|(i, size)| send(i % 2 == 0, i % 3 == 0, Some(i as u32), &output(*size)))
+            .collect();
+
+        for read_size in [7, READ_AHEAD_SIZE, usize::MAX] {
+            let messages = receive(frames.clone(), read_size).unwrap();
+            assert_eq!(messages.len(), sizes.len());
+
+            for (i, (_, id, received)) in messages.iter().enumerate() {
+                let msg: TextMessage = bincode::deserialize(received).unwrap();
+                assert_eq!(*id, Some(i as u32));
+                assert_eq!(msg.data, &output(sizes[i])[..]);
+            }
+        }
+    }
+
+    #[test]
+    fn corrupted_data_fails_the_checksum() {
+        let mut frame = send(false, true, None, &output(100));
+        *frame.last_mut().unwrap() ^= 1;
+        assert!(receive(frame, usize::MAX).is_err());
     }
 }
@@ -1,10 +1,20 @@
 use serde::{Deserialize, Serialize};
 
-pub const REMOTELINK_MAJOR_VERSION: u8 = 0;
-pub const REMOTELINK_MINOR_VERSION: u8 = 1;
+/// Changes to the layout of existing messages (fields added anywhere but at the end, removed
+/// or changed) bumps the major version, peers of another major version are refused. Minor
+/// versions may only add new messages and fields at the end of existing ones, which older
+/// peers ignore (bincode allows trailing bytes).
+pub const REMOTELINK_MAJOR_VERSION: u8 = 6;
+pub const REMOTELINK_MINOR_VERSION: u8 = 0;
+
+/// Bit in the `compression` field of the handshake for zstd compressed messages
+pub const COMPRESSION_ZSTD: u8 = 1;
+
+/// Bit in the `features` field of the handshake for messages carrying an xxh3 checksum
+pub const FEATURE_CHECKSUM: u8 = 1;
 
 /// Used for read/write over the stream
-//const CHUNK_SIZE: usize = 64 * 1024;
+pub const CHUNK_SIZE: usize = 64 * 1024;
 
 #[repr(u8)]
 #[derive(Copy, Clone, PartialEq, Debug)]
@@ -16,42 +26,261 @@ pub enum Messages {
     StopExecutableRequest = 4,
     StopExecutableReply = 5,
     StdoutOutput = 6,
+    StderrOutput = 7,
     NoMessage = 8,
+    ExecutableUploadChunk = 9,
+    ExecutableUploadEnd = 10,
+    ExecutableUploadReply = 11,
+    ExecutableUploadCopy = 12,
+    OpenHandleRequest = 13,
+    OpenHandleReply = 14,
+    ReadRequest = 15,
+    ReadReply = 16,
+    CloseHandleRequest = 17,
+    ExecutableExited = 18,
+    StopLaunchRequest = 19,
+    StatsRequest = 20,
+    StatsReply = 21,
+    StdinInput = 22,
+    ReattachRequest = 23,
+    ReattachReply = 24,
+    ProfileData = 25,
+}
+
+impl Messages {
+    /// All message types in the order of their values
+    const ALL: [Messages; 26] = [
+        Messages::HandshakeRequest,
+        Messages::HandshakeReply,
+        Messages::LaunchExecutableRequest,
+        Messages::LaunchExecutableReply,
+        Messages::StopExecutableRequest,
+        Messages::StopExecutableReply,
+        Messages::StdoutOutput,
+        Messages::StderrOutput,
+        Messages::NoMessage,
+        Messages::ExecutableUploadChunk,
+        Messages::ExecutableUploadEnd,
+        Messages::ExecutableUploadReply,
+        Messages::ExecutableUploadCopy,
+        Messages::OpenHandleRequest,
+        Messages::OpenHandleReply,
+        Messages::ReadRequest,
+        Messages::ReadReply,
+        Messages::CloseHandleRequest,
+        Messages::ExecutableExited,
+        Messages::StopLaunchRequest,
+        Messages::StatsRequest,
+        Messages::StatsReply,
+        Messages::StdinInput,
+        Messages::ReattachRequest,
+        Messages::ReattachReply,
+        Messages::ProfileData,
+    ];
+
+    /// Message type for a value read from the wire, None if it isn't a known type
+    pub fn from_u8(value: u8) -> Option<Messages> {
+        Self::ALL.get(value as usize).copied()
+    }
+
+    /// Messages the runner keeps in the spool of a session to send again when the host
+    /// reattaches (see `ReattachRequest`)
+    pub fn is_spooled(self) -> bool {
+        matches!(
+            self,
+            Messages::LaunchExecutableReply
+                | Messages::StdoutOutput
+                | Messages::StderrOutput
+                | Messages::ProfileData
+                | Messages::ExecutableExited
+        )
+    }
 }
 
+/// The version has to stay first in the handshake messages so it can be checked before the
+/// rest of the message is deserialized
 #[derive(Serialize, Deserialize, Debug)]
 pub struct HandshakeRequest {
     pub version_major: u8,
     pub version_minor: u8,
+    /// Compression methods supported by the host
+    pub compression: u8,
+    /// Optional features the host wants to use
+    pub features: u8,
 }
 
 #[derive(Serialize, Deserialize, Debug)]
 pub struct HandshakeReply {
     pub version_major: u8,
     pub version_minor: u8,
+    /// Compression methods that both sides will use
+    pub compression: u8,
+    /// Optional features that both sides will use
+    pub features: u8,
+    /// Id of the session on the runner, used to reattach to it (see `ReattachRequest`)
+    pub session: u64,
+}
+
+/// Sent right after the handshake on a new connection to take over a session whose connection
+/// was lost. The runner replies with `ReattachReply` and then sends the launch replies, output
+/// and exits of the session again from `offset`, which is the number of bytes of such messages
+/// (as deserialized) that the host got before the connection was lost.
+#[derive(Serialize, Deserialize, Debug)]
+pub struct ReattachRequest {
+    pub session: u64,
+    pub offset: u64,
+}
+
+/// `attached` is false if the session is gone (it ended or waited too long for the host).
+/// `lost` is the number of bytes after the requested offset that are no longer kept by the
+/// runner and can't be sent again.
+#[derive(Serialize, Deserialize, Debug)]
+pub struct ReattachReply {
+    pub attached: bool,
+    pub lost: u64,
 }
 
+/// Starts the launch of an executable. The runner replies with `ExecutableUploadReply`, if the
+/// executable isn't cached the data follows in `ExecutableUploadChunk` messages (as
+/// `TextMessage`) of up to `CHUNK_SIZE` bytes and `ExecutableUploadEnd` launches it.
+/// Any number of executables can be launched over the same connection, all messages about a
+/// launch carry the `id` given here by the host.
 #[derive(Serialize, Deserialize, Debug)]
 pub struct LaunchExecutableRequest<'a> {
+    pub id: u32,
+    /// The host serves files to the executable (see `OpenHandleRequest`)
     pub file_server: bool,
+    /// The host forwards its stdin to the executable in `StdinInput` messages and output is
+    /// sent as soon as it's written
+    pub interactive: bool,
+    /// Run the executable in a pseudo terminal (stdout and stderr are both sent as stdout)
+    pub pty: bool,
+    /// Run the executable under `perf record`, the profile is sent in `ProfileData` messages
+    /// once it has exited
+    pub profile: bool,
+    pub process: ProcessSettings,
     pub path: &'a str,
-    pub data: &'a [u8],
+    pub size: u64,
+    /// SHA-256 of the executable
+    pub hash: [u8; 32],
+}
+
+/// How the executable is started, so the same (cached) executable can be run with different
+/// parameters without being uploaded again
+#[derive(Serialize, Deserialize, Clone, Default, Debug)]
+pub struct ProcessSettings {
+    /// Arguments after the executable itself
+    pub args: Vec<String>,
+    /// Variables set in the environment of the executable, on top of that of the runner
+    pub env: Vec<(String, String)>,
+    /// Working directory of the executable, that of the runner if None
+    pub cwd: Option<String>,
+    /// CPUs the executable may run on, any CPU if empty
+    pub affinity: Vec<u32>,
+    /// Added to the nice value of the runner, negative values needs privileges on the runner
+    pub nice: i32,
+}
+
+/// Tells the host if the executable needs to be uploaded or if it was found in the cache. If
+/// the runner has an older version of the same path `signature` describes it so the host can
+/// send `ExecutableUploadCopy` for the blocks that hasn't changed instead of the data.
+#[derive(Serialize, Deserialize, Debug)]
+pub struct ExecutableUploadReply {
+    pub id: u32,
+    pub cached: bool,
+    pub signature: Option<Signature>,
+}
+
+/// Checksums of a block in the old version of an executable
+#[derive(Serialize, Deserialize, Debug)]
+pub struct BlockSignature {
+    /// Rolling checksum
+    pub weak: u32,
+    /// xxh3 of the block
+    pub strong: u64,
+}
+
+/// Signature of all full blocks in the old version of an executable
+#[derive(Serialize, Deserialize, Debug)]
+pub struct Signature {
+    pub block_size: u32,
+    pub blocks: Vec<BlockSignature>,
 }
 
+/// Copy `count` blocks starting at `block` from the old version of the executable
+#[derive(Serialize, Deserialize, Debug)]
+pub struct ExecutableUploadCopy {
+    pub id: u32,
+    pub block: u32,
+    pub count: u32,
+}
+
+/// Data of an upload, output, input (`StdinInput`) or profile (`ProfileData`) of an executable
+/// given by `id`. `data` has to stay the last field as it's written as a trailing payload by the
+/// sender. A `StdinInput` without data closes the stdin of the executable. `ProfileData` is sent
+/// in order, before `ExecutableExited`.
 #[derive(Serialize, Deserialize, Debug)]
 pub struct TextMessage<'a> {
+    pub id: u32,
     pub data: &'a [u8],
 }
 
+/// Sent when the executable has been started (once there is a free slot on the runner) or if
+/// it failed to start, then `launch_status` is non-zero
 #[derive(Serialize, Deserialize, Debug)]
 pub struct LaunchExecutableReply<'a> {
+    pub id: u32,
     pub launch_status: i32,
     pub error_info: Option<&'a str>,
 }
 
+#[derive(Serialize, Deserialize, Debug)]
+pub struct ExecutableUploadEnd {
+    pub id: u32,
+}
+
+/// Resources used by an executable as reported by the kernel when it was reaped
+#[derive(Serialize, Deserialize, Debug, Default, Clone, Copy)]
+pub struct ResourceUsage {
+    pub user_time_us: u64,
+    pub system_time_us: u64,
+    pub max_rss_kb: u64,
+    pub major_faults: u64,
+}
+
+/// Sent when the executable has exited and all of its output has been sent. `exit_code` is
+/// None if it was terminated by a signal, and both are None if it never started. `usage` is
+/// only set for executables that were started. A profiled executable is run by `perf record`,
+/// which exits with the exit code of the executable (and terminates with the same signal), but
+/// `wall_time_us` and `usage` are those of perf and include the time it takes to record and
+/// write the profile.
+#[derive(Serialize, Deserialize, Debug)]
+pub struct ExecutableExited {
+    pub id: u32,
+    pub exit_code: Option<i32>,
+    pub signal: Option<i32>,
+    /// Time from start until the runner noticed that it had exited
+    pub wall_time_us: u64,
+    pub usage: Option<ResourceUsage>,
+}
+
+/// Stops all executables of the session. They get SIGTERM and then SIGKILL if they are still
+/// running after the grace period (0 kills them directly). The runner sends their remaining
+/// output and `ExecutableExited` as usual and replies with `StopExecutableReply` once all of
+/// them are done, then it closes the connection.
 #[derive(Serialize, Deserialize, Debug, Default)]
 pub struct StopExecutableRequest {
-    dummy: u32,
+    pub grace_period_ms: u32,
+}
+
+/// Stops a single launch while keeping the connection (unlike `StopExecutableRequest`). If it
+/// hasn't been started yet it's cancelled, `ExecutableExited` is sent either way. The host
+/// stops sending an upload it cancels, nothing more is sent for the launch after the request.
+#[derive(Serialize, Deserialize, Debug)]
+pub struct StopLaunchRequest {
+    pub id: u32,
+    /// Same as in `StopExecutableRequest`
+    pub grace_period_ms: u32,
 }
 
 #[derive(Serialize, Deserialize, Debug, Default)]
@@ -59,36 +288,54 @@ pub struct StopExecutableReply {
     dummy: u32,
 }
 
-#[derive(Copy, Clone)]
-pub struct Header {
-    pub msg_type: Messages,
-    pub size: usize,
+/// Asks the runner for its metrics
+#[derive(Serialize, Deserialize, Debug, Default)]
+pub struct StatsRequest {
+    dummy: u32,
+}
+
+/// Metrics of the runner in the Prometheus text format
+#[derive(Serialize, Deserialize, Debug)]
+pub struct StatsReply<'a> {
+    pub text: &'a str,
 }
 
-/*
+/// Opens a file on the host. Sent by the executable to the runner over the file server socket
+/// and forwarded by the runner to the host. `path` is relative to the directory served by the
+/// host and `id` is returned in the reply so multiple opens can be in flight.
 #[derive(Serialize, Deserialize, Debug)]
-pub struct OpenHandleRequest {
-msg_type: u8,
-path: String,
+pub struct OpenHandleRequest<'a> {
+    pub id: u32,
+    pub path: &'a str,
 }
 
+/// `handle` is None if the file couldn't be opened
 #[derive(Serialize, Deserialize, Debug)]
 pub struct OpenHandleReply {
-msg_type: u8,
-handle: Option<u32>,
+    pub id: u32,
+    pub handle: Option<u32>,
+    pub size: u64,
 }
 
+/// Reads `size` bytes at `offset`. Any number of reads can be outstanding, the replies are
+/// identified by the handle and offset.
 #[derive(Serialize, Deserialize, Debug)]
 pub struct ReadRequest {
-msg_type: u8,
-handle: u32,
-size: u64,
+    pub handle: u32,
+    pub offset: u64,
+    pub size: u32,
 }
 
+/// Data is shorter than requested at the end of the file. `data` has to stay the last field as
+/// it's written as a trailing payload by the sender.
 #[derive(Serialize, Deserialize, Debug)]
-pub struct ReadReply {
-msg_type: u8,
-data: Vec<u8>,
+pub struct ReadReply<'a> {
+    pub handle: u32,
+    pub offset: u64,
+    pub data: &'a [u8],
 }
 
-*/
+#[derive(Serialize, Deserialize, Debug)]
+pub struct CloseHandleRequest {
+    pub handle: u32,
+}
@@ -0,0 +1,280 @@
+use crate::messages::Messages;
+use log::{error, info};
+use std::fmt::Write as _;
+use std::io::{Read, Write};
+use std::net::TcpListener;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::thread;
+use std::time::Duration;
+
+/// Number of message types counters are kept for, types above this are counted as the last one
+const MESSAGE_TYPES: usize = 32;
+/// Histogram buckets are powers of two microseconds, from 16 us up to about 67 s
+const HISTOGRAM_BUCKETS: usize = 23;
+const HISTOGRAM_FIRST_BUCKET: u32 = 4;
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+/// Distribution of durations in power of two buckets
+pub struct Histogram {
+    buckets: [AtomicU64; HISTOGRAM_BUCKETS],
+    count: AtomicU64,
+    sum_us: AtomicU64,
+}
+
+impl Histogram {
+    const fn new() -> Histogram {
+        Histogram {
+            buckets: [ZERO; HISTOGRAM_BUCKETS],
+            count: ZERO,
+            sum_us: ZERO,
+        }
+    }
+
+    pub fn record(&self, duration: Duration) {
+        let us = duration.as_micros().min(u64::MAX as u128) as u64;
+
+        // Index of the first bucket the value fits in, values above the last bucket are only
+        // part of the count (the +Inf bucket)
+        let bits = 64 - us.saturating_sub(1).leading_zeros();
+        let index = bits.saturating_sub(HISTOGRAM_FIRST_BUCKET) as usize;
+
+        if index < HISTOGRAM_BUCKETS {
+            self.buckets[index].fetch_add(1, Ordering::Relaxed);
+        }
+
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum_us.fetch_add(us, Ordering::Relaxed);
+    }
+
+    fn render(&self, out: &mut String, name: &str, help: &str) {
+        let _ = writeln!(out, "# HELP {} {}", name, help);
+        let _ = writeln!(out, "# TYPE {} histogram", name);
+
+        let mut cumulative = 0;
+        for (i, bucket) in self.buckets.iter().enumerate() {
+            cumulative += bucket.load(Ordering::Relaxed);
+            let le = (1u64 << (i as u32 + HISTOGRAM_FIRST_BUCKET)) as f64 / 1e6;
+            let _ = writeln!(out, "{}_bucket{{le=\"{}\"}} {}", name, le, cumulative);
+        }
+
+        let count = self.count.load(Ordering::Relaxed);
+        let sum = self.sum_us.load(Ordering::Relaxed) as f64 / 1e6;
+        let _ = writeln!(out, "{}_bucket{{le=\"+Inf\"}} {}", name, count);
+        let _ = writeln!(out, "{}_sum {}", name, sum);
+        let _ = writeln!(out, "{}_count {}", name, count);
+    }
+}
+
+/// Frame and byte counters for one direction, by message type
+pub struct Traffic {
+    frames: [AtomicU64; MESSAGE_TYPES],
+    bytes: [AtomicU64; MESSAGE_TYPES],
+}
+
+impl Traffic {
+    const fn new() -> Traffic {
+        Traffic {
+            frames: [ZERO; MESSAGE_TYPES],
+            bytes: [ZERO; MESSAGE_TYPES],
+        }
+    }
+
+    /// Counts a frame of `bytes` (header included) of type `msg_type`
+    pub fn add(&self, msg_type: u8, bytes: usize) {
+        let index = (msg_type as usize).min(MESSAGE_TYPES - 1);
+        self.frames[index].fetch_add(1, Ordering::Relaxed);
+        self.bytes[index].fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+}
+
+/// Counters for everything going on in the process. They are updated with relaxed atomics so
+/// they are cheap enough to keep on all the time.
+pub struct Metrics {
+    pub received: Traffic,
+    pub sent: Traffic,
+    /// Writes to the socket that would have blocked
+    pub would_block: AtomicU64,
+    /// Writes to the socket that only wrote part of what was given
+    pub partial_writes: AtomicU64,
+    /// Bytes queued on message streams that hasn't been written yet
+    pub write_queue_bytes: AtomicU64,
+    /// Bytes of executable output waiting to be sent
+    pub output_queue_bytes: AtomicU64,
+    pub output_dropped_bytes: AtomicU64,
+    pub output_spilled_bytes: AtomicU64,
+    pub sessions: AtomicU64,
+    /// From the LaunchExecutableRequest until the executable has been uploaded
+    pub upload_duration: Histogram,
+    /// From the LaunchExecutableRequest until spawn has returned, includes upload and time
+    /// waiting for a launch slot
+    pub launch_latency: Histogram,
+    /// From spawn until the first output of the executable is sent
+    pub first_output: Histogram,
+}
+
+pub static METRICS: Metrics = Metrics {
+    received: Traffic::new(),
+    sent: Traffic::new(),
+    would_block: ZERO,
+    partial_writes: ZERO,
+    write_queue_bytes: ZERO,
+    output_queue_bytes: ZERO,
+    output_dropped_bytes: ZERO,
+    output_spilled_bytes: ZERO,
+    sessions: ZERO,
+    upload_duration: Histogram::new(),
+    launch_latency: Histogram::new(),
+    first_output: Histogram::new(),
+};
+
+fn render_value(out: &mut String, name: &str, kind: &str, help: &str, value: u64) {
+    let _ = writeln!(out, "# HELP {} {}", name, help);
+    let _ = writeln!(out, "# TYPE {} {}", name, kind);
+    let _ = writeln!(out, "{} {}", name, value);
+}
+
+fn render_traffic(out: &mut String) {
+    let counters = [
+        ("remotelink_frames_total", "Messages sent and received"),
+        (
+            "remotelink_bytes_total",
+            "Bytes sent and received (headers included)",
+        ),
+    ];
+
+    for (n, (name, help)) in counters.iter().enumerate() {
+        let _ = writeln!(out, "# HELP {} {}", name, help);
+        let _ = writeln!(out, "# TYPE {} counter", name);
+
+        for (direction, traffic) in [("in", &METRICS.received), ("out", &METRICS.sent)] {
+            let values = match n {
+                0 => &traffic.frames,
+                _ => &traffic.bytes,
+            };
+
+            for (msg_type, value) in values.iter().enumerate() {
+                let value = value.load(Ordering::Relaxed);
+                if value == 0 {
+                    continue;
+                }
+
+                let _ = match Messages::from_u8(msg_type as u8) {
+                    Some(msg) => writeln!(
+                        out,
+                        "{}{{direction=\"{}\",type=\"{:?}\"}} {}",
+                        name, direction, msg, value
+                    ),
+                    None => writeln!(
+                        out,
+                        "{}{{direction=\"{}\",type=\"{}\"}} {}",
+                        name, direction, msg_type, value
+                    ),
+                };
+            }
+        }
+    }
+}
+
+/// All metrics in the Prometheus text format. `launches` is the number of running and waiting
+/// executables on the runner.
+pub fn render(launches: Option<(usize, usize)>) -> String {
+    let mut out = String::new();
+    let m = &METRICS;
+    let load = |v: &AtomicU64| v.load(Ordering::Relaxed);
+
+    render_traffic(&mut out);
+
+    #[rustfmt::skip]
+    let values = [
+        ("remotelink_write_would_block_total", "counter", "Socket writes that would have blocked", load(&m.would_block)),
+        ("remotelink_partial_writes_total", "counter", "Socket writes that only wrote part of the data", load(&m.partial_writes)),
+        ("remotelink_write_queue_bytes", "gauge", "Bytes queued for writing to the socket", load(&m.write_queue_bytes)),
+        ("remotelink_output_queue_bytes", "gauge", "Bytes of executable output waiting to be sent", load(&m.output_queue_bytes)),
+        ("remotelink_output_dropped_bytes_total", "counter", "Bytes of executable output dropped as the host didn't keep up", load(&m.output_dropped_bytes)),
+        ("remotelink_output_spilled_bytes_total", "counter", "Bytes of executable output spilled to disk as the host didn't keep up", load(&m.output_spilled_bytes)),
+        ("remotelink_sessions", "gauge", "Connected hosts", load(&m.sessions)),
+    ];
+
+    for (name, kind, help, value) in values {
+        render_value(&mut out, name, kind, help, value);
+    }
+
+    if let Some((running, waiting)) = launches {
+        render_value(
+            &mut out,
+            "remotelink_executables_running",
+            "gauge",
+            "Executables running",
+            running as u64,
+        );
+        render_value(
+            &mut out,
+            "remotelink_executables_waiting",
+            "gauge",
+            "Sessions waiting for a launch slot",
+            waiting as u64,
+        );
+    }
+
+    m.upload_duration.render(
+        &mut out,
+        "remotelink_upload_duration_seconds",
+        "Time to upload an executable",
+    );
+    m.launch_latency.render(
+        &mut out,
+        "remotelink_launch_latency_seconds",
+        "Time from launch request until the executable has been started",
+    );
+    m.first_output.render(
+        &mut out,
+        "remotelink_first_output_seconds",
+        "Time from start until the first output of an executable is sent",
+    );
+
+    out
+}
+
+/// Serves the metrics over HTTP on `port` for Prometheus to scrape. Any request gets the
+/// metrics back so nothing more than a minimal HTTP/1.0 reply is needed.
+pub fn serve<F>(port: u16, launches: F)
+where
+    F: Fn() -> (usize, usize) + Send + 'static,
+{
+    let listener = match TcpListener::bind(("0.0.0.0", port)) {
+        Ok(listener) => listener,
+        Err(err) => {
+            error!("Unable to serve metrics on port {}: {}", port, err);
+            return;
+        }
+    };
+
+    info!("Serving metrics on port {}", port);
+
+    thread::Builder::new()
+        .name("metrics".into())
+        .spawn(move || {
+            for stream in listener.incoming() {
+                let mut stream = match stream {
+                    Ok(stream) => stream,
+                    Err(_) => continue,
+                };
+
+                // The request itself doesn't matter, read it so the client doesn't get a reset
+                let _ = stream.set_read_timeout(Some(Duration::from_millis(100)));
+                let mut request = [0u8; 1024];
+                let _ = stream.read(&mut request);
+
+                let body = render(Some(launches()));
+                let _ = write!(
+                    stream,
+                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\n\r\n{}",
+                    body.len(),
+                    body
+                );
+            }
+        })
+        .expect("!thread");
+}
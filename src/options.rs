@@ -1,5 +1,8 @@
 pub use clap::Parser;
 
+use crate::exe_cache::Storage;
+use crate::output_pipe::OverflowPolicy;
+
 #[derive(Parser, Debug)]
 #[command(author, version, about, long_about = None)]
 pub struct Opt {
@@ -13,10 +16,112 @@ pub struct Opt {
     #[arg(short, long, default_value = "8888")]
     /// Select a TCP port to talk over. Has to be same on both sides.
     pub port: u16,
+    #[arg(long)]
+    /// Size (in KB) of the socket send buffer (SO_SNDBUF). Tuned by the kernel if not given.
+    pub send_buffer: Option<usize>,
+    #[arg(long)]
+    /// Size (in KB) of the socket receive buffer (SO_RCVBUF). Tuned by the kernel if not given.
+    pub receive_buffer: Option<usize>,
+    #[arg(short, long, value_delimiter = ',')]
+    /// The remote runner to connect to (an address or host name, optionally with a port). Can be
+    /// given multiple times, or as a comma separated list, to run the executables on several
+    /// runners at once.
+    pub target: Vec<String>,
     #[arg(short, long)]
-    /// The remote runner to connect to.
-    pub target: Option<String>,
-    #[arg(short, long)]
-    /// The executable to run.
-    pub filename: Option<String>,
+    /// The executable to run. Can be given multiple times to run several executables over the
+    /// same connection, use - to read the executables to run from stdin (one per line).
+    pub filename: Vec<String>,
+    #[arg(short, long, default_value = "1")]
+    /// Number of executables to run at the same time.
+    pub jobs: usize,
+    #[arg(long, default_value = "remotelink_cache")]
+    /// Directory where the remote runner keeps uploaded executables.
+    pub cache_dir: String,
+    #[arg(long, default_value = "1024")]
+    /// Max size (in MB) of the executable cache on the remote runner.
+    pub cache_size: u64,
+    #[arg(long, value_enum, default_value = "disk")]
+    /// Where the remote runner stores uploaded executables: on disk in the cache directory, or
+    /// in memory so launches never write to persistent storage (the cache is lost on restart).
+    pub storage: Storage,
+    #[arg(long)]
+    /// Max number of executables the remote runner runs at the same time, launches are queued
+    /// when all are busy. Defaults to the number of CPUs.
+    pub max_processes: Option<usize>,
+    #[arg(long, value_enum, default_value = "block")]
+    /// What the remote runner does with output when the host doesn't keep up: block the
+    /// executable, drop the output or spill it to a temporary file.
+    pub output_overflow: OverflowPolicy,
+    #[arg(long)]
+    /// Start executables on the remote runner from a small helper process forked when the
+    /// runner starts, so launches stay fast no matter how large the runner grows.
+    pub launcher: bool,
+    #[arg(long, default_value = "2000")]
+    /// Milliseconds the executables get to exit after SIGTERM when they are stopped (by Ctrl-C
+    /// or when relaunched with --watch) before they are killed with SIGKILL. 0 kills them
+    /// directly.
+    pub grace_period: u32,
+    #[arg(long, default_value = "60")]
+    /// Seconds to keep the executables running on the remote runner when the connection to
+    /// the host is lost, so the host can reconnect and reattach to them. Also how long the host
+    /// keeps trying to reconnect. 0 disables reattaching.
+    pub reattach_timeout: u64,
+    #[arg(long, default_value = "16")]
+    /// Max size (in MB) of the output that the remote runner keeps for each session so it can
+    /// be sent again when the host reattaches.
+    pub spool_size: u64,
+    #[arg(long)]
+    /// Serve metrics of the remote runner in the Prometheus text format over HTTP on this port.
+    pub metrics_port: Option<u16>,
+    #[arg(long)]
+    /// Print the metrics of the remote runner and exit.
+    pub stats: bool,
+    #[arg(long)]
+    /// Serve files from this directory to the executable on the remote runner.
+    pub file_root: Option<String>,
+    #[arg(long)]
+    /// Don't compress executable uploads and output sent between the host and the runner.
+    /// Uploads are then sent with sendfile (unless --checksum is given).
+    pub no_compression: bool,
+    #[arg(long)]
+    /// Send an xxh3 checksum with every message between the host and the runner and verify it
+    /// on the receiving side.
+    pub checksum: bool,
+    #[arg(long)]
+    /// Forward stdin to the executable on the runner and send its output as soon as it's
+    /// written, for interactive shells and REPLs.
+    pub interactive: bool,
+    #[arg(long)]
+    /// Run the executable in a pseudo terminal on the runner (implies --interactive). The local
+    /// terminal is switched to raw mode so keystrokes, Ctrl-C included, go to the executable.
+    pub pty: bool,
+    #[arg(long)]
+    /// Run the executables under `perf record` on the runner and write the profile next to
+    /// each executable as <executable>.perf.data (<executable>.<target>.perf.data with several
+    /// targets).
+    pub profile: bool,
+    #[arg(long, value_name = "NAME=VALUE")]
+    /// Set a variable in the environment of the executables on the runner. Can be given
+    /// multiple times.
+    pub env: Vec<String>,
+    #[arg(long)]
+    /// Working directory of the executables on the runner.
+    pub cwd: Option<String>,
+    #[arg(long, value_name = "CPUS")]
+    /// CPUs the executables may run on, as a list such as 0,2-3.
+    pub affinity: Option<String>,
+    #[arg(long, default_value = "0", allow_hyphen_values = true)]
+    /// Added to the nice value of the executables on the runner (negative values need
+    /// privileges on the runner).
+    pub nice: i32,
+    #[arg(long)]
+    /// Watch the executables and relaunch them on the runner when they change.
+    pub watch: bool,
+    #[arg(long)]
+    /// Run the protocol benchmarks (framing, round trip, upload and output forwarding) locally
+    /// and exit.
+    pub bench: bool,
+    #[arg(last = true)]
+    /// Arguments passed to the executables on the runner.
+    pub args: Vec<String>,
 }
@@ -0,0 +1,624 @@
+use crate::metrics::METRICS;
+use log::{error, trace};
+use mio::Waker;
+use std::{
+    collections::VecDeque,
+    fs::File,
+    io::Read,
+    os::unix::fs::FileExt,
+    os::unix::io::{AsRawFd, RawFd},
+    path::PathBuf,
+    sync::atomic::{AtomicU64, Ordering},
+    sync::mpsc::TryRecvError,
+    sync::{Arc, Condvar, Mutex},
+    thread,
+    time::{Duration, Instant},
+};
+
+/// Max size of a single coalesced chunk of child output
+pub const CHUNK_CAPACITY: usize = 64 * 1024;
+/// Max time we wait for more output to show up before handing off a chunk
+pub const COALESCE_TIMEOUT: Duration = Duration::from_millis(2);
+/// Number of spent buffers that we keep around for reuse
+const MAX_POOLED_BUFFERS: usize = 16;
+/// Max number of chunks queued between a pipe reader and the socket, what happens to more
+/// output than this is decided by the `OverflowPolicy`
+pub const MAX_QUEUED_CHUNKS: usize = 64;
+
+/// Used to give temporary files unique names
+static TEMP_FILE_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// What to do with output from an executable when the queue to the socket is full
+#[derive(clap::ValueEnum, Clone, Copy, Debug, PartialEq)]
+pub enum OverflowPolicy {
+    /// Stop reading the pipe so the executable blocks when writing
+    Block,
+    /// Throw away the output (and count how much)
+    Drop,
+    /// Write the output to a temporary file and send it from there once the queue has room
+    Spill,
+}
+
+/// Output that has been written to the spill file but not sent yet
+struct Spill {
+    file: File,
+    read_offset: u64,
+    write_offset: u64,
+}
+
+struct QueueState {
+    chunks: VecDeque<Vec<u8>>,
+    /// Set while output goes to the spill file, stays set until all of it has been read back
+    /// so the order is kept
+    spill: Option<Spill>,
+    /// Bytes in `chunks`
+    queued_bytes: usize,
+    dropped_bytes: u64,
+    spilled_bytes: u64,
+    sender_closed: bool,
+    receiver_closed: bool,
+}
+
+/// Bounded queue of output chunks between a pipe reader thread and the socket writer
+struct OutputQueue {
+    policy: OverflowPolicy,
+    pool: Arc<BufferPool>,
+    state: Mutex<QueueState>,
+    /// Signaled when a chunk is taken from or added to the queue and when either side closes
+    changed: Condvar,
+}
+
+/// Number of chunks and bytes queued and how much output has been dropped or spilled
+#[derive(Default, Debug, Clone, Copy)]
+pub struct QueueStatus {
+    pub chunks: usize,
+    pub bytes: usize,
+    pub dropped_bytes: u64,
+    pub spilled_bytes: u64,
+}
+
+/// Sending end of an output queue, used by the pipe reader
+pub struct OutputSender {
+    queue: Arc<OutputQueue>,
+}
+
+/// Receiving end of an output queue
+pub struct OutputReceiver {
+    queue: Arc<OutputQueue>,
+}
+
+/// Creates a queue that holds up to `MAX_QUEUED_CHUNKS` chunks of output. Spilled output is
+/// read back to buffers from `pool`.
+pub fn output_queue(
+    policy: OverflowPolicy,
+    pool: Arc<BufferPool>,
+) -> (OutputSender, OutputReceiver) {
+    let queue = Arc::new(OutputQueue {
+        policy,
+        pool,
+        state: Mutex::new(QueueState {
+            chunks: VecDeque::new(),
+            spill: None,
+            queued_bytes: 0,
+            dropped_bytes: 0,
+            spilled_bytes: 0,
+            sender_closed: false,
+            receiver_closed: false,
+        }),
+        changed: Condvar::new(),
+    });
+
+    (
+        OutputSender {
+            queue: queue.clone(),
+        },
+        OutputReceiver { queue },
+    )
+}
+
+/// Unique path for a temporary file named after `kind`
+pub fn temp_path(kind: &str) -> PathBuf {
+    std::env::temp_dir().join(format!(
+        "remotelink-{}-{}-{}",
+        kind,
+        std::process::id(),
+        TEMP_FILE_COUNTER.fetch_add(1, Ordering::Relaxed)
+    ))
+}
+
+/// Opens a new temporary file (such as a spill file) named after `kind`. It's removed directly so
+/// nothing is left behind if the runner dies.
+pub fn open_temp_file(kind: &str) -> std::io::Result<File> {
+    let path = temp_path(kind);
+
+    let file = File::options()
+        .read(true)
+        .write(true)
+        .create_new(true)
+        .open(&path)?;
+    std::fs::remove_file(&path)?;
+
+    Ok(file)
+}
+
+impl OutputSender {
+    /// Queues a chunk of output, what happens when the queue is full depends on the policy.
+    /// Returns false if the receiver is gone.
+    pub fn send(&self, chunk: Vec<u8>) -> bool {
+        let queue = &self.queue;
+        let mut state = queue.state.lock().unwrap();
+
+        if queue.policy == OverflowPolicy::Block {
+            while state.chunks.len() >= MAX_QUEUED_CHUNKS && !state.receiver_closed {
+                state = queue.changed.wait(state).unwrap();
+            }
+        }
+
+        if state.receiver_closed {
+            queue.pool.put(chunk);
+            return false;
+        }
+
+        let full = state.chunks.len() >= MAX_QUEUED_CHUNKS;
+
+        if queue.policy == OverflowPolicy::Spill && (full || state.spill.is_some()) {
+            if let Err(err) = Self::spill(&mut state, &chunk) {
+                // Nothing else to do with it at this point
+                error!("Unable to spill output: {}", err);
+                Self::dropped(&mut state, chunk.len());
+            }
+            queue.pool.put(chunk);
+        } else if full {
+            Self::dropped(&mut state, chunk.len());
+            queue.pool.put(chunk);
+        } else {
+            METRICS
+                .output_queue_bytes
+                .fetch_add(chunk.len() as u64, Ordering::Relaxed);
+            state.queued_bytes += chunk.len();
+            state.chunks.push_back(chunk);
+        }
+
+        queue.changed.notify_all();
+
+        true
+    }
+
+    fn dropped(state: &mut QueueState, size: usize) {
+        state.dropped_bytes += size as u64;
+        METRICS
+            .output_dropped_bytes
+            .fetch_add(size as u64, Ordering::Relaxed);
+    }
+
+    fn spill(state: &mut QueueState, chunk: &[u8]) -> std::io::Result<()> {
+        if state.spill.is_none() {
+            trace!("Output queue full, spilling to file");
+            state.spill = Some(Spill {
+                file: open_temp_file("spill")?,
+                read_offset: 0,
+                write_offset: 0,
+            });
+        }
+
+        let spill = state.spill.as_mut().unwrap();
+        spill.file.write_all_at(chunk, spill.write_offset)?;
+        spill.write_offset += chunk.len() as u64;
+        state.spilled_bytes += chunk.len() as u64;
+        METRICS
+            .output_spilled_bytes
+            .fetch_add(chunk.len() as u64, Ordering::Relaxed);
+
+        Ok(())
+    }
+}
+
+impl Drop for OutputSender {
+    fn drop(&mut self) {
+        self.queue.state.lock().unwrap().sender_closed = true;
+        self.queue.changed.notify_all();
+    }
+}
+
+impl OutputReceiver {
+    /// Takes the next chunk of output. Disconnected is returned once the sender is gone and
+    /// all output has been received.
+    pub fn try_recv(&self) -> Result<Vec<u8>, TryRecvError> {
+        let queue = &self.queue;
+        let mut state = queue.state.lock().unwrap();
+
+        if let Some(chunk) = state.chunks.pop_front() {
+            state.queued_bytes -= chunk.len();
+            METRICS
+                .output_queue_bytes
+                .fetch_sub(chunk.len() as u64, Ordering::Relaxed);
+            queue.changed.notify_all();
+            return Ok(chunk);
+        }
+
+        if let Some(spill) = state.spill.as_mut() {
+            if spill.read_offset < spill.write_offset {
+                let mut buffer = queue.pool.get();
+                let size = (CHUNK_CAPACITY as u64).min(spill.write_offset - spill.read_offset);
+
+                if read_exact_spare(&spill.file, &mut buffer, size as usize, spill.read_offset)
+                    .is_ok()
+                {
+                    spill.read_offset += size;
+                    return Ok(buffer);
+                }
+
+                error!("Unable to read spilled output");
+                let lost = spill.write_offset - spill.read_offset;
+                OutputSender::dropped(&mut state, lost as usize);
+            }
+
+            // Everything spilled has been sent, back to the queue
+            state.spill = None;
+        }
+
+        if state.sender_closed {
+            Err(TryRecvError::Disconnected)
+        } else {
+            Err(TryRecvError::Empty)
+        }
+    }
+
+    /// Same as `try_recv` but waits for output if there is none
+    pub fn recv(&self) -> Option<Vec<u8>> {
+        loop {
+            match self.try_recv() {
+                Ok(chunk) => return Some(chunk),
+                Err(TryRecvError::Disconnected) => return None,
+                Err(TryRecvError::Empty) => {
+                    let state = self.queue.state.lock().unwrap();
+                    if state.chunks.is_empty() && state.spill.is_none() && !state.sender_closed {
+                        drop(self.queue.changed.wait(state).unwrap());
+                    }
+                }
+            }
+        }
+    }
+
+    pub fn status(&self) -> QueueStatus {
+        let state = self.queue.state.lock().unwrap();
+        QueueStatus {
+            chunks: state.chunks.len(),
+            bytes: state.queued_bytes,
+            dropped_bytes: state.dropped_bytes,
+            spilled_bytes: state.spilled_bytes,
+        }
+    }
+}
+
+impl Drop for OutputQueue {
+    fn drop(&mut self) {
+        let state = self.state.get_mut().unwrap();
+        METRICS
+            .output_queue_bytes
+            .fetch_sub(state.queued_bytes as u64, Ordering::Relaxed);
+    }
+}
+
+impl Drop for OutputReceiver {
+    fn drop(&mut self) {
+        self.queue.state.lock().unwrap().receiver_closed = true;
+        self.queue.changed.notify_all();
+    }
+}
+
+/// Pool of output buffers. Buffers are handed out by the pipe readers and given back by the
+/// consumer once the data has been sent so we don't allocate for every read.
+#[derive(Default)]
+pub struct BufferPool {
+    free: Mutex<Vec<Vec<u8>>>,
+}
+
+impl BufferPool {
+    /// Get an empty buffer with room for at least `CHUNK_CAPACITY` bytes. It's meant to be read
+    /// into with `read_spare` so it isn't zero filled every time it's reused.
+    pub fn get(&self) -> Vec<u8> {
+        let mut buf = self
+            .free
+            .lock()
+            .unwrap()
+            .pop()
+            .unwrap_or_else(|| Vec::with_capacity(CHUNK_CAPACITY));
+        buf.clear();
+        buf
+    }
+
+    /// Give back a buffer that has been consumed
+    pub fn put(&self, buf: Vec<u8>) {
+        let mut free = self.free.lock().unwrap();
+        if free.len() < MAX_POOLED_BUFFERS && buf.capacity() >= CHUNK_CAPACITY {
+            free.push(buf);
+        }
+    }
+}
+
+/// Reads up to `len` bytes from `fd` (at `offset` if given) to the end of `buf`. The data goes
+/// straight to the spare capacity of `buf` so it doesn't have to be initialized first. Returns
+/// the number of bytes read, 0 at the end of the file.
+pub fn read_spare(
+    fd: RawFd,
+    buf: &mut Vec<u8>,
+    len: usize,
+    offset: Option<u64>,
+) -> std::io::Result<usize> {
+    buf.reserve(len);
+    let spare = buf.spare_capacity_mut().as_mut_ptr() as *mut libc::c_void;
+
+    let res = unsafe {
+        match offset {
+            Some(offset) => libc::pread(fd, spare, len, offset as libc::off_t),
+            None => libc::read(fd, spare, len),
+        }
+    };
+
+    if res < 0 {
+        return Err(std::io::Error::last_os_error());
+    }
+
+    // The kernel has written the bytes that were read
+    unsafe { buf.set_len(buf.len() + res as usize) };
+
+    Ok(res as usize)
+}
+
+/// Reads exactly `len` bytes from `file` at `offset` to the end of `buf`, see `read_spare`
+pub fn read_exact_spare(
+    file: &File,
+    buf: &mut Vec<u8>,
+    len: usize,
+    offset: u64,
+) -> std::io::Result<()> {
+    let mut done = 0;
+
+    while done < len {
+        match read_spare(
+            file.as_raw_fd(),
+            buf,
+            len - done,
+            Some(offset + done as u64),
+        ) {
+            Ok(0) => return Err(std::io::ErrorKind::UnexpectedEof.into()),
+            Ok(n) => done += n,
+            Err(err) if err.kind() == std::io::ErrorKind::Interrupted => (),
+            Err(err) => return Err(err),
+        }
+    }
+
+    Ok(())
+}
+
+/// Wait up to `timeout` for `fd` to become readable. Returns true if data (or EOF) is available.
+fn wait_readable(fd: RawFd, timeout: Duration) -> bool {
+    let mut pfd = libc::pollfd {
+        fd,
+        events: libc::POLLIN,
+        revents: 0,
+    };
+
+    // poll only has ms granularity so round up to not spin when less than 1 ms is left
+    let timeout_ms = ((timeout.as_micros() + 999) / 1000) as libc::c_int;
+
+    unsafe { libc::poll(&mut pfd, 1, timeout_ms) > 0 }
+}
+
+/// Reads as much as is available from the stream into `buf` (up to `CHUNK_CAPACITY` bytes),
+/// waiting no longer than `coalesce` after the first read for more data to arrive. Returns true
+/// if the end of the stream was reached.
+fn read_coalesced<R: AsRawFd>(stream: &R, buf: &mut Vec<u8>, coalesce: Duration) -> bool {
+    let fd = stream.as_raw_fd();
+    let mut start = None;
+
+    while buf.len() < CHUNK_CAPACITY {
+        if let Some(start) = start {
+            let elapsed = Instant::now().duration_since(start);
+            if elapsed >= coalesce || !wait_readable(fd, coalesce - elapsed) {
+                break;
+            }
+        }
+
+        match read_spare(fd, buf, CHUNK_CAPACITY - buf.len(), None) {
+            Ok(0) => return true,
+            // A pseudo terminal gives EIO once the other end has been closed
+            Err(err) if err.raw_os_error() == Some(libc::EIO) => return true,
+            Ok(_) => (),
+            Err(err) if err.kind() == std::io::ErrorKind::Interrupted => continue,
+            Err(err) => {
+                error!("{}] Error reading from stream: {}", line!(), err);
+                return true;
+            }
+        }
+
+        // Start the coalescing window after the first data has arrived
+        if start.is_none() {
+            start = Some(Instant::now());
+        }
+    }
+
+    false
+}
+
+/// Pipe streams are blocking, we need separate threads to monitor them without blocking the
+/// primary thread. Output is coalesced for up to `coalesce` into chunks of up to
+/// `CHUNK_CAPACITY` bytes that are taken from (and should be given back to) `pool`. `waker` is
+/// signaled for every chunk sent and when the stream has ended.
+pub fn spawn_reader<R>(
+    stream: R,
+    pool: Arc<BufferPool>,
+    out: OutputSender,
+    waker: Option<Arc<Waker>>,
+    coalesce: Duration,
+) where
+    R: Read + AsRawFd + Send + 'static,
+{
+    thread::Builder::new()
+        .name("output_pipe".into())
+        .spawn(move || {
+            loop {
+                let mut buf = pool.get();
+                let eof = read_coalesced(&stream, &mut buf, coalesce);
+
+                if !buf.is_empty() {
+                    if !out.send(buf) {
+                        break;
+                    }
+
+                    if let Some(waker) = waker.as_ref() {
+                        let _ = waker.wake();
+                    }
+                } else {
+                    pool.put(buf);
+                }
+
+                if eof {
+                    break;
+                }
+            }
+
+            // The queue is closed here so the consumer sees the end once it's woken up
+            drop(out);
+
+            if let Some(waker) = waker.as_ref() {
+                let _ = waker.wake();
+            }
+        })
+        .expect("!thread");
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::AtomicUsize;
+
+    /// Numbered chunk of 1000 bytes
+    fn chunk(i: usize) -> Vec<u8> {
+        let mut chunk = format!("chunk {} ", i).into_bytes();
+        chunk.resize(1000, b'.');
+        chunk
+    }
+
+    fn received(rx: &OutputReceiver) -> Vec<u8> {
+        let mut data = Vec::new();
+        while let Ok(chunk) = rx.try_recv() {
+            data.extend_from_slice(&chunk);
+        }
+        data
+    }
+
+    #[test]
+    fn spilled_output_keeps_its_order() {
+        let (tx, rx) = output_queue(OverflowPolicy::Spill, Arc::new(BufferPool::default()));
+        let count = 3 * MAX_QUEUED_CHUNKS;
+        let mut expected = Vec::new();
+
+        for i in 0..count {
+            expected.extend_from_slice(&chunk(i));
+            assert!(tx.send(chunk(i)));
+        }
+
+        let status = rx.status();
+        assert_eq!(status.chunks, MAX_QUEUED_CHUNKS);
+        assert_eq!(
+            status.spilled_bytes,
+            ((count - MAX_QUEUED_CHUNKS) * 1000) as u64
+        );
+
+        // Output that arrives while the spill file is read back (in pieces of up to
+        // `CHUNK_CAPACITY`) has to go after it
+        let mut data: Vec<u8> = (0..MAX_QUEUED_CHUNKS + 1)
+            .flat_map(|_| rx.try_recv().unwrap())
+            .collect();
+        assert!(data.len() < count * 1000);
+
+        for i in count..count + 10 {
+            expected.extend_from_slice(&chunk(i));
+            assert!(tx.send(chunk(i)));
+        }
+
+        drop(tx);
+        data.extend_from_slice(&received(&rx));
+        assert!(data == expected);
+        assert_eq!(rx.try_recv(), Err(TryRecvError::Disconnected));
+        assert_eq!(rx.status().dropped_bytes, 0);
+    }
+
+    #[test]
+    fn dropped_output_is_counted() {
+        let (tx, rx) = output_queue(OverflowPolicy::Drop, Arc::new(BufferPool::default()));
+
+        for i in 0..MAX_QUEUED_CHUNKS + 10 {
+            assert!(tx.send(vec![i as u8; 100]));
+        }
+
+        let status = rx.status();
+        assert_eq!(status.chunks, MAX_QUEUED_CHUNKS);
+        assert_eq!(status.bytes, MAX_QUEUED_CHUNKS * 100);
+        assert_eq!(status.dropped_bytes, 10 * 100);
+        assert_eq!(status.spilled_bytes, 0);
+
+        // What fit in the queue is kept, the newest output is what gets dropped
+        for i in 0..MAX_QUEUED_CHUNKS {
+            assert_eq!(rx.try_recv().unwrap(), vec![i as u8; 100]);
+        }
+
+        // There is room again once the queue has been drained
+        assert!(tx.send(vec![1; 10]));
+        assert_eq!(rx.try_recv().unwrap(), vec![1; 10]);
+        assert_eq!(rx.status().dropped_bytes, 10 * 100);
+    }
+
+    #[test]
+    fn blocking_policy_applies_backpressure() {
+        let (tx, rx) = output_queue(OverflowPolicy::Block, Arc::new(BufferPool::default()));
+        let sent = Arc::new(AtomicUsize::new(0));
+        let count = 2 * MAX_QUEUED_CHUNKS;
+
+        let sender = {
+            let sent = sent.clone();
+            thread::spawn(move || {
+                for i in 0..count {
+                    assert!(tx.send(chunk(i)));
+                    sent.fetch_add(1, Ordering::SeqCst);
+                }
+            })
+        };
+
+        while sent.load(Ordering::SeqCst) < MAX_QUEUED_CHUNKS {
+            thread::sleep(Duration::from_millis(1));
+        }
+
+        // The sender is held back instead of the queue growing
+        thread::sleep(Duration::from_millis(50));
+        assert_eq!(sent.load(Ordering::SeqCst), MAX_QUEUED_CHUNKS);
+        assert_eq!(rx.status().chunks, MAX_QUEUED_CHUNKS);
+
+        for i in 0..count {
+            assert_eq!(rx.recv().unwrap(), chunk(i));
+        }
+
+        sender.join().unwrap();
+        assert_eq!(rx.recv(), None);
+
+        let status = rx.status();
+        assert_eq!((status.dropped_bytes, status.spilled_bytes), (0, 0));
+    }
+
+    #[test]
+    fn blocked_sender_is_released_when_the_receiver_goes_away() {
+        let (tx, rx) = output_queue(OverflowPolicy::Block, Arc::new(BufferPool::default()));
+
+        for i in 0..MAX_QUEUED_CHUNKS {
+            assert!(tx.send(chunk(i)));
+        }
+
+        let sender = thread::spawn(move || tx.send(chunk(0)));
+        thread::sleep(Duration::from_millis(20));
+        drop(rx);
+
+        assert!(!sender.join().unwrap());
+    }
+}
@@ -1,33 +1,475 @@
-use crate::message_stream::{MessageStream, TransitionToRead};
+use crate::delta;
+use crate::exe_cache::{hash_to_string, CachedExecutable, ExecutableCache, Hash};
+use crate::file_server::{FileServer, FILE_SERVER_ENV};
+use crate::launch_queue::{LaunchQueue, LaunchSlot};
+use crate::launcher::{self, LaunchedChild, Launcher};
+use crate::message_stream::{
+    is_disconnect, set_buffer_sizes, set_keepalive, wait_for_events, ConnectionClosed,
+    MessageStream,
+};
 use crate::messages;
 use crate::messages::*;
+use crate::metrics::{self, METRICS};
 use crate::options::*;
+use crate::output_pipe::{self, BufferPool, OutputReceiver, OverflowPolicy};
+use crate::spool::Spool;
 use anyhow::*;
 use core::result::Result::Ok;
-use log::{trace, error, info};
+use log::{error, info, trace};
+use mio::{net::TcpStream, Events, Interest, Poll, Registry, Token, Waker};
+use serde::ser::Serialize;
+use sha2::{Digest, Sha256};
 use std::{
+    collections::{BTreeMap, HashMap, VecDeque},
     fs::File,
     io::{Read, Write},
-    net::{TcpListener, TcpStream},
-    os::unix::fs::PermissionsExt,
-    process::{Child, Command, Stdio},
-    sync::mpsc::{Receiver, Sender, channel},
+    net::TcpListener,
+    os::unix::fs::{FileExt, PermissionsExt},
+    os::unix::io::{AsRawFd, FromRawFd, OwnedFd},
+    os::unix::process::{CommandExt, ExitStatusExt},
+    path::{Path, PathBuf},
+    process::{Child, Command, ExitStatus, Stdio},
+    sync::atomic::{AtomicU64, Ordering},
+    sync::mpsc::{channel, Receiver, Sender, TryRecvError},
+    sync::{Arc, Mutex},
     thread,
+    time::{Duration, Instant},
 };
 
-type IoOut = Receiver<Vec<u8>>;
+type IoOut = OutputReceiver;
+
+const SOCKET: Token = Token(0);
+const WAKER: Token = Token(1);
+
+/// Max amount of output that is packed into a single StdoutOutput message
+const MAX_OUTPUT_BATCH: usize = 1024 * 1024;
+
+/// Samples per second taken by `perf record` when profiling
+const PROFILE_FREQUENCY: u32 = 999;
+
+/// Max number of uploads dropped by the runner that are remembered so data the host still
+/// sends for them can be ignored
+const MAX_DROPPED_UPLOADS: usize = 256;
+
+/// Used to give each connection (session) its own id
+static SESSION_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// State shared between all sessions on the runner
+#[derive(Clone)]
+struct Shared {
+    /// Executables uploaded to this runner
+    cache: Arc<Mutex<ExecutableCache>>,
+    /// Limits how many executables that can run at once
+    launch_queue: Arc<LaunchQueue>,
+    /// What to do with output when the host doesn't keep up
+    output_policy: OverflowPolicy,
+    /// Starts the executables if the runner was started with --launcher
+    launcher: Option<Arc<Launcher>>,
+    /// How long a session waits for the host to reattach after the connection was lost
+    reattach_timeout: Duration,
+    /// Size of the spool of each session in bytes
+    spool_size: u64,
+    /// Sessions waiting for the host to reattach, a new connection for the session is handed
+    /// over on the channel
+    detached: Arc<Mutex<HashMap<u64, (Sender<Reattach>, Arc<Waker>)>>>,
+}
+
+/// Connection taken over by a session that was waiting for its host to reattach
+struct Reattach {
+    stream: TcpStream,
+    /// Has done the handshake of the new connection
+    msg_stream: MessageStream,
+    /// Where the host wants the spooled messages from
+    offset: u64,
+}
+
+/// What ended the handling of a connection
+enum Served {
+    /// The host stopped the session
+    Stopped,
+    /// The host asked for the connection to be handed over to a detached session
+    Reattach(ReattachRequest),
+}
+
+/// Stands in for the socket while a session waits for its host to reattach. What is written
+/// is dropped (the messages the host needs are in the spool) and there is never anything to read.
+struct Detached;
+
+impl Read for Detached {
+    fn read(&mut self, _buf: &mut [u8]) -> std::io::Result<usize> {
+        Err(std::io::ErrorKind::WouldBlock.into())
+    }
+}
+
+impl Write for Detached {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+}
 
+/// What a session has used of the runner, logged when the session ends
 #[derive(Default)]
-struct Context {
-    /// Used for tracking running executable.
+struct SessionStats {
+    /// Bytes of executables written to the cache (including copied blocks)
+    uploaded: u64,
+    /// Bytes of output sent to the host
+    output: u64,
+    /// Bytes of output that were dropped or spilled to disk as the host didn't keep up
+    dropped_output: u64,
+    spilled_output: u64,
+    launches: u32,
+    /// Time spent waiting for a free launch slot
+    queued: Duration,
+    /// Time executables have been running
+    running: Duration,
+}
+
+/// How input from the host reaches an interactive executable
+#[derive(Clone, Copy, PartialEq, Debug)]
+enum InputMode {
+    /// Stdin is a pipe
+    Pipe,
+    /// Stdin, stdout and stderr are a pseudo terminal
+    Pty,
+}
+
+/// How the host asked for an executable to be run, kept until it's started
+#[derive(Default, Debug)]
+struct LaunchSettings {
+    /// Set for interactive executables
+    input: Option<InputMode>,
+    /// Run the executable under `perf record`
+    profile: bool,
+    process: ProcessSettings,
+}
+
+/// Profile of an executable written by `perf record`, sent to the host after the output once
+/// the executable has exited. The file is removed when dropped.
+struct Profile {
+    path: PathBuf,
+    /// Opened once the executable has exited
+    file: Option<File>,
+    /// How much has been sent
+    offset: u64,
+}
+
+impl Profile {
+    /// Sends what the stream has room for, returns true once all of the profile has been sent
+    fn send<S: Write + Read>(
+        &mut self,
+        id: u32,
+        pool: &BufferPool,
+        mut spool: Option<&mut Spool>,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<bool> {
+        let file = match self.file.as_ref() {
+            Some(file) => file,
+            None => match File::open(&self.path) {
+                Ok(file) => self.file.insert(file),
+                Err(err) => {
+                    error!("No profile from executable {}: {}", id, err);
+                    return Ok(true);
+                }
+            },
+        };
+
+        while msg_stream.queued_bytes() < MAX_OUTPUT_BATCH {
+            let mut buffer = pool.get();
+            let size = output_pipe::read_spare(
+                file.as_raw_fd(),
+                &mut buffer,
+                output_pipe::CHUNK_CAPACITY,
+                Some(self.offset),
+            )?;
+
+            if size == 0 {
+                pool.put(buffer);
+                return Ok(true);
+            }
+
+            self.offset += size as u64;
+
+            send_spooled(
+                spool.as_deref_mut(),
+                msg_stream,
+                stream,
+                Some(id),
+                &id,
+                vec![buffer],
+                Messages::ProfileData,
+            )?;
+        }
+
+        Ok(false)
+    }
+}
+
+impl Drop for Profile {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.path);
+    }
+}
+
+/// Executable started directly by the runner or by the launcher process
+enum ChildProcess {
+    Direct(Child),
+    Launched(LaunchedChild),
+}
+
+impl ChildProcess {
+    fn id(&self) -> u32 {
+        match self {
+            ChildProcess::Direct(child) => child.id(),
+            ChildProcess::Launched(child) => child.id(),
+        }
+    }
+
+    fn kill(&mut self) -> std::io::Result<()> {
+        match self {
+            ChildProcess::Direct(child) => child.kill(),
+            ChildProcess::Launched(child) => child.kill(),
+        }
+    }
+
+    /// Sends `signal` to the process. Direct children are only reaped by us so the pid can't
+    /// have been reused while the exit status isn't known.
+    fn signal(&mut self, signal: libc::c_int) -> std::io::Result<()> {
+        match self {
+            ChildProcess::Direct(child) => {
+                if unsafe { libc::kill(child.id() as libc::pid_t, signal) } < 0 {
+                    return Err(std::io::Error::last_os_error());
+                }
+                Ok(())
+            }
+            ChildProcess::Launched(child) => child.signal(signal),
+        }
+    }
+
+    /// Exit status and resource usage if it has exited
+    fn try_wait(&mut self) -> Result<Option<(ExitStatus, ResourceUsage)>> {
+        match self {
+            ChildProcess::Direct(child) => try_reap(child.id()),
+            ChildProcess::Launched(child) => Ok(child.try_wait()),
+        }
+    }
+
+    /// Kills the process and reaps it unless it's reaped by the launcher
+    fn kill_and_wait(&mut self) {
+        match self {
+            ChildProcess::Direct(child) => {
+                let _ = child.kill();
+                let _ = child.wait();
+            }
+            ChildProcess::Launched(child) => {
+                let _ = child.kill();
+            }
+        }
+    }
+}
+
+/// Executable launched by the host, identified by the id given in the LaunchExecutableRequest
+struct Process {
+    child: ChildProcess,
+    /// Output of the executable, set to None once the stream has ended and everything has
+    /// been sent
     stdout: Option<IoOut>,
-    /// Used for tracking running executable.
     stderr: Option<IoOut>,
-    /// Used for tracking running executable.
-    proc: Option<Child>,
+    /// Input from the host is written to stdin from a thread of its own, dropped to close it
+    stdin: Option<Sender<Vec<u8>>>,
+    /// Held while the executable is running
+    slot: Option<LaunchSlot>,
+    started: Instant,
+    /// Set until the first output of the executable has been sent
+    waiting_for_output: Option<Instant>,
+    /// Set when the executable has exited and been reaped
+    exit_status: Option<ExitStatus>,
+    wall_time: Duration,
+    usage: ResourceUsage,
+    /// Set when the executable has been sent SIGTERM, it's killed if it's still running then
+    kill_at: Option<Instant>,
+    /// Set if the executable is run under `perf record`
+    profile: Option<Profile>,
+    /// Keeps a memfd executable open while it runs, an interpreter opens a script by its path
+    /// only after it has been executed
+    _executable: CachedExecutable,
+}
+
+impl Process {
+    /// Asks the executable to exit with SIGTERM and kills it if it hasn't after `grace`, or
+    /// directly if `grace` is zero
+    fn stop(&mut self, grace: Duration) -> Result<()> {
+        if self.exit_status.is_some() {
+            return Ok(());
+        }
+
+        if grace.is_zero() {
+            self.kill()?;
+        } else if self.kill_at.is_none() {
+            self.signal(libc::SIGTERM)?;
+            self.kill_at = Some(Instant::now() + grace);
+        }
+
+        Ok(())
+    }
+
+    /// Pid of the executable when it's run under `perf record`, the only child of perf once
+    /// perf has started it
+    fn profiled_pid(&self) -> Option<libc::pid_t> {
+        self.profile.as_ref()?;
+
+        let pid = self.child.id();
+        let children = std::fs::read_to_string(format!("/proc/{}/task/{}/children", pid, pid));
+        children.ok()?.split_whitespace().next()?.parse().ok()
+    }
+
+    /// Sends `signal` to the executable. Under `perf record` it goes to the executable itself
+    /// so perf gets to write the profile even when the executable is killed, or to perf if it
+    /// hasn't started the executable yet.
+    fn signal(&mut self, signal: libc::c_int) -> std::io::Result<()> {
+        match self.profiled_pid() {
+            Some(pid) => {
+                if unsafe { libc::kill(pid, signal) } < 0 {
+                    return Err(std::io::Error::last_os_error());
+                }
+                Ok(())
+            }
+            None => self.child.signal(signal),
+        }
+    }
+
+    fn kill(&mut self) -> std::io::Result<()> {
+        match self.profile {
+            Some(_) => self.signal(libc::SIGKILL),
+            None => self.child.kill(),
+        }
+    }
+}
+
+struct Context {
+    session: u64,
+    /// Executables launched in this session that hasn't been reported as exited yet
+    procs: BTreeMap<u32, Process>,
+    /// Output buffers shared with the pipe readers
+    output_pool: Arc<BufferPool>,
+    /// Wakes up the event loop when there is new output, an executable has exited or a launch
+    /// slot is free
+    waker: Arc<Waker>,
+    /// Executables being uploaded
+    uploads: HashMap<u32, Upload>,
+    /// Uploads the runner has dropped without the host asking for it (oldest first), the host
+    /// may still be sending them until it sees that the launch is done
+    dropped_uploads: VecDeque<u32>,
+    /// When the LaunchExecutableRequest was received for launches that hasn't started yet
+    requested: HashMap<u32, Instant>,
+    /// How the launches that hasn't started yet should be run
+    settings: HashMap<u32, LaunchSettings>,
+    /// Executables uploaded to this runner (shared between all connections)
+    cache: Arc<Mutex<ExecutableCache>>,
+    launch_queue: Arc<LaunchQueue>,
+    output_policy: OverflowPolicy,
+    launcher: Option<Arc<Launcher>>,
+    /// Executables waiting for a launch slot and when they started waiting
+    queued_launches: VecDeque<(u32, CachedExecutable, Instant)>,
+    stats: SessionStats,
+    /// Serves files from the host to the executables if the host asked for it
+    file_server: Option<FileServer>,
+    /// Used for registering file server connections with the event loop
+    registry: Registry,
+    /// Launch replies, output and exits sent to the host, kept for when it reattaches. None if
+    /// the runner doesn't wait for hosts to reattach, such sessions are never detached so a
+    /// ReattachRequest for them is told that they are gone.
+    spool: Option<Spool>,
+    /// Set when the host asks for this connection to be handed over to another session
+    reattach: Option<ReattachRequest>,
+    /// Set when the host has asked to stop all executables, it gets the reply once all of
+    /// them has exited and their output has been sent
+    stop_requested: bool,
+}
+
+/// Executable that is being streamed to disk as it arrives
+struct Upload {
+    file: File,
+    /// Where the executable is written until it's moved into the cache
+    partial_path: PathBuf,
+    /// Hash given by the host, the data is verified against it
+    hash: Hash,
+    hasher: Sha256,
+    /// Size of the executable as given in the LaunchExecutableRequest
+    size: u64,
+    /// Number of bytes written so far
+    received: u64,
+    /// Path of the executable on the host
+    host_path: String,
+    /// Previous version of the executable that blocks are copied from in delta uploads
+    previous: Option<File>,
+    /// Block size of the signature sent for `previous`
+    block_size: u64,
+    /// Used when copying blocks from `previous`
+    copy_buffer: Vec<u8>,
+}
+
+impl Upload {
+    fn write(&mut self, data: &[u8]) -> Result<()> {
+        self.file.write_all(data)?;
+        self.hasher.update(data);
+        self.received += data.len() as u64;
+        Ok(())
+    }
+
+    /// Copies unchanged blocks from the previous version of the executable
+    fn copy_blocks(&mut self, block: u32, count: u32) -> Result<()> {
+        let previous = self
+            .previous
+            .take()
+            .ok_or_else(|| anyhow!("ExecutableUploadCopy without previous executable"))?;
+
+        let mut buffer = std::mem::take(&mut self.copy_buffer);
+        buffer.resize(self.block_size as usize, 0);
+
+        let result = (block as u64..block as u64 + count as u64).try_for_each(|b| {
+            previous.read_exact_at(&mut buffer, b * self.block_size)?;
+            self.write(&buffer)
+        });
+
+        self.copy_buffer = buffer;
+        self.previous = Some(previous);
+
+        result
+    }
 }
 
 impl Context {
+    fn new(session: u64, shared: &Shared, waker: Arc<Waker>, registry: Registry) -> Context {
+        METRICS.sessions.fetch_add(1, Ordering::Relaxed);
+
+        Context {
+            session,
+            procs: BTreeMap::new(),
+            output_pool: Arc::new(BufferPool::default()),
+            waker,
+            uploads: HashMap::new(),
+            dropped_uploads: VecDeque::new(),
+            requested: HashMap::new(),
+            settings: HashMap::new(),
+            cache: shared.cache.clone(),
+            launch_queue: shared.launch_queue.clone(),
+            output_policy: shared.output_policy,
+            launcher: shared.launcher.clone(),
+            queued_launches: VecDeque::new(),
+            stats: SessionStats::default(),
+            file_server: None,
+            registry,
+            spool: (!shared.reattach_timeout.is_zero()).then(|| Spool::new(shared.spool_size)),
+            reattach: None,
+            stop_requested: false,
+        }
+    }
+
     /// Handles incoming messages and sends back reply (if needed) if returns false it means we
     /// should exit the update
     pub fn handle_incoming_msg<S: Write + Read>(
@@ -38,81 +480,307 @@ impl Context {
     ) -> Result<bool> {
         match message {
             Messages::HandshakeRequest => {
-                let msg: HandshakeRequest = bincode::deserialize(&msg_stream.data)?;
+                // Check the version first as the rest of request may differ between versions
+                let (version_major, version_minor): (u8, u8) =
+                    bincode::deserialize(msg_stream.data())?;
+
+                // The messages have another layout so nothing else can be understood. The host
+                // gets our version (which every version reads first) so it can tell why.
+                if version_major != messages::REMOTELINK_MAJOR_VERSION {
+                    let reply = HandshakeReply {
+                        version_major: messages::REMOTELINK_MAJOR_VERSION,
+                        version_minor: messages::REMOTELINK_MINOR_VERSION,
+                        compression: 0,
+                        features: 0,
+                        session: self.session,
+                    };
+
+                    msg_stream.begin_write_message(stream, &reply, Messages::HandshakeReply)?;
 
-                if msg.version_major != messages::REMOTELINK_MAJOR_VERSION {
                     return Err(anyhow!(
-                        "Major version miss-match (target {} host {})",
+                        "Major version miss-match (target {} host {}), refusing host",
                         messages::REMOTELINK_MAJOR_VERSION,
-                        msg.version_major
+                        version_major
                     ));
                 }
 
-                if msg.version_minor != messages::REMOTELINK_MINOR_VERSION {
-                    println!("Minor version miss-matching, but continuing");
+                // Minor versions only add to the end of messages so they work together
+                if version_minor != messages::REMOTELINK_MINOR_VERSION {
+                    info!(
+                        "Session {}: host has minor version {} (target {})",
+                        self.session,
+                        version_minor,
+                        messages::REMOTELINK_MINOR_VERSION
+                    );
                 }
 
+                let msg: HandshakeRequest = bincode::deserialize(msg_stream.data())?;
+                let compression = msg.compression & COMPRESSION_ZSTD;
+                let features = msg.features & FEATURE_CHECKSUM;
+
                 let handshake_reply = HandshakeReply {
                     version_major: messages::REMOTELINK_MAJOR_VERSION,
                     version_minor: messages::REMOTELINK_MINOR_VERSION,
+                    compression,
+                    features,
+                    session: self.session,
                 };
 
                 msg_stream.begin_write_message(
                     stream,
                     &handshake_reply,
                     Messages::HandshakeReply,
-                    TransitionToRead::Yes,
                 )?;
+
+                // Everything after the reply may be compressed
+                msg_stream.set_compression(compression != 0);
+                msg_stream.set_checksum(features & FEATURE_CHECKSUM != 0);
             }
 
             Messages::StopExecutableRequest => {
-                trace!("StopExecutableRequest");
+                let msg: StopExecutableRequest = bincode::deserialize(msg_stream.data())?;
+                trace!("StopExecutableRequest {} ms", msg.grace_period_ms);
 
-                if let Some(proc) = self.proc.as_mut() {
-                    proc.kill()?;
+                let grace = Duration::from_millis(msg.grace_period_ms as u64);
+
+                // Launches that hasn't started are cancelled, the running ones get to exit
+                let waiting: Vec<u32> = self
+                    .uploads
+                    .keys()
+                    .copied()
+                    .chain(self.queued_launches.iter().map(|launch| launch.0))
+                    .collect();
+
+                for id in waiting {
+                    self.stop_launch(msg_stream, stream, id, grace)?;
+                }
+
+                for proc in self.procs.values_mut() {
+                    proc.stop(grace)?;
                 }
 
-                let stop_reply = StopExecutableReply::default();
+                // Replied to from the event loop once everything has been sent
+                self.stop_requested = true;
+            }
+
+            Messages::ReattachRequest => {
+                let msg: ReattachRequest = bincode::deserialize(msg_stream.data())?;
+                trace!("ReattachRequest {} from {}", msg.session, msg.offset);
+
+                ensure!(
+                    self.stats.launches == 0 && self.uploads.is_empty(),
+                    "ReattachRequest after launches"
+                );
+
+                self.reattach = Some(msg);
+                return Ok(false);
+            }
 
+            Messages::StatsRequest => {
+                let text = metrics::render(Some(self.launch_queue.status()));
                 msg_stream.begin_write_message(
                     stream,
-                    &stop_reply,
-                    Messages::StopExecutableReply,
-                    TransitionToRead::Yes,
+                    &StatsReply { text: &text },
+                    Messages::StatsReply,
                 )?;
+            }
 
-                return Ok(false);
+            Messages::StopLaunchRequest => {
+                let msg: StopLaunchRequest = bincode::deserialize(msg_stream.data())?;
+                trace!("StopLaunchRequest {}", msg.id);
+                let grace = Duration::from_millis(msg.grace_period_ms as u64);
+                self.stop_launch(msg_stream, stream, msg.id, grace)?;
             }
 
             Messages::LaunchExecutableRequest => {
-                trace!("LaunchExecutableRequest");
-
-                let file: bincode::Result<messages::LaunchExecutableRequest> =
-                    bincode::deserialize(&msg_stream.data);
-
-                match file {
-                    Ok(f) => {
-                        self.start_executable(&f);
-
-                        let exe_launch = LaunchExecutableReply {
-                            launch_status: 0,
-                            error_info: None,
-                        };
-
-                        msg_stream.begin_write_message(
-                            stream,
-                            &exe_launch,
-                            Messages::LaunchExecutableReply,
-                            TransitionToRead::Yes,
-                        )?;
+                let msg: LaunchExecutableRequest = bincode::deserialize(msg_stream.data())?;
+                trace!(
+                    "LaunchExecutableRequest {} {} size {}",
+                    msg.id,
+                    msg.path,
+                    msg.size
+                );
+
+                let (id, hash, size, host_path) = (msg.id, msg.hash, msg.size, msg.path.to_owned());
+                self.requested.insert(id, Instant::now());
+
+                // The id is in use again, so anything for it belongs to this launch
+                self.dropped_uploads.retain(|&dropped| dropped != id);
+
+                let input = match (msg.interactive, msg.pty) {
+                    (_, true) => Some(InputMode::Pty),
+                    (true, false) => Some(InputMode::Pipe),
+                    (false, false) => None,
+                };
+
+                let settings = LaunchSettings {
+                    input,
+                    profile: msg.profile,
+                    process: msg.process,
+                };
+                self.settings.insert(id, settings);
+
+                if msg.file_server && self.file_server.is_none() {
+                    self.file_server = Some(FileServer::new(&self.registry)?);
+                }
+
+                let (cached, previous) = {
+                    let mut cache = self.cache.lock().unwrap();
+                    let cached = cache.lookup(&hash, &host_path);
+                    let previous = match cached {
+                        None if size >= delta::MIN_DELTA_SIZE => cache.lookup_previous(&host_path),
+                        _ => None,
+                    };
+                    (cached, previous)
+                };
+
+                if let Some(exe) = cached {
+                    msg_stream.begin_write_message(
+                        stream,
+                        &ExecutableUploadReply {
+                            id,
+                            cached: true,
+                            signature: None,
+                        },
+                        Messages::ExecutableUploadReply,
+                    )?;
+
+                    // Launch directly without waiting for any data
+                    return self.launch(msg_stream, stream, id, exe).map(|_| true);
+                }
+
+                // Opened here so blocks can be copied from it even if it's evicted meanwhile
+                let mut previous = previous.and_then(|path| File::open(path).ok());
+
+                let signature = match previous.as_mut() {
+                    Some(file) => {
+                        let len = file.metadata()?.len();
+                        Some(delta::signature(file, len)?)
+                    }
+                    None => None,
+                };
+
+                let block_size = signature.as_ref().map_or(0, |s| s.block_size as u64);
+
+                msg_stream.begin_write_message(
+                    stream,
+                    &ExecutableUploadReply {
+                        id,
+                        cached: false,
+                        signature,
+                    },
+                    Messages::ExecutableUploadReply,
+                )?;
+
+                self.begin_upload(id, &hash, size, host_path, previous, block_size)?;
+            }
+
+            Messages::ExecutableUploadChunk => {
+                let msg: TextMessage = bincode::deserialize(msg_stream.data())?;
+
+                // Chunks of different uploads may be interleaved, the header tells which it is
+                ensure!(
+                    msg_stream.stream_id().map_or(true, |id| id == msg.id),
+                    "ExecutableUploadChunk for {} sent on stream {:?}",
+                    msg.id,
+                    msg_stream.stream_id()
+                );
+
+                if self.dropped_uploads.contains(&msg.id) {
+                    return Ok(true);
+                }
+
+                let upload = self
+                    .uploads
+                    .get_mut(&msg.id)
+                    .ok_or_else(|| anyhow!("ExecutableUploadChunk without upload in progress"))?;
+
+                // Written directly so writing to disk overlaps with the rest of the transfer
+                if let Err(err) = upload.write(msg.data) {
+                    return self
+                        .abort_upload(msg_stream, stream, msg.id, err)
+                        .map(|_| true);
+                }
+
+                self.stats.uploaded += msg.data.len() as u64;
+            }
+
+            Messages::ExecutableUploadCopy => {
+                let msg: ExecutableUploadCopy = bincode::deserialize(msg_stream.data())?;
+
+                if self.dropped_uploads.contains(&msg.id) {
+                    return Ok(true);
+                }
+
+                let upload = self
+                    .uploads
+                    .get_mut(&msg.id)
+                    .ok_or_else(|| anyhow!("ExecutableUploadCopy without upload in progress"))?;
+
+                if let Err(err) = upload.copy_blocks(msg.block, msg.count) {
+                    return self
+                        .abort_upload(msg_stream, stream, msg.id, err)
+                        .map(|_| true);
+                }
+
+                self.stats.uploaded += msg.count as u64 * upload.block_size;
+            }
+
+            Messages::ExecutableUploadEnd => {
+                let msg: ExecutableUploadEnd = bincode::deserialize(msg_stream.data())?;
+                trace!("ExecutableUploadEnd {}", msg.id);
+
+                // Nothing more is sent for a dropped upload after its end
+                if let Some(index) = self.dropped_uploads.iter().position(|&id| id == msg.id) {
+                    self.dropped_uploads.remove(index);
+                    return Ok(true);
+                }
+
+                let upload = self
+                    .uploads
+                    .remove(&msg.id)
+                    .ok_or_else(|| anyhow!("ExecutableUploadEnd without upload in progress"))?;
+
+                // A broken upload only fails its own launch, the session carries on
+                let exe = match self.finish_upload(upload) {
+                    Ok(exe) => exe,
+                    Err(err) => {
+                        error!(
+                            "Session {}: upload {} failed: {}",
+                            self.session, msg.id, err
+                        );
+                        return self
+                            .fail_launch(msg_stream, stream, msg.id, &err.to_string())
+                            .map(|_| true);
                     }
+                };
+
+                if let Some(requested) = self.requested.get(&msg.id) {
+                    METRICS.upload_duration.record(requested.elapsed());
+                }
+
+                self.launch(msg_stream, stream, msg.id, exe)?;
+            }
+
+            Messages::StdinInput => {
+                let msg: TextMessage = bincode::deserialize(msg_stream.data())?;
 
-                    Err(e) => {
-                        panic!("{}", e);
+                if let Some(proc) = self.procs.get_mut(&msg.id) {
+                    if msg.data.is_empty() {
+                        proc.stdin = None;
+                    } else if let Some(stdin) = proc.stdin.as_ref() {
+                        // Fails if stdin has been closed by the executable, the input is lost
+                        let _ = stdin.send(msg.data.to_vec());
                     }
                 }
             }
 
+            Messages::OpenHandleReply | Messages::ReadReply => {
+                if let Some(file_server) = self.file_server.as_mut() {
+                    file_server.handle_host_message(msg_stream, stream, message)?;
+                }
+            }
+
             _ => {
                 // if we didn't handle the message switch over to waiting for new data
                 dbg!(message);
@@ -122,117 +790,1502 @@ impl Context {
         Ok(true)
     }
 
-    /// Pipe streams are blocking, we need separate threads to monitor them without blocking the primary thread.
-    fn child_stream_to_vec<R>(mut stream: R, out: Sender<Vec<u8>>)
-    where
-        R: Read + Send + 'static,
-    {
-        thread::Builder::new()
-            .name("child_stream_to_vec".into())
-            .spawn(move || loop {
-                let mut buf = [0u8; 2];
-                match stream.read(&mut buf) {
-                    Err(err) => {
-                        error!("{}] Error reading from stream: {}", line!(), err);
-                        break;
-                    }
-                    Ok(got) => {
-                        if got == 0 {
-                            break;
-                        }
+    /// Drains all pending output from the running executables and sends it using as few
+    /// messages as possible. The executables, and stdout and stderr of each, take turns so a
+    /// chatty stream can't hold back the others. Returns true if any output was sent.
+    fn send_output<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<bool> {
+        let mut sent = false;
+
+        // Keep queuing output while the stream keeps up, the rest stays in the channels
+        while msg_stream.queued_bytes() < MAX_OUTPUT_BATCH {
+            let mut size = 0;
 
-                        let mut vec = Vec::with_capacity(got);
-                        vec.extend_from_slice(&buf[..got]);
-                        // TODO: Fix this
-                        let _ = out.send(vec);
+            for (id, proc) in self.procs.iter_mut() {
+                let sent = Self::send_output_batch(
+                    *id,
+                    &mut proc.stdout,
+                    msg_stream,
+                    stream,
+                    Messages::StdoutOutput,
+                    &mut self.stats,
+                    self.spool.as_mut(),
+                )? + Self::send_output_batch(
+                    *id,
+                    &mut proc.stderr,
+                    msg_stream,
+                    stream,
+                    Messages::StderrOutput,
+                    &mut self.stats,
+                    self.spool.as_mut(),
+                )?;
+
+                if sent > 0 {
+                    if let Some(started) = proc.waiting_for_output.take() {
+                        METRICS.first_output.record(started.elapsed());
                     }
                 }
-            })
-            .expect("!thread");
+
+                size += sent;
+            }
+
+            if size == 0 {
+                break;
+            }
+
+            self.stats.output += size as u64;
+            sent = true;
+        }
+
+        if msg_stream.queued_bytes() >= MAX_OUTPUT_BATCH {
+            for (id, proc) in self.procs.iter() {
+                if let Some(rx) = proc.stdout.as_ref() {
+                    let status = rx.status();
+                    trace!(
+                        "Socket backed up, executable {} has {} chunks ({} bytes) of output queued",
+                        id,
+                        status.chunks,
+                        status.bytes
+                    );
+                }
+            }
+        }
+
+        Ok(sent)
     }
 
-    fn start_executable(&mut self, f: &messages::LaunchExecutableRequest) {
-        trace!("Want to launch {} size {}", f.path, f.data.len());
+    /// Sends up to `MAX_OUTPUT_BATCH` bytes of pending output from `output` as a single
+    /// message. `output` is cleared once the stream has ended and all of it has been sent.
+    /// Returns the number of bytes sent.
+    fn send_output_batch<S: Write + Read>(
+        id: u32,
+        output: &mut Option<IoOut>,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        msg_type: Messages,
+        stats: &mut SessionStats,
+        spool: Option<&mut Spool>,
+    ) -> Result<usize> {
+        let rx = match output.as_ref() {
+            Some(rx) => rx,
+            None => return Ok(0),
+        };
+
+        let mut chunks = Vec::new();
+        let mut size = 0;
+
+        while size < MAX_OUTPUT_BATCH {
+            match rx.try_recv() {
+                Ok(data) => {
+                    size += data.len();
+                    chunks.push(data);
+                }
+                Err(TryRecvError::Disconnected) => {
+                    let status = rx.status();
+                    if status.dropped_bytes > 0 {
+                        info!(
+                            "Executable {}: {} bytes of {:?} dropped as the host didn't keep up",
+                            id, status.dropped_bytes, msg_type
+                        );
+                    }
 
-        {
-            let mut file = File::create("test").unwrap();
-            file.write_all(f.data).unwrap();
+                    stats.dropped_output += status.dropped_bytes;
+                    stats.spilled_output += status.spilled_bytes;
+                    *output = None;
+                    break;
+                }
+                Err(TryRecvError::Empty) => break,
+            }
         }
 
-        // make exe executable
-        std::fs::set_permissions("test", std::fs::Permissions::from_mode(0o700)).unwrap();
+        if chunks.is_empty() {
+            return Ok(0);
+        }
+
+        // Chunks are sent as the TextMessage data straight from the pipe buffers and given back
+        // to the pool once written
+        send_spooled(spool, msg_stream, stream, Some(id), &id, chunks, msg_type)?;
+
+        Ok(size)
+    }
 
-        let mut p = Command::new("./test")
-            .stderr(Stdio::piped())
-            .stdout(Stdio::piped())
-            .spawn()
-            .expect("failed to execute child");
+    /// Starts receiving an executable, the data follows in ExecutableUploadChunk messages
+    fn begin_upload(
+        &mut self,
+        id: u32,
+        hash: &Hash,
+        size: u64,
+        host_path: String,
+        previous: Option<File>,
+        block_size: u64,
+    ) -> Result<()> {
+        let partial_path = self.cache.lock().unwrap().partial_path(hash)?;
 
-        let (stdout_tx, stdout_rx) = channel();
-        let (stderr_tx, stderr_rx) = channel();
+        let upload = Upload {
+            file: File::create(&partial_path)?,
+            partial_path,
+            hash: *hash,
+            hasher: Sha256::new(),
+            size,
+            received: 0,
+            host_path,
+            previous,
+            block_size,
+            copy_buffer: Vec::new(),
+        };
 
-        Self::child_stream_to_vec(p.stdout.take().expect("!stdout"), stdout_tx);
-        Self::child_stream_to_vec(p.stderr.take().expect("!stderr"), stderr_tx);
+        self.uploads.insert(id, upload);
 
-        self.stdout = Some(stdout_rx); 
-        self.stderr = Some(stderr_rx); 
-        self.proc = Some(p);
+        Ok(())
     }
-}
 
-fn handle_client(stream: &mut TcpStream) -> Result<()> {
-    info!("Incoming connection from: {}", stream.peer_addr()?);
+    /// Completes `upload`, verifies it against the size and hash given by the host, makes the
+    /// file executable and moves it into the cache. Returns the executable.
+    fn finish_upload(&mut self, upload: Upload) -> Result<CachedExecutable> {
+        drop(upload.file);
 
-    stream.set_nonblocking(true)?;
+        if upload.received != upload.size {
+            self.cache
+                .lock()
+                .unwrap()
+                .remove_partial(&upload.partial_path);
+            bail!(
+                "Executable upload incomplete ({} of {} bytes)",
+                upload.received,
+                upload.size
+            );
+        }
 
-    let mut msg_stream = MessageStream::new();
+        let hash: Hash = upload.hasher.finalize().into();
 
-    msg_stream.begin_read(stream, false)?;
+        if hash != upload.hash {
+            self.cache
+                .lock()
+                .unwrap()
+                .remove_partial(&upload.partial_path);
+            bail!(
+                "Executable upload hash miss-match (expected {} got {})",
+                hash_to_string(&upload.hash),
+                hash_to_string(&hash)
+            );
+        }
 
-    // Setup a context so we can keep track of a running process and such
-    let mut context = Context::default();
+        // make exe executable
+        std::fs::set_permissions(&upload.partial_path, std::fs::Permissions::from_mode(0o700))?;
 
-    loop {
-        let msg = msg_stream.update(stream)?;
+        self.cache
+            .lock()
+            .unwrap()
+            .insert(&hash, &upload.partial_path, &upload.host_path)
+    }
 
-        if let Some(msg) = msg {
-            if !context.handle_incoming_msg(&mut msg_stream, stream, msg)? {
-                info!("exit client");
-                return Ok(());
-            }
+    /// Starts the executable (once there is a free launch slot) and replies with the launch
+    /// status
+    fn launch<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        id: u32,
+        exe: CachedExecutable,
+    ) -> Result<()> {
+        // The executable is held until it has exited so a memfd stays open while it's queued
+        self.queued_launches.push_back((id, exe, Instant::now()));
+
+        self.try_launch(msg_stream, stream)?;
+
+        if !self.queued_launches.is_empty() {
+            let (running, waiting) = self.launch_queue.status();
+            info!(
+                "Session {}: launch {} queued ({} running, {} waiting)",
+                self.session, id, running, waiting
+            );
         }
 
-        if let Some(stdout) = context.stdout.as_mut() {
-            if let Ok(data) = stdout.try_recv() {
-                if !data.is_empty() {
-                    let text_message = TextMessage { data: &data };
+        Ok(())
+    }
 
-                    msg_stream.begin_write_message(
-                        stream,
-                        &text_message,
-                        Messages::StdoutOutput,
-                        TransitionToRead::Yes,
-                    )?;
+    /// Starts queued executables while there are free launch slots. Returns true if any was
+    /// started
+    fn try_launch<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<bool> {
+        let mut started = false;
+
+        while !self.queued_launches.is_empty() {
+            let slot = match LaunchQueue::try_acquire(&self.launch_queue, self.session, &self.waker)
+            {
+                Some(slot) => slot,
+                None => break,
+            };
+
+            let (id, exe, queued_at) = self.queued_launches.pop_front().unwrap();
+            let path = exe.path.clone();
+
+            self.stats.queued += queued_at.elapsed();
+            self.stats.launches += 1;
+
+            let settings = self.settings.remove(&id).unwrap_or_default();
+            let result = self.start_executable(exe, slot, settings);
+
+            if let Some(requested) = self.requested.remove(&id) {
+                if result.is_ok() {
+                    METRICS.launch_latency.record(requested.elapsed());
                 }
             }
-        } else {
-            // If there isn't much going on we sleep for 1 ms to not hammer the CPU
-            std::thread::sleep(std::time::Duration::from_millis(1));
-        }
-    }
-}
 
-pub fn update(_opts: &Opt) {
-    let listener = TcpListener::bind("0.0.0.0:8888").expect("Could not bind");
-    info!("Wating incoming host");
-    for stream in listener.incoming() {
+            let error = match result {
+                Ok(proc) => {
+                    self.procs.insert(id, proc);
+                    None
+                }
+                Err(err) => {
+                    error!(
+                        "Session {}: unable to start {:?}: {}",
+                        self.session, path, err
+                    );
+                    Some(err.to_string())
+                }
+            };
+
+            let exe_launch = LaunchExecutableReply {
+                id,
+                launch_status: if error.is_some() { -1 } else { 0 },
+                error_info: error.as_deref(),
+            };
+
+            send_spooled(
+                self.spool.as_mut(),
+                msg_stream,
+                stream,
+                None,
+                &exe_launch,
+                Vec::new(),
+                Messages::LaunchExecutableReply,
+            )?;
+
+            started = true;
+        }
+
+        Ok(started)
+    }
+
+    /// Stops the executable of launch `id` (see `Process::stop`) or cancels it if it hasn't
+    /// been started yet
+    fn stop_launch<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        id: u32,
+        grace: Duration,
+    ) -> Result<()> {
+        if let Some(proc) = self.procs.get_mut(&id) {
+            // ExecutableExited is sent as usual once it has exited
+            return proc.stop(grace);
+        }
+
+        self.requested.remove(&id);
+        self.settings.remove(&id);
+
+        if let Some(upload) = self.uploads.remove(&id) {
+            self.cache
+                .lock()
+                .unwrap()
+                .remove_partial(&upload.partial_path);
+        } else if let Some(index) = self.queued_launches.iter().position(|l| l.0 == id) {
+            self.queued_launches.remove(index);
+        } else {
+            return Ok(());
+        }
+
+        self.send_not_started(msg_stream, stream, id)
+    }
+
+    /// Fails launch `id` when its upload can't be continued (such as when the disk is full),
+    /// the rest of the upload is ignored so only this launch fails and the session carries on
+    fn abort_upload<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        id: u32,
+        err: Error,
+    ) -> Result<()> {
+        error!("Session {}: upload {} failed: {}", self.session, id, err);
+
+        if let Some(upload) = self.uploads.remove(&id) {
+            self.cache
+                .lock()
+                .unwrap()
+                .remove_partial(&upload.partial_path);
+        }
+
+        self.drop_upload(id);
+        self.fail_launch(msg_stream, stream, id, &err.to_string())
+    }
+
+    /// Remembers that the runner has dropped upload `id` so the rest of it is ignored
+    fn drop_upload(&mut self, id: u32) {
+        if self.dropped_uploads.len() == MAX_DROPPED_UPLOADS {
+            self.dropped_uploads.pop_front();
+        }
+
+        self.dropped_uploads.push_back(id);
+    }
+
+    /// Replies to launch `id` with a failed launch status and `error`, and tells the host that
+    /// it's done without having been started
+    fn fail_launch<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        id: u32,
+        error: &str,
+    ) -> Result<()> {
+        self.requested.remove(&id);
+        self.settings.remove(&id);
+
+        let reply = LaunchExecutableReply {
+            id,
+            launch_status: -1,
+            error_info: Some(error),
+        };
+
+        send_spooled(
+            self.spool.as_mut(),
+            msg_stream,
+            stream,
+            None,
+            &reply,
+            Vec::new(),
+            Messages::LaunchExecutableReply,
+        )?;
+
+        self.send_not_started(msg_stream, stream, id)
+    }
+
+    /// Sends ExecutableExited for launch `id` that never started, without exit status or usage
+    fn send_not_started<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        id: u32,
+    ) -> Result<()> {
+        let msg = ExecutableExited {
+            id,
+            exit_code: None,
+            signal: None,
+            wall_time_us: 0,
+            usage: None,
+        };
+
+        send_spooled(
+            self.spool.as_mut(),
+            msg_stream,
+            stream,
+            None,
+            &msg,
+            Vec::new(),
+            Messages::ExecutableExited,
+        )?;
+
+        Ok(())
+    }
+
+    /// Gives back the launch slots of executables that has exited and tells the host about
+    /// them once all of their output has been sent
+    fn check_exits<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<()> {
+        let mut exited = Vec::new();
+
+        for (id, proc) in self.procs.iter_mut() {
+            if proc.exit_status.is_none() {
+                if let Some((status, usage)) = proc.child.try_wait()? {
+                    info!(
+                        "Session {}: executable {} exited ({})",
+                        self.session, id, status
+                    );
+                    proc.exit_status = Some(status);
+                    proc.wall_time = proc.started.elapsed();
+                    proc.usage = usage;
+                    proc.slot = None;
+                    self.stats.running += proc.wall_time;
+                }
+            }
+
+            if proc.exit_status.is_some() && proc.stdout.is_none() && proc.stderr.is_none() {
+                // The profile follows the output
+                let done = match proc.profile.as_mut() {
+                    Some(profile) => profile.send(
+                        *id,
+                        &self.output_pool,
+                        self.spool.as_mut(),
+                        msg_stream,
+                        stream,
+                    )?,
+                    None => true,
+                };
+
+                if done {
+                    exited.push(*id);
+                }
+            }
+        }
+
+        for id in exited {
+            let proc = self.procs.remove(&id).unwrap();
+
+            let msg = ExecutableExited {
+                id,
+                exit_code: proc.exit_status.and_then(|status| status.code()),
+                signal: proc.exit_status.and_then(|status| status.signal()),
+                wall_time_us: proc.wall_time.as_micros() as u64,
+                usage: Some(proc.usage),
+            };
+
+            send_spooled(
+                self.spool.as_mut(),
+                msg_stream,
+                stream,
+                None,
+                &msg,
+                Vec::new(),
+                Messages::ExecutableExited,
+            )?;
+        }
+
+        Ok(())
+    }
+
+    /// Sends output and exits to the host and starts queued executables. Returns true if there
+    /// was anything to do.
+    fn update<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+    ) -> Result<bool> {
+        self.kill_overdue()?;
+
+        let mut progress = self.send_output(msg_stream, stream)?;
+
+        self.check_exits(msg_stream, stream)?;
+
+        if self.try_launch(msg_stream, stream)? {
+            progress = true;
+        }
+
+        if let Some(file_server) = self.file_server.as_mut() {
+            if file_server.update(msg_stream, stream)? {
+                progress = true;
+            }
+        }
+
+        Ok(progress)
+    }
+
+    /// Kills the executables that are still running when their grace period after SIGTERM
+    /// has passed
+    fn kill_overdue(&mut self) -> Result<()> {
+        let now = Instant::now();
+
+        for (id, proc) in self.procs.iter_mut() {
+            match proc.kill_at {
+                Some(kill_at) if kill_at <= now && proc.exit_status.is_none() => {
+                    info!(
+                        "Session {}: executable {} still running after SIGTERM, killing it",
+                        self.session, id
+                    );
+                    proc.kill()?;
+                    proc.kill_at = None;
+                }
+                _ => (),
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Time until the next executable that has been sent SIGTERM is due to be killed
+    fn kill_timeout(&self) -> Option<Duration> {
+        self.procs
+            .values()
+            .filter(|proc| proc.exit_status.is_none())
+            .filter_map(|proc| proc.kill_at)
+            .min()
+            .map(|kill_at| kill_at.saturating_duration_since(Instant::now()))
+    }
+
+    /// True while there are launches that the host hasn't been told have exited
+    fn is_busy(&self) -> bool {
+        !self.procs.is_empty() || !self.queued_launches.is_empty() || !self.uploads.is_empty()
+    }
+
+    /// Keeps the executables running without a connection to the host. Returns the new
+    /// connection if the host reattaches before the reattach timeout has passed.
+    fn detach(
+        &mut self,
+        poll: &mut Poll,
+        events: &mut Events,
+        shared: &Shared,
+    ) -> Result<Option<Reattach>> {
+        let (tx, rx) = channel();
+        shared
+            .detached
+            .lock()
+            .unwrap()
+            .insert(self.session, (tx, self.waker.clone()));
+
+        let result = self.run_detached(poll, events, &rx, shared.reattach_timeout);
+
+        // Connections are handed over with the lock held so none can be left behind here
+        shared.detached.lock().unwrap().remove(&self.session);
+        let late = rx.try_recv().ok();
+
+        Ok(result?.or(late))
+    }
+
+    fn run_detached(
+        &mut self,
+        poll: &mut Poll,
+        events: &mut Events,
+        rx: &Receiver<Reattach>,
+        timeout: Duration,
+    ) -> Result<Option<Reattach>> {
+        let mut msg_stream = MessageStream::new();
+        msg_stream.set_payload_pool(self.output_pool.clone());
+        let mut stream = Detached;
+
+        // Data of uploads may have been lost with the connection so they can't be finished,
+        // the host is told that they were stopped before they started. It may keep sending them
+        // after reattaching until it has seen that.
+        let uploads: Vec<u32> = self.uploads.keys().copied().collect();
+        for id in uploads {
+            self.stop_launch(&mut msg_stream, &mut stream, id, Duration::ZERO)?;
+            self.drop_upload(id);
+        }
+
+        let deadline = Instant::now() + timeout;
+
+        loop {
+            // Output still has to be read so the executables don't block, it ends up in the spool
+            while self.update(&mut msg_stream, &mut stream)? {}
+
+            if let Ok(reattach) = rx.try_recv() {
+                return Ok(Some(reattach));
+            }
+
+            let now = Instant::now();
+            if now >= deadline {
+                return Ok(None);
+            }
+
+            let timeout = match self.kill_timeout() {
+                Some(timeout) => timeout.min(deadline - now),
+                None => deadline - now,
+            };
+
+            wait_for_events(poll, events, Some(timeout))?;
+        }
+    }
+
+    /// Continues the session on the connection of a host that has reattached, and sends the
+    /// spooled messages from `offset` on again
+    fn attach<S: Write + Read>(
+        &mut self,
+        msg_stream: &mut MessageStream,
+        stream: &mut S,
+        offset: u64,
+    ) -> Result<()> {
+        let spool = self
+            .spool
+            .as_mut()
+            .ok_or_else(|| anyhow!("Session {} has no spool to reattach to", self.session))?;
+        let (lost, messages) = spool.replay(offset)?;
+
+        info!(
+            "Session {}: host reattached, sending {} messages again ({} bytes lost)",
+            self.session,
+            messages.len(),
+            lost
+        );
+
+        msg_stream.begin_write_message(
+            stream,
+            &ReattachReply {
+                attached: true,
+                lost,
+            },
+            Messages::ReattachReply,
+        )?;
+
+        for (msg_type, stream_id, data) in messages {
+            msg_stream.begin_write_raw_message(stream, stream_id, &data, msg_type)?;
+        }
+
+        Ok(())
+    }
+
+    fn start_executable(
+        &mut self,
+        exe: CachedExecutable,
+        slot: LaunchSlot,
+        settings: LaunchSettings,
+    ) -> Result<Process> {
+        let path = exe.path.as_path();
+        trace!("Starting {:?} ({:?})", path, settings);
+
+        let LaunchSettings {
+            input,
+            profile,
+            process,
+        } = settings;
+
+        let profile = profile.then(|| Profile {
+            path: output_pipe::temp_path("profile"),
+            file: None,
+            offset: 0,
+        });
+
+        let mut env = process.env.clone();
+
+        if let Some(file_server) = self.file_server.as_ref() {
+            let path = file_server.socket_path().to_string_lossy().into_owned();
+            env.push((FILE_SERVER_ENV.to_owned(), path));
+        }
+
+        // The launcher only handles output, arguments and environment. Interactive and profiled
+        // executables and those that needs a working directory, affinity or nice value are
+        // started directly.
+        let plain = process.cwd.is_none() && process.affinity.is_empty() && process.nice == 0;
+
+        let (child, stdout, stderr, stdin) = match self.launcher.as_ref() {
+            Some(launcher) if input.is_none() && profile.is_none() && plain => {
+                let (stdout, stdout_write) = pipe()?;
+                let (stderr, stderr_write) = pipe()?;
+
+                // The write ends are closed here once the launcher has passed them on
+                let child = launcher.spawn(
+                    path,
+                    process.args,
+                    env,
+                    &stdout_write,
+                    &stderr_write,
+                    self.waker.clone(),
+                )?;
+
+                (ChildProcess::Launched(child), stdout, Some(stderr), None)
+            }
+
+            _ => {
+                let profile = profile.as_ref().map(|p| p.path.as_path());
+                self.spawn_direct(path, &process, &env, input, profile)?
+            }
+        };
+
+        trace!("Started {:?} as pid {}", path, child.id());
+
+        // Interactive output is sent as soon as it's written
+        let coalesce = match input {
+            Some(_) => Duration::ZERO,
+            None => output_pipe::COALESCE_TIMEOUT,
+        };
+
+        let output = |stream: File| {
+            let (tx, rx) = output_pipe::output_queue(self.output_policy, self.output_pool.clone());
+            output_pipe::spawn_reader(
+                stream,
+                self.output_pool.clone(),
+                tx,
+                Some(self.waker.clone()),
+                coalesce,
+            );
+            rx
+        };
+
+        let stdout = output(stdout);
+        let stderr = stderr.map(output);
+
+        Ok(Process {
+            child,
+            stdout: Some(stdout),
+            stderr,
+            stdin: stdin.map(spawn_stdin_writer),
+            slot: Some(slot),
+            started: Instant::now(),
+            waiting_for_output: Some(Instant::now()),
+            exit_status: None,
+            wall_time: Duration::ZERO,
+            usage: ResourceUsage::default(),
+            kill_at: None,
+            profile,
+            _executable: exe,
+        })
+    }
+
+    /// Starts the executable from the runner itself, under `perf record` writing to `profile`
+    /// if set. `env` is added to the environment. Returns the child and its stdout, stderr
+    /// (None when it's in a pseudo terminal as both goes to the terminal) and stdin if `input`
+    /// is set.
+    fn spawn_direct(
+        &self,
+        path: &Path,
+        process: &ProcessSettings,
+        env: &[(String, String)],
+        input: Option<InputMode>,
+        profile: Option<&Path>,
+    ) -> Result<(ChildProcess, File, Option<File>, Option<File>)> {
+        // The cache directory may be relative to the working directory of the runner
+        let path = match process.cwd.is_some() && path.is_relative() {
+            true => std::env::current_dir()?.join(path),
+            false => path.to_owned(),
+        };
+
+        let mut command = match profile {
+            Some(profile) => {
+                let mut command = Command::new("perf");
+                command
+                    .args(["record", "--quiet", "-g", "-F"])
+                    .arg(PROFILE_FREQUENCY.to_string())
+                    .arg("-o")
+                    .arg(profile)
+                    .arg("--")
+                    .arg(&path);
+                command
+            }
+            None => Command::new(&path),
+        };
+
+        command.args(&process.args).envs(env.iter().cloned());
+
+        if let Some(cwd) = process.cwd.as_ref() {
+            command.current_dir(cwd);
+        }
+
+        set_scheduling(&mut command, process)?;
+
+        if input == Some(InputMode::Pty) {
+            let (master, slave) = open_pty()?;
+
+            command
+                .stdin(slave.try_clone()?)
+                .stdout(slave.try_clone()?)
+                .stderr(slave);
+
+            // The terminal becomes the controlling terminal of the executable so line editing
+            // and signals (such as Ctrl-C) work as on a local terminal
+            unsafe {
+                command.pre_exec(|| {
+                    if libc::setsid() < 0 || libc::ioctl(0, libc::TIOCSCTTY, 0) < 0 {
+                        return Err(std::io::Error::last_os_error());
+                    }
+                    Ok(())
+                });
+            }
+
+            let p = spawn(&mut command, profile.is_some())?;
+
+            // Closes the slave ends so the output ends when the executable exits
+            drop(command);
+            wait_for_exit(p.id(), self.waker.clone());
+
+            let stdout = master.try_clone()?;
+            return Ok((ChildProcess::Direct(p), stdout, None, Some(master)));
+        }
+
+        if input == Some(InputMode::Pipe) {
+            command.stdin(Stdio::piped());
+        }
+
+        command.stderr(Stdio::piped()).stdout(Stdio::piped());
+        let mut p = spawn(&mut command, profile.is_some())?;
+
+        wait_for_exit(p.id(), self.waker.clone());
+
+        let stdout = File::from(OwnedFd::from(p.stdout.take().expect("!stdout")));
+        let stderr = File::from(OwnedFd::from(p.stderr.take().expect("!stderr")));
+        let stdin = p.stdin.take().map(|stdin| File::from(OwnedFd::from(stdin)));
+
+        Ok((ChildProcess::Direct(p), stdout, Some(stderr), stdin))
+    }
+}
+
+impl Drop for Context {
+    fn drop(&mut self) {
+        self.launch_queue.cancel(self.session);
+        METRICS.sessions.fetch_sub(1, Ordering::Relaxed);
+
+        // Executables still running when the session ends are killed and reaped so they don't
+        // linger as zombies
+        for proc in self.procs.values_mut() {
+            if proc.exit_status.is_none() {
+                // perf doesn't pass SIGKILL on, the executable would be left running
+                if proc.profile.is_some() {
+                    let _ = proc.signal(libc::SIGKILL);
+                }
+                proc.child.kill_and_wait();
+                self.stats.running += proc.started.elapsed();
+            }
+        }
+
+        let stats = &self.stats;
+        info!(
+            "Session {} ended: {} launches, {} bytes uploaded, {} bytes of output ({} dropped, {} spilled), {:?} queued, {:?} running",
+            self.session, stats.launches, stats.uploaded, stats.output, stats.dropped_output, stats.spilled_output, stats.queued, stats.running
+        );
+    }
+}
+
+/// Reaps the process with `pid` if it has exited and returns its exit status and the resources
+/// it used. Used instead of `Child::try_wait` as it doesn't give the resource usage.
+fn try_reap(pid: u32) -> Result<Option<(ExitStatus, ResourceUsage)>> {
+    let mut status = 0;
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+
+    let res = unsafe { libc::wait4(pid as libc::pid_t, &mut status, libc::WNOHANG, &mut usage) };
+
+    if res == 0 {
+        return Ok(None);
+    }
+
+    if res < 0 {
+        return Err(std::io::Error::last_os_error().into());
+    }
+
+    Ok(Some((
+        ExitStatus::from_raw(status),
+        launcher::resource_usage(&usage),
+    )))
+}
+
+/// Makes `command` run on the CPUs in `process.affinity` (if any) with `process.nice` added to
+/// the nice value of the runner
+fn set_scheduling(command: &mut Command, process: &ProcessSettings) -> Result<()> {
+    let affinity = match process.affinity.is_empty() {
+        true => None,
+        false => {
+            let mut set: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+            for &cpu in &process.affinity {
+                ensure!(
+                    (cpu as usize) < libc::CPU_SETSIZE as usize,
+                    "CPU {} is out of range",
+                    cpu
+                );
+                unsafe { libc::CPU_SET(cpu as usize, &mut set) };
+            }
+            Some(set)
+        }
+    };
+
+    let nice = match process.nice {
+        0 => None,
+        // getpriority can return -1 on success so errno tells if it failed
+        nice => unsafe {
+            *libc::__errno_location() = 0;
+            let current = libc::getpriority(libc::PRIO_PROCESS, 0);
+            if current == -1 && *libc::__errno_location() != 0 {
+                return Err(std::io::Error::last_os_error().into());
+            }
+            Some(current + nice)
+        },
+    };
+
+    if affinity.is_none() && nice.is_none() {
+        return Ok(());
+    }
+
+    // Only async-signal-safe calls between fork and exec
+    unsafe {
+        command.pre_exec(move || {
+            if let Some(set) = affinity.as_ref() {
+                if libc::sched_setaffinity(0, std::mem::size_of_val(set), set) < 0 {
+                    return Err(std::io::Error::last_os_error());
+                }
+            }
+
+            if let Some(nice) = nice {
+                if libc::setpriority(libc::PRIO_PROCESS, 0, nice) < 0 {
+                    return Err(std::io::Error::last_os_error());
+                }
+            }
+
+            Ok(())
+        });
+    }
+
+    Ok(())
+}
+
+/// Spawns `command`, which runs the executable under perf if `profiled` is set
+fn spawn(command: &mut Command, profiled: bool) -> Result<Child> {
+    match command.spawn() {
+        Ok(child) => Ok(child),
+        Err(err) if profiled => bail!("Unable to run perf: {}", err),
+        Err(err) => Err(err.into()),
+    }
+}
+
+/// Opens a pseudo terminal, returns the master and slave ends
+fn open_pty() -> Result<(File, File)> {
+    unsafe {
+        let fd = libc::posix_openpt(libc::O_RDWR | libc::O_NOCTTY | libc::O_CLOEXEC);
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        let master = File::from_raw_fd(fd);
+
+        if libc::grantpt(fd) < 0 || libc::unlockpt(fd) < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        let mut name = [0 as libc::c_char; 128];
+        let res = libc::ptsname_r(fd, name.as_mut_ptr(), name.len());
+        if res != 0 {
+            return Err(std::io::Error::from_raw_os_error(res).into());
+        }
+
+        let slave = libc::open(
+            name.as_ptr(),
+            libc::O_RDWR | libc::O_NOCTTY | libc::O_CLOEXEC,
+        );
+        if slave < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        Ok((master, File::from_raw_fd(slave)))
+    }
+}
+
+/// Writes what is sent on the returned channel to `stdin` of an executable. Writes block until
+/// the executable reads them so they are done on a thread of their own. Dropping the sender
+/// closes stdin.
+fn spawn_stdin_writer(mut stdin: File) -> Sender<Vec<u8>> {
+    let (tx, rx) = channel::<Vec<u8>>();
+
+    thread::Builder::new()
+        .name("stdin_writer".into())
+        .spawn(move || {
+            for data in rx {
+                if stdin.write_all(&data).is_err() {
+                    break;
+                }
+            }
+        })
+        .expect("!thread");
+
+    tx
+}
+
+/// Creates a pipe, returns the read and write ends
+fn pipe() -> Result<(File, File)> {
+    let mut fds = [0; 2];
+
+    if unsafe { libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC) } < 0 {
+        return Err(std::io::Error::last_os_error().into());
+    }
+
+    unsafe { Ok((File::from_raw_fd(fds[0]), File::from_raw_fd(fds[1]))) }
+}
+
+/// Wakes up `waker` when the process with `pid` has exited. The process is left for the owner
+/// of the Child to reap.
+fn wait_for_exit(pid: u32, waker: Arc<Waker>) {
+    thread::Builder::new()
+        .name("exit_waiter".into())
+        .spawn(move || {
+            let mut info: libc::siginfo_t = unsafe { std::mem::zeroed() };
+
+            loop {
+                let res = unsafe {
+                    libc::waitid(
+                        libc::P_PID,
+                        pid as libc::id_t,
+                        &mut info,
+                        libc::WEXITED | libc::WNOWAIT,
+                    )
+                };
+
+                if res == 0
+                    || std::io::Error::last_os_error().kind() != std::io::ErrorKind::Interrupted
+                {
+                    break;
+                }
+            }
+
+            let _ = waker.wake();
+        })
+        .expect("!thread");
+}
+
+fn handle_client(stream: std::net::TcpStream, shared: Shared, session: u64) -> Result<()> {
+    info!(
+        "Session {}: incoming connection from: {}",
+        session,
+        stream.peer_addr()?
+    );
+
+    stream.set_nonblocking(true)?;
+    set_keepalive(&stream)?;
+
+    // Messages are written a whole frame at a time and output is coalesced, so Nagle's
+    // algorithm would only delay the small messages such as replies and exits
+    stream.set_nodelay(true)?;
+
+    let mut stream = TcpStream::from_std(stream);
+    let mut poll = Poll::new()?;
+    let mut events = Events::with_capacity(16);
+
+    poll.registry()
+        .register(&mut stream, SOCKET, Interest::READABLE | Interest::WRITABLE)?;
+
+    // Setup a context so we can keep track of a running process and such
+    let waker = Arc::new(Waker::new(poll.registry(), WAKER)?);
+    let mut context = Context::new(session, &shared, waker, poll.registry().try_clone()?);
+
+    let mut msg_stream = MessageStream::new();
+    msg_stream.set_payload_pool(context.output_pool.clone());
+
+    loop {
+        let error = match serve(
+            &mut context,
+            &mut msg_stream,
+            &mut stream,
+            &mut poll,
+            &mut events,
+        ) {
+            Ok(Served::Stopped) => return Ok(()),
+            Ok(Served::Reattach(request)) => {
+                return hand_over(&shared, request, stream, msg_stream, &mut poll, &mut events)
+            }
+            Err(error) => error,
+        };
+
+        // The executables keep running for a while when the connection is lost so the host
+        // can reconnect and reattach to them
+        if !is_disconnect(&error) || !context.is_busy() || shared.reattach_timeout.is_zero() {
+            return Err(error);
+        }
+
+        info!(
+            "Session {}: connection lost ({}), waiting {:?} for the host to reattach",
+            session, error, shared.reattach_timeout
+        );
+
+        poll.registry().deregister(&mut stream)?;
+
+        let reattach = match context.detach(&mut poll, &mut events, &shared)? {
+            Some(reattach) => reattach,
+            None => {
+                info!(
+                    "Session {}: host didn't reattach, stopping the executables",
+                    session
+                );
+                return Ok(());
+            }
+        };
+
+        stream = reattach.stream;
+        msg_stream = reattach.msg_stream;
+        msg_stream.set_payload_pool(context.output_pool.clone());
+
+        poll.registry()
+            .register(&mut stream, SOCKET, Interest::READABLE | Interest::WRITABLE)?;
+
+        context.attach(&mut msg_stream, &mut stream, reattach.offset)?;
+    }
+}
+
+/// Handles messages from the host and sends it the output of the executables until the host
+/// stops the session
+fn serve(
+    context: &mut Context,
+    msg_stream: &mut MessageStream,
+    stream: &mut TcpStream,
+    poll: &mut Poll,
+    events: &mut Events,
+) -> Result<Served> {
+    loop {
+        // Keep going until neither the socket nor the executable has anything more for us
+        loop {
+            let mut progress = false;
+
+            while let Some(msg) = msg_stream.update(stream)? {
+                if !context.handle_incoming_msg(msg_stream, stream, msg)? {
+                    let request = context.reattach.take().expect("!reattach");
+                    return Ok(Served::Reattach(request));
+                }
+
+                progress = true;
+            }
+
+            if context.update(msg_stream, stream)? {
+                progress = true;
+            }
+
+            if context.stop_requested && !context.is_busy() {
+                info!("exit client");
+                msg_stream.begin_write_message(
+                    stream,
+                    &StopExecutableReply::default(),
+                    Messages::StopExecutableReply,
+                )?;
+
+                // Make sure the reply reaches the host before closing the connection
+                while !msg_stream.flush(stream)? {
+                    wait_for_events(poll, events, None)?;
+                }
+                return Ok(Served::Stopped);
+            }
+
+            if !progress {
+                break;
+            }
+        }
+
+        // Sleep until the socket is ready, there is new output from the executable or one that
+        // was asked to stop is due to be killed
+        wait_for_events(poll, events, context.kill_timeout())?;
+    }
+}
+
+/// Hands the connection over to the detached session that the host wants to reattach to, or
+/// tells the host that it's gone
+fn hand_over(
+    shared: &Shared,
+    request: ReattachRequest,
+    mut stream: TcpStream,
+    mut msg_stream: MessageStream,
+    poll: &mut Poll,
+    events: &mut Events,
+) -> Result<()> {
+    {
+        let detached = shared.detached.lock().unwrap();
+
+        // Sent with the lock held so the session sees it even if it's just giving up
+        if let Some((tx, waker)) = detached.get(&request.session) {
+            poll.registry().deregister(&mut stream)?;
+
+            let reattach = Reattach {
+                stream,
+                msg_stream,
+                offset: request.offset,
+            };
+
+            tx.send(reattach)
+                .map_err(|_| anyhow!("Session {} gone", request.session))?;
+            waker.wake()?;
+            return Ok(());
+        }
+    }
+
+    info!(
+        "Host tried to reattach to session {} which is gone",
+        request.session
+    );
+
+    msg_stream.begin_write_message(
+        &mut stream,
+        &ReattachReply {
+            attached: false,
+            lost: 0,
+        },
+        Messages::ReattachReply,
+    )?;
+
+    while !msg_stream.flush(&mut stream)? {
+        wait_for_events(poll, events, None)?;
+    }
+
+    Ok(())
+}
+
+/// Sends a message that the host has to get even if the connection is lost, it's kept in the
+/// spool (if the session has one) so it can be sent again when the host reattaches
+fn send_spooled<T: Serialize, S: Write + Read>(
+    spool: Option<&mut Spool>,
+    msg_stream: &mut MessageStream,
+    stream: &mut S,
+    stream_id: Option<u32>,
+    head: &T,
+    payload: Vec<Vec<u8>>,
+    msg_type: Messages,
+) -> Result<bool> {
+    if let Some(spool) = spool {
+        spool.add(msg_type, stream_id, head, &payload)?;
+    }
+
+    match stream_id {
+        Some(id) => msg_stream.begin_write_stream_message(stream, id, head, payload, msg_type),
+        None => msg_stream.begin_write_message_with_payload(stream, head, payload, msg_type),
+    }
+}
+
+pub fn update(opts: &Opt) {
+    // Forked first of all, while the runner is still small and has no other threads
+    let launcher = opts
+        .launcher
+        .then(|| Arc::new(Launcher::start().expect("Could not start launcher process")));
+
+    let cache = ExecutableCache::open(
+        opts.storage,
+        Path::new(&opts.cache_dir),
+        opts.cache_size * 1024 * 1024,
+    )
+    .expect("Could not open executable cache");
+    let max_processes = opts
+        .max_processes
+        .unwrap_or_else(|| thread::available_parallelism().map_or(1, |n| n.get()));
+
+    let shared = Shared {
+        cache: Arc::new(Mutex::new(cache)),
+        launch_queue: Arc::new(LaunchQueue::new(max_processes)),
+        output_policy: opts.output_overflow,
+        launcher,
+        reattach_timeout: Duration::from_secs(opts.reattach_timeout),
+        spool_size: opts.spool_size * 1024 * 1024,
+        detached: Arc::new(Mutex::new(HashMap::new())),
+    };
+
+    if let Some(port) = opts.metrics_port {
+        let launch_queue = shared.launch_queue.clone();
+        metrics::serve(port, move || launch_queue.status());
+    }
+
+    let listener = TcpListener::bind(("0.0.0.0", opts.port)).expect("Could not bind");
+
+    // Accepted connections get the buffer sizes of the listener
+    set_buffer_sizes(
+        &listener,
+        opts.send_buffer.map(|kb| kb * 1024),
+        opts.receive_buffer.map(|kb| kb * 1024),
+    )
+    .expect("Could not set socket buffer sizes");
+
+    info!(
+        "Wating incoming host (max {} running executables)",
+        max_processes
+    );
+    for stream in listener.incoming() {
         match stream {
             Err(e) => error!("failed: {}", e),
-            Ok(mut stream) => {
+            Ok(stream) => {
+                let shared = shared.clone();
+                let session = SESSION_COUNTER.fetch_add(1, Ordering::Relaxed);
                 thread::spawn(move || {
-                    handle_client(&mut stream).unwrap_or_else(|error| error!("{:?}", error));
+                    match handle_client(stream, shared, session) {
+                        Ok(()) => (),
+                        // Hosts disconnect when all their executables has exited
+                        Err(error) if error.downcast_ref::<ConnectionClosed>().is_some() => {
+                            info!("Session {}: host disconnected", session)
+                        }
+                        Err(error) => error!("Session {}: {:?}", session, error),
+                    }
                 });
             }
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::exe_cache::Storage;
+
+    /// In-memory connection, the runner reads what the host has written to `input` and its
+    /// replies end up in `output`
+    #[derive(Default)]
+    struct Connection {
+        input: Vec<u8>,
+        pos: usize,
+        output: Vec<u8>,
+    }
+
+    impl Read for Connection {
+        fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+            let size = buf.len().min(self.input.len() - self.pos);
+            if size == 0 && !buf.is_empty() {
+                return Err(std::io::ErrorKind::WouldBlock.into());
+            }
+
+            buf[..size].copy_from_slice(&self.input[self.pos..self.pos + size]);
+            self.pos += size;
+            Ok(size)
+        }
+    }
+
+    impl Write for Connection {
+        fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+            self.output.extend_from_slice(buf);
+            Ok(buf.len())
+        }
+
+        fn flush(&mut self) -> std::io::Result<()> {
+            Ok(())
+        }
+    }
+
+    /// Session of a runner with an in-memory cache, driven by messages from a fake host
+    struct Session {
+        ctx: Context,
+        msg_stream: MessageStream,
+        conn: Connection,
+        host: MessageStream,
+        poll: Poll,
+    }
+
+    impl Session {
+        fn new() -> Session {
+            let cache = ExecutableCache::open(Storage::Memory, Path::new(""), 1 << 20).unwrap();
+            let shared = Shared {
+                cache: Arc::new(Mutex::new(cache)),
+                launch_queue: Arc::new(LaunchQueue::new(1)),
+                output_policy: OverflowPolicy::Block,
+                launcher: None,
+                reattach_timeout: Duration::from_secs(1),
+                spool_size: 1 << 20,
+                detached: Arc::new(Mutex::new(HashMap::new())),
+            };
+
+            let poll = Poll::new().unwrap();
+            let waker = Arc::new(Waker::new(poll.registry(), WAKER).unwrap());
+            let registry = poll.registry().try_clone().unwrap();
+
+            Session {
+                ctx: Context::new(1, &shared, waker, registry),
+                msg_stream: MessageStream::new(),
+                conn: Connection::default(),
+                host: MessageStream::new(),
+                poll,
+            }
+        }
+
+        /// Sends `msg` from the host and lets the runner handle it
+        fn send<T: Serialize>(&mut self, msg: &T, msg_type: Messages) -> Result<bool> {
+            let mut frame = Connection::default();
+            self.host.begin_write_message(&mut frame, msg, msg_type)?;
+            self.conn.input.extend_from_slice(&frame.output);
+
+            let msg_type = self.msg_stream.update(&mut self.conn)?.unwrap();
+            self.ctx
+                .handle_incoming_msg(&mut self.msg_stream, &mut self.conn, msg_type)
+        }
+
+        /// Loses the connection and lets the session run detached until it gives up
+        fn disconnect(&mut self) {
+            let (_tx, rx) = channel();
+            let mut events = Events::with_capacity(16);
+            let reattach = self
+                .ctx
+                .run_detached(&mut self.poll, &mut events, &rx, Duration::ZERO)
+                .unwrap();
+            assert!(reattach.is_none());
+        }
+    }
+
+    fn launch_request(id: u32, data: &[u8]) -> LaunchExecutableRequest<'static> {
+        LaunchExecutableRequest {
+            id,
+            file_server: false,
+            interactive: false,
+            pty: false,
+            profile: false,
+            process: ProcessSettings::default(),
+            path: "test.sh",
+            size: data.len() as u64,
+            hash: Sha256::digest(data).into(),
+        }
+    }
+
+    #[test]
+    fn uploads_lost_with_the_connection_are_ignored_after_it() {
+        let data = b"#!/bin/sh\nexit 0\n";
+        let (head, tail) = data.split_at(8);
+
+        let mut session = Session::new();
+        let chunk = |data| TextMessage { id: 1, data };
+
+        session
+            .send(&launch_request(1, data), Messages::LaunchExecutableRequest)
+            .unwrap();
+        session
+            .send(&chunk(head), Messages::ExecutableUploadChunk)
+            .unwrap();
+
+        // The upload is stopped while detached, the host may not have seen that when it
+        // reattaches and sends the rest of it
+        session.disconnect();
+        assert!(!session.ctx.is_busy());
+
+        session
+            .send(&chunk(tail), Messages::ExecutableUploadChunk)
+            .unwrap();
+        session
+            .send(
+                &ExecutableUploadEnd { id: 1 },
+                Messages::ExecutableUploadEnd,
+            )
+            .unwrap();
+        assert!(session.ctx.dropped_uploads.is_empty());
+
+        // Uploads that the runner doesn't know about are still refused
+        assert!(session
+            .send(&chunk(tail), Messages::ExecutableUploadChunk)
+            .is_err());
+    }
+
+    #[test]
+    fn failed_upload_only_fails_its_launch() {
+        let data = b"#!/bin/sh\nexit 0\n";
+
+        let mut session = Session::new();
+        session
+            .send(&launch_request(1, data), Messages::LaunchExecutableRequest)
+            .unwrap();
+
+        // There is no previous version to copy blocks from
+        let copy = ExecutableUploadCopy {
+            id: 1,
+            block: 0,
+            count: 1,
+        };
+        assert!(session.send(&copy, Messages::ExecutableUploadCopy).unwrap());
+        assert!(!session.ctx.is_busy());
+
+        // The host sends the rest before it sees the failed launch
+        let chunk = TextMessage { id: 1, data };
+        session
+            .send(&chunk, Messages::ExecutableUploadChunk)
+            .unwrap();
+        session
+            .send(
+                &ExecutableUploadEnd { id: 1 },
+                Messages::ExecutableUploadEnd,
+            )
+            .unwrap();
+        assert!(session.ctx.dropped_uploads.is_empty());
+    }
+
+    #[test]
+    fn launches_reusing_a_dropped_id_are_uploaded() {
+        let data = b"#!/bin/sh\nexit 0\n";
+
+        let mut session = Session::new();
+        session
+            .send(&launch_request(1, data), Messages::LaunchExecutableRequest)
+            .unwrap();
+        session.disconnect();
+        assert_eq!(session.ctx.dropped_uploads, [1]);
+
+        session
+            .send(&launch_request(1, data), Messages::LaunchExecutableRequest)
+            .unwrap();
+        assert!(session.ctx.dropped_uploads.is_empty());
+        assert!(session.ctx.uploads.contains_key(&1));
+    }
+}
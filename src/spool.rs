@@ -0,0 +1,324 @@
+use crate::message_stream::serialize_head;
+use crate::messages::Messages;
+use crate::output_pipe;
+use anyhow::*;
+use core::result::Result::Ok;
+use log::error;
+use serde::ser::Serialize;
+use std::{collections::VecDeque, fs::File, os::unix::fs::FileExt};
+
+/// Max number of messages other than output kept, the oldest are dropped beyond this
+const MAX_CONTROL_MESSAGES: usize = 64 * 1024;
+
+/// Output (or profile data) kept in the spool file
+struct Entry {
+    /// Offset of the message, the size of all messages added before it
+    start: u64,
+    size: u64,
+    msg_type: Messages,
+    stream_id: Option<u32>,
+}
+
+/// Message read back from the spool: type, stream id and the serialized message
+pub type SpooledMessage = (Messages, Option<u32>, Vec<u8>);
+
+/// A message other than output, these are small and kept in memory so the host never misses
+/// an exit (and waits for it forever) because of a lot of output
+struct ControlEntry {
+    start: u64,
+    msg_type: Messages,
+    data: Vec<u8>,
+}
+
+/// Ring buffer in a temporary file with the messages of a session that the host must not miss
+/// (launch replies, output and exits), so they can be sent again if the host reattaches after
+/// losing the connection. Messages are kept as serialized and the offset of a message is the
+/// size of all messages added before it, which the host tracks by counting the size of the
+/// same messages as it gets them. Only the last `capacity` bytes of output are kept.
+pub struct Spool {
+    /// Opened when the first message is added
+    file: Option<File>,
+    capacity: u64,
+    /// Size of all messages added so far
+    written: u64,
+    /// Output that is still in the file, oldest first
+    entries: VecDeque<Entry>,
+    /// Other messages, oldest first
+    control: VecDeque<ControlEntry>,
+    /// Reused for serializing messages
+    buffer: Vec<u8>,
+}
+
+impl Spool {
+    pub fn new(capacity: u64) -> Spool {
+        Spool {
+            file: None,
+            capacity,
+            written: 0,
+            entries: VecDeque::new(),
+            control: VecDeque::new(),
+            buffer: Vec::new(),
+        }
+    }
+
+    /// Adds a message the way it's serialized by `begin_write_message_with_payload`. Messages
+    /// that can't be kept (larger than the spool or if writing fails) still move the offset
+    /// so the host finds out that they are lost if it reattaches.
+    pub fn add<T: Serialize>(
+        &mut self,
+        msg_type: Messages,
+        stream_id: Option<u32>,
+        head: &T,
+        payload: &[Vec<u8>],
+    ) -> Result<()> {
+        let mut head_data = std::mem::take(&mut self.buffer);
+        head_data.clear();
+        serialize_head(&mut head_data, head, payload)?;
+
+        let start = self.written;
+        let size = (head_data.len() + payload.iter().map(|p| p.len()).sum::<usize>()) as u64;
+        self.written += size;
+
+        if !matches!(
+            msg_type,
+            Messages::StdoutOutput | Messages::StderrOutput | Messages::ProfileData
+        ) {
+            let mut data = head_data.clone();
+            payload.iter().for_each(|p| data.extend_from_slice(p));
+
+            if self.control.len() == MAX_CONTROL_MESSAGES {
+                self.control.pop_front();
+            }
+
+            self.control.push_back(ControlEntry {
+                start,
+                msg_type,
+                data,
+            });
+        } else if size <= self.capacity {
+            match self.write(start, &head_data, payload) {
+                Ok(()) => self.entries.push_back(Entry {
+                    start,
+                    size,
+                    msg_type,
+                    stream_id,
+                }),
+                Err(err) => error!("Unable to write {:?} to spool: {}", msg_type, err),
+            }
+        }
+
+        // Drop the messages that has been overwritten
+        let oldest = self.written.saturating_sub(self.capacity);
+        while self.entries.front().map_or(false, |e| e.start < oldest) {
+            self.entries.pop_front();
+        }
+
+        self.buffer = head_data;
+        Ok(())
+    }
+
+    fn write(&mut self, start: u64, head: &[u8], payload: &[Vec<u8>]) -> Result<()> {
+        let file = match self.file.as_ref() {
+            Some(file) => file,
+            None => self.file.insert(output_pipe::open_temp_file("spool")?),
+        };
+
+        let mut pos = start;
+        for part in std::iter::once(head).chain(payload.iter().map(|p| &p[..])) {
+            let mut done = 0;
+
+            // Parts may wrap around the end of the file
+            while done < part.len() {
+                let at = (pos + done as u64) % self.capacity;
+                let len = (part.len() - done).min((self.capacity - at) as usize);
+                file.write_all_at(&part[done..done + len], at)?;
+                done += len;
+            }
+
+            pos += part.len() as u64;
+        }
+
+        Ok(())
+    }
+
+    /// Reads back the messages from `offset` on. Returns the number of bytes after `offset`
+    /// that are no longer kept and the messages that are.
+    pub fn replay(&self, offset: u64) -> Result<(u64, Vec<SpooledMessage>)> {
+        ensure!(
+            offset <= self.written,
+            "Reattach from offset {} but only {} bytes has been sent",
+            offset,
+            self.written
+        );
+
+        let first = self.entries.partition_point(|e| e.start < offset);
+        let mut output = self.entries.range(first..).peekable();
+        let first = self.control.partition_point(|e| e.start < offset);
+        let mut control = self.control.range(first..).peekable();
+
+        let mut messages = Vec::new();
+        let mut kept = 0;
+
+        // Output and the other messages are merged back in the order they were added
+        loop {
+            let next_output = output.peek().map(|e| e.start);
+            let next_control = control.peek().map(|e| e.start);
+
+            let from_control = match (next_output, next_control) {
+                (None, None) => break,
+                (Some(o), Some(c)) => c < o,
+                (None, Some(_)) => true,
+                (Some(_), None) => false,
+            };
+
+            let (msg_type, stream_id, data) = match from_control {
+                true => {
+                    let entry = control.next().unwrap();
+                    (entry.msg_type, None, entry.data.clone())
+                }
+                false => {
+                    let entry = output.next().unwrap();
+                    (entry.msg_type, entry.stream_id, self.read(entry)?)
+                }
+            };
+
+            kept += data.len() as u64;
+            messages.push((msg_type, stream_id, data));
+        }
+
+        Ok((self.written - offset - kept, messages))
+    }
+
+    fn read(&self, entry: &Entry) -> Result<Vec<u8>> {
+        let file = self.file.as_ref().expect("!spool file");
+        let mut data = vec![0; entry.size as usize];
+        let mut done = 0;
+
+        while done < data.len() {
+            let at = (entry.start + done as u64) % self.capacity;
+            let len = (data.len() - done).min((self.capacity - at) as usize);
+            file.read_exact_at(&mut data[done..done + len], at)?;
+            done += len;
+        }
+
+        Ok(data)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::messages::{ExecutableExited, TextMessage};
+
+    /// Size of the output messages added by `add_output`
+    const MESSAGE_SIZE: u64 = 130;
+
+    /// Adds stdout message `i` of `MESSAGE_SIZE` bytes
+    fn add_output(spool: &mut Spool, i: u32) {
+        let data = vec![i as u8; 118];
+        let msg = TextMessage { id: i, data: &data };
+        spool
+            .add(Messages::StdoutOutput, Some(i), &msg, &[])
+            .unwrap();
+    }
+
+    fn add_exit(spool: &mut Spool, id: u32) {
+        let msg = ExecutableExited {
+            id,
+            exit_code: Some(0),
+            signal: None,
+            wall_time_us: 0,
+            usage: None,
+        };
+        spool
+            .add(Messages::ExecutableExited, None, &msg, &[])
+            .unwrap();
+    }
+
+    /// Ids of the output messages in `messages`, checking that they came back as added
+    fn output_ids(messages: &[SpooledMessage]) -> Vec<u32> {
+        messages
+            .iter()
+            .filter(|(msg_type, _, _)| *msg_type == Messages::StdoutOutput)
+            .map(|(_, stream_id, data)| {
+                let msg: TextMessage = bincode::deserialize(data).unwrap();
+                assert_eq!(data.len() as u64, MESSAGE_SIZE);
+                assert_eq!(*stream_id, Some(msg.id));
+                assert!(msg.data.iter().all(|b| *b == msg.id as u8));
+                msg.id
+            })
+            .collect()
+    }
+
+    #[test]
+    fn ring_wraps_more_than_once() {
+        let mut spool = Spool::new(1000);
+        for i in 0..50 {
+            add_output(&mut spool, i);
+        }
+
+        // 6500 bytes went through the ring, the last 7 messages (from 5590 on) are still there
+        // and some of them wrap around the end of the file
+        let (lost, messages) = spool.replay(0).unwrap();
+        assert_eq!(output_ids(&messages), (43..50).collect::<Vec<_>>());
+        assert_eq!(lost, 43 * MESSAGE_SIZE);
+
+        let (lost, messages) = spool.replay(50 * MESSAGE_SIZE).unwrap();
+        assert_eq!((lost, messages.len()), (0, 0));
+        assert!(spool.replay(50 * MESSAGE_SIZE + 1).is_err());
+    }
+
+    #[test]
+    fn replay_from_inside_a_message() {
+        let mut spool = Spool::new(1000);
+        for i in 0..50 {
+            add_output(&mut spool, i);
+        }
+
+        // Message 10 was overwritten long ago, everything up to message 43 is lost
+        let offset = 10 * MESSAGE_SIZE + 50;
+        let (lost, messages) = spool.replay(offset).unwrap();
+        assert_eq!(output_ids(&messages), (43..50).collect::<Vec<_>>());
+        assert_eq!(lost, 43 * MESSAGE_SIZE - offset);
+
+        // A message that is cut at the offset can't be sent again, the rest of it is lost
+        let offset = 45 * MESSAGE_SIZE + 10;
+        let (lost, messages) = spool.replay(offset).unwrap();
+        assert_eq!(output_ids(&messages), (46..50).collect::<Vec<_>>());
+        assert_eq!(lost, MESSAGE_SIZE - 10);
+    }
+
+    #[test]
+    fn exits_survive_heavy_output() {
+        let mut spool = Spool::new(1000);
+
+        add_exit(&mut spool, 1000);
+        for i in 0..100 {
+            add_output(&mut spool, i);
+        }
+        add_exit(&mut spool, 1001);
+        for i in 100..110 {
+            add_output(&mut spool, i);
+        }
+
+        let (lost, messages) = spool.replay(0).unwrap();
+        let exits: Vec<u32> = messages
+            .iter()
+            .enumerate()
+            .filter(|(_, (msg_type, _, _))| *msg_type == Messages::ExecutableExited)
+            .map(|(i, (_, stream_id, data))| {
+                let msg: ExecutableExited = bincode::deserialize(data).unwrap();
+                assert_eq!(*stream_id, None);
+                assert_eq!(msg.id as usize, 1000 + i);
+                msg.id
+            })
+            .collect();
+
+        // Both exits are kept in the order they were added, ahead of the newer output
+        assert_eq!(exits, [1000, 1001]);
+        assert_eq!(output_ids(&messages), (103..110).collect::<Vec<_>>());
+
+        let kept: u64 = messages.iter().map(|(_, _, data)| data.len() as u64).sum();
+        assert_eq!(lost + kept, spool.written);
+    }
+}